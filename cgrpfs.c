@@ -5,12 +5,13 @@
 #include <puffs.h>
 #endif
 
-#include <sys/event.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -19,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cgrpfs.h"
@@ -26,9 +28,17 @@
 struct cgdir_nodes {
 	cg_nodetype_t type;
 	const char *name;
+	mode_t mode;
 };
 
-#ifdef CGRPFS_THREADED
+sched_stats_t sched_stats;
+
+/* is a reconciliation already due shortly? */
+static bool reconcilepending;
+/* when the process table was last swept whole */
+static uint64_t lastsweep;
+
+#ifdef CGRPFS_LOCKING
 void
 _unlock_cgmgr_(int *unused)
 {
@@ -37,49 +47,31 @@ _unlock_cgmgr_(int *unused)
 }
 
 static void *
-kqueue_thread(void *unused)
+event_thread(void *unused)
 {
-	struct kevent kev;
+	cg_event_t ev;
+	sigset_t set;
 
 	(void)unused;
 
+	/* signals are for the thread serving the filesystem */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
 	while (true) {
 		int r;
 
-		r = kevent(cgmgr.kq, NULL, 0, &kev, 1, NULL);
+		r = ev_wait(&ev);
 
 		pthread_mutex_lock(&cgmgr.lock);
 
-		if (r < 0 && errno != EINTR)
-			err(EXIT_FAILURE, "kevent failed");
-		else if (r < 0)
-			;
-		else if (r == 0)
-			warn("Got 0 from kevent");
-		else if (kev.filter == EVFILT_READ &&
-			kev.ident == cgmgr.notifyfd)
-			cgmgr_accept();
-		else if (kev.filter == EVFILT_PROC) {
-			if (kev.fflags & NOTE_CHILD) {
-				pid_hash_entry_t *entry;
-				uintptr_t ppidp = kev.data; /* parent pid */
-
-				/* find parent pid's node */
-				HASH_FIND_PTR(cgmgr.pidcg, &ppidp, entry);
-
-				if (!entry)
-					warn("Couldn't find containing CGroup of PID %lld",
-						(long long)kev.data);
-				else
-					attachpid(entry->node, kev.ident);
-			} else if (kev.fflags & NOTE_EXIT)
-				detachpid(kev.ident, kev.data, false);
-			else if (kev.fflags & NOTE_TRACKERR)
-				warn("NOTE_TRACKERR received from Kernel Queue");
-			else if (kev.fflags & NOTE_EXEC)
-				warn("NOTE_EXEC was received");
-		} else
-			assert(!"Unreached");
+		if (r < 0)
+			err(EXIT_FAILURE, "Failed to wait for events");
+		else if (r > 0)
+			cgmgr_event(&ev);
 
 		pthread_mutex_unlock(&cgmgr.lock);
 	}
@@ -87,7 +79,217 @@ kqueue_thread(void *unused)
 	exit(EXIT_FAILURE);
 	return NULL;
 }
-#endif /* CGROUPFS_THREADS */
+
+void
+cgmgr_startevents(void)
+{
+	pthread_t thrd;
+	int r;
+
+	r = pthread_create(&thrd, NULL, event_thread, NULL);
+	if (r != 0)
+		errx(EXIT_FAILURE, "pthread_create failed: %s", strerror(r));
+}
+#endif /* CGRPFS_LOCKING */
+
+/* Is a CGroup frozen, either itself or through an ancestor? */
+static bool
+nodefrozen(cg_node_t *node)
+{
+	for (; node; node = node->parent)
+		if (node->frozen)
+			return true;
+	return false;
+}
+
+/* Find the nearest CGroup, from node upwards, that is being killed. */
+static cg_node_t *
+killingancestor(cg_node_t *node)
+{
+	for (; node; node = node->parent)
+		if (node->killing)
+			return node;
+	return NULL;
+}
+
+/* Signal a PID, unless replaying a trace. */
+static void
+signalpid(pid_t pid, int sig)
+{
+	if (!cgmgr.replaying)
+		kill(pid, sig);
+}
+
+/* Get the monotonic time in milliseconds. */
+static uint64_t
+nowms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Get the real time in milliseconds since the Epoch. */
+static uint64_t
+wallms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Set the reap timer to fire in ms milliseconds. */
+static void
+armreaptimer(uint64_t ms)
+{
+	if (ev_settimer(CGT_REAP, ms) < 0)
+		warn("Failed to set reap timer");
+}
+
+/* Set the reconcile timer to fire in ms milliseconds. */
+static void
+armreconciletimer(uint64_t ms)
+{
+	if (ev_settimer(CGT_RECONCILE, ms) < 0)
+		warn("Failed to set reconcile timer");
+}
+
+/*
+ * Reconcile the PID map shortly, once a burst of missed forks has likely
+ * passed, rather than once for each.
+ */
+static void
+reconcilesoon(void)
+{
+	if (reconcilepending)
+		return;
+
+	reconcilepending = true;
+	armreconciletimer(CGRPFS_RECONCILE_DELAY);
+}
+
+/*
+ * Queue an emptied autoremove CGroup for deletion after the grace period,
+ * which starts afresh each time it empties. The queue stays in order of
+ * deadline, as each is the latest.
+ */
+static void
+reapcg(cg_node_t *node)
+{
+	if (node == cgmgr.rootnode)
+		return;
+
+	if (node->reaping)
+		TAILQ_REMOVE(&cgmgr.reaps, node, reapentries);
+	node->reaping = true;
+	node->reapat = nowms() + CGRPFS_REAP_GRACE;
+	if (TAILQ_EMPTY(&cgmgr.reaps))
+		armreaptimer(CGRPFS_REAP_GRACE);
+	TAILQ_INSERT_TAIL(&cgmgr.reaps, node, reapentries);
+}
+
+/* Could an autoremove CGroup be deleted now? */
+static bool
+reapable(cg_node_t *node)
+{
+	/*
+	 * Not while an instance is mounted within it, nor while it has child
+	 * CGroups, which would be deleted with it.
+	 */
+	return node != cgmgr.rootnode && node->autoremove && !node->todel &&
+		node->nsubpids == 0 && !node->nmounts &&
+		node->ndescendants == 0;
+}
+
+/* Delete the autoremove CGroups which are due and still empty. */
+static void
+reapexpired(void)
+{
+	uint64_t now = nowms();
+	cg_node_t *node, *parent;
+
+	while ((node = TAILQ_FIRST(&cgmgr.reaps)) != NULL &&
+		node->reapat <= now) {
+		TAILQ_REMOVE(&cgmgr.reaps, node, reapentries);
+		node->reaping = false;
+
+		if (!reapable(node))
+			continue;
+
+		parent = node->parent;
+		removenode(node);
+
+		/* a parent passed over for its children is due already */
+		if (!parent->reaping && reapable(parent)) {
+			parent->reaping = true;
+			parent->reapat = now;
+			TAILQ_INSERT_HEAD(&cgmgr.reaps, parent, reapentries);
+		}
+	}
+
+	if (node)
+		armreaptimer(node->reapat - now);
+}
+
+/*
+ * Set which CGroup a PID entry belongs to (NULL if it's being removed),
+ * updating the population counts of the old and new CGroups' ancestries.
+ */
+static void
+setpidnode(pid_hash_entry_t *entry, cg_node_t *node)
+{
+	cg_node_t *n, *old = entry->node;
+
+	/*
+	 * The new ancestry is counted before the old is uncounted, so that the
+	 * ancestors they share, which a move within a subtree leaves populated,
+	 * never seem to empty.
+	 */
+	if (node) {
+		node->npids++;
+		for (n = node; n; n = n->parent)
+			if (n->nsubpids++ == 0 && cgmgr.ncgevsubs)
+				notify_cgevents(n);
+	}
+
+	if (old) {
+		old->npids--;
+		for (n = old; n; n = n->parent) {
+			if (--n->nsubpids != 0)
+				continue;
+			if (n->killing) {
+				/* emptied; the kill is complete */
+				n->killing = false;
+				cgmgr.nkilling--;
+			}
+			if (n->notify && !n->todel)
+				release_enqueue(n);
+			if (n->autoremove && !n->todel)
+				reapcg(n);
+			if (cgmgr.ncgevsubs)
+				notify_cgevents(n);
+		}
+	}
+
+	entry->node = node;
+	shm_setpid(entry->pid, node);
+}
+
+/* Remove a PID entry from the hashtable and free it. */
+static void
+dropentry(pid_hash_entry_t *entry)
+{
+	/* what it used stays counted, as far as it was last sampled */
+	if (entry->node) {
+		entry->node->exitutime += entry->utime;
+		entry->node->exitstime += entry->stime;
+	}
+	setpidnode(entry, NULL);
+	HASH_DEL(cgmgr.pidcg, entry);
+	reserve_freepidentry(entry);
+}
 
 /* add PID to cgmgr hashtable */
 static int
@@ -99,19 +301,23 @@ addpidhash(pid_t pid, cg_node_t *node, pid_hash_entry_t **entryout)
 	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
 
 	if (entry) {
-		entry->node = node;
+		setpidnode(entry, node);
 		*entryout = entry;
 		return 0;
 	}
 
-	entry = malloc(sizeof *entry);
+	entry = reserve_pidentry();
 
 	if (!entry)
 		return -ENOMEM;
 
 	entry->pid = pid;
-	entry->node = node;
+	entry->node = NULL;
+	entry->since = 0;
+	entry->seen = cgmgr.reconcilegen;
+	entry->utime = entry->stime = 0;
 	HASH_ADD_PTR(cgmgr.pidcg, pid, entry);
+	setpidnode(entry, node);
 
 	*entryout = entry;
 
@@ -132,6 +338,21 @@ newnode(cg_node_t *parent, const char *name, cg_nodetype_t type)
 	node->notify = false;
 	node->parent = parent;
 	node->pid = 0;
+	node->id = 0;
+	node->npids = 0;
+	node->nsubpids = 0;
+	node->ndescendants = 0;
+	node->nforks = node->nexits = node->nsigexits = 0;
+	node->killing = false;
+	node->frozen = false;
+	node->pidsmax = -1;
+	node->pidsevents = 0;
+	node->autoremove = false;
+	node->reaping = false;
+	node->attrset = false;
+	node->nmounts = 0;
+	node->utime = node->stime = node->rss = 0;
+	node->exitutime = node->exitstime = 0;
 	node->accessed = false;
 	node->todel = false;
 	LIST_INIT(&node->subnodes);
@@ -152,20 +373,84 @@ movepids(cg_node_t *from, cg_node_t *to)
 {
 	pid_hash_entry_t *entry, *tmp2;
 
+	/* and the CPU time of those that exited, so usage never falls */
+	if (to) {
+		to->exitutime += from->exitutime;
+		to->exitstime += from->exitstime;
+	}
+
 	HASH_ITER(hh, cgmgr.pidcg, entry, tmp2)
 	if (entry->node == from) {
 		if (to)
-			entry->node = to;
+			setpidnode(entry, to);
 		else
 			detachpid(entry->pid, 0, true);
 	}
 }
 
+static int freezecg(cg_node_t *node, bool freeze);
+
+/*
+ * Take a CGroup being unlinked, and its descendants, off its ancestors'
+ * counts. Those above a CGroup already marked for deletion were adjusted then.
+ */
+static void
+unlinkcg(cg_node_t *node)
+{
+	for (cg_node_t *n = node->parent; n && !n->todel; n = n->parent)
+		n->ndescendants -= node->ndescendants + 1;
+}
+
+/*
+ * A CGroup being deleted no longer freezes, kills or limits its PIDs, which
+ * move up to its parent, and is no longer waiting to be reaped.
+ */
+static void
+clearcontrols(cg_node_t *node)
+{
+	freezecg(node, false);
+	if (node->killing) {
+		node->killing = false;
+		cgmgr.nkilling--;
+	}
+	if (node->pidsmax >= 0) {
+		node->pidsmax = -1;
+		cgmgr.nlimited--;
+	}
+	if (node->reaping) {
+		TAILQ_REMOVE(&cgmgr.reaps, node, reapentries);
+		node->reaping = false;
+	}
+}
+
+void
+nodehold(cg_node_t *node)
+{
+	for (; node; node = node->parent)
+		node->accessed++;
+}
+
+void
+noderelease(cg_node_t *node)
+{
+	while (node) {
+		cg_node_t *parent = node->parent;
+
+		if (--node->accessed == 0 && node->todel)
+			delnode(node);
+		node = parent;
+	}
+}
+
 void
 removenode(cg_node_t *node)
 {
 	cg_node_t *val, *tmp;
 
+	if (cgmgr.persisting && node->type == CGN_CG_DIR && !node->todel &&
+		node->parent && !node->parent->todel)
+		persist_rmdir(node);
+
 	if (!node->accessed)
 		return delnode(node);
 	if (node->todel)
@@ -173,6 +458,11 @@ removenode(cg_node_t *node)
 
 	// printf("Marking node %p for deletion\n", node);
 	node->todel = true;
+	if (node->type == CGN_CG_DIR) {
+		unlinkcg(node);
+		shm_delcg(node);
+		clearcontrols(node);
+	}
 
 	LIST_FOREACH_SAFE (val, &node->subnodes, entries, tmp)
 		if (!val->accessed)
@@ -202,12 +492,21 @@ delnode(cg_node_t *node)
 			/* if accessed, wait for PUFFS to issue a reclaim op */
 			removenode(val);
 
+	if (node->type == CGN_CG_DIR) {
+		if (!node->todel)
+			unlinkcg(node);
+		clearcontrols(node);
+	}
+
 	/* move up all contained PIDs to parent */
 	movepids(node, node->parent);
 
-	if (node->parent)
+	if (node->parent && !node->todel)
 		LIST_REMOVE(node, entries);
 
+	if (node->type == CGN_CG_DIR)
+		shm_delcg(node);
+
 	free(node->name);
 	free(node->agent);
 	free(node);
@@ -217,42 +516,89 @@ delnode(cg_node_t *node)
 static int
 addcgdirfiles(cg_node_t *node)
 {
-	struct cgdir_nodes nodes[] = { { CGN_EVENTS, "cgroup.events" },
-		{ CGN_PROCS, "cgroup.procs" },
-		{ CGN_RELEASE_AGENT, "release_agent" },
-		{ CGN_NOTIFY_ON_RELEASE, "notify_on_release" },
+	struct cgdir_nodes nodes[] = { { CGN_EVENTS, "cgroup.events", 0444 },
+		{ CGN_PROCS, "cgroup.procs", 0644 },
+		{ CGN_RELEASE_AGENT, "release_agent", 0644 },
+		{ CGN_NOTIFY_ON_RELEASE, "notify_on_release", 0644 },
+		{ CGN_KILL, "cgroup.kill", 0200 },
+		{ CGN_FREEZE, "cgroup.freeze", 0644 },
+		{ CGN_PIDS_CURRENT, "pids.current", 0444 },
+		{ CGN_PIDS_MAX, "pids.max", 0644 },
+		{ CGN_PIDS_EVENTS, "pids.events", 0444 },
+		{ CGN_CPU_STAT, "cpu.stat", 0444 },
+		{ CGN_MEMORY_CURRENT, "memory.current", 0444 },
+		{ CGN_STAT, "cgroup.stat", 0444 },
+		{ CGN_AUTOREMOVE, "cgroup.autoremove", 0644 },
+		{ CGN_DAEMON_STATS, "cgrpfs.stats", 0444 },
 		{ CGN_INVALID, NULL } };
 
 	for (int i = 0; nodes[i].type != CGN_INVALID; i++) {
-		cg_node_t *subnode = newnode(node, nodes[i].name,
-			nodes[i].type);
+		cg_node_t *subnode;
+
+		/* as on Linux, there is one release agent for the hierarchy */
+		if (nodes[i].type == CGN_RELEASE_AGENT && node->parent)
+			continue;
+		/* nor can the root CGroup be removed */
+		if (nodes[i].type == CGN_AUTOREMOVE && !node->parent)
+			continue;
+		/* and the daemon's own statistics are shown once */
+		if (nodes[i].type == CGN_DAEMON_STATS && node->parent)
+			continue;
+
+		subnode = newnode(node, nodes[i].name, nodes[i].type);
 
 		if (!subnode)
 			return -ENOMEM;
 
-		subnode->attr.st_mode = S_IFREG | 0644;
+		subnode->attr.st_mode = S_IFREG | nodes[i].mode;
 	}
 
 	return 0;
 }
 
+/* Allocate a CGroup ID, skipping any whose shared-memory slot is taken. */
+static uint64_t
+newcgid(void)
+{
+	uint64_t id;
+
+	for (int tries = 0; tries < 64; tries++)
+		if (shm_slotfree(id = cgmgr.nextid++))
+			return id;
+
+	return id;
+}
+
 cg_node_t *
 newcgdir(cg_node_t *parent, const char *name, mode_t perms, uid_t uid,
 	gid_t gid)
 {
 	cg_node_t *node = newnode(parent, name, CGN_CG_DIR);
 
+	if (!node)
+		return NULL;
+
 	node->type = CGN_CG_DIR;
+	node->id = newcgid();
+	/* as on Linux, children inherit notify_on_release */
+	node->notify = parent ? parent->notify : false;
 	node->attr.st_mode = S_IFDIR | perms;
 	node->attr.st_uid = uid;
 	node->attr.st_gid = gid;
 
+	for (cg_node_t *n = parent; n; n = n->parent)
+		n->ndescendants++;
+
 	if (addcgdirfiles(node) < 0) {
 		warn("Out of memory");
 		delnode(node);
 		return NULL;
 	}
 
+	shm_setcg(node);
+	if (cgmgr.persisting && parent)
+		persist_mkdir(node);
+
 	return node;
 }
 
@@ -325,9 +671,15 @@ lookupfile(cg_node_t *node, const char *filename)
 
 cg_node_t *
 lookupnode(const char *path, bool secondlast)
+{
+	return lookupnodeat(cgmgr.rootnode, path, secondlast);
+}
+
+cg_node_t *
+lookupnodeat(cg_node_t *root, const char *path, bool secondlast)
 {
 	const char *part = path;
-	cg_node_t *node = cgmgr.rootnode;
+	cg_node_t *node = root;
 	bool breaksecondlast = false; /* whether to break on finding 2nd-last */
 	bool last = false; /* are we on the last component of the path? */
 
@@ -350,7 +702,7 @@ lookupnode(const char *path, bool secondlast)
 			last = true;
 		}
 
-		if (secondlast && last && node == cgmgr.rootnode)
+		if (secondlast && last && node == root)
 			return node;
 		else if (last && breaksecondlast)
 			return node;
@@ -393,6 +745,82 @@ lookupnode(const char *path, bool secondlast)
 	return node;
 }
 
+cg_node_t *
+lookupprefix(const char *path, const char **rest)
+{
+	return lookupprefixat(cgmgr.rootnode, path, rest);
+}
+
+cg_node_t *
+lookupprefixat(cg_node_t *root, const char *path, const char **rest)
+{
+	cg_node_t *node = root;
+
+	while (node->type == CGN_CG_DIR) {
+		cg_node_t *subnode;
+		size_t partlen;
+
+		while (*path == '/')
+			path++;
+		partlen = strcspn(path, "/");
+		if (partlen == 0)
+			break;
+
+		LIST_FOREACH (subnode, &node->subnodes, entries)
+			if (strlen(subnode->name) == partlen &&
+				!strncmp(subnode->name, path, partlen))
+				break;
+
+		if (!subnode)
+			break;
+
+		node = subnode;
+		path += partlen;
+	}
+
+	while (*path == '/')
+		path++;
+	*rest = path;
+
+	return node;
+}
+
+int
+mkcgdirs(cg_node_t *node, const char *rest, mode_t perms, uid_t uid,
+	gid_t gid, cg_node_t **out)
+{
+	/* keep what memory is left for tracking processes */
+	if (*rest != '\0' && reserve_low()) {
+		reserve_stats.mkdirrefused++;
+		return -ENOSPC;
+	}
+
+	while (*rest != '\0') {
+		size_t partlen = strcspn(rest, "/");
+		char *name;
+
+		if (node->type != CGN_CG_DIR)
+			return -ENOTDIR;
+		else if ((partlen == 1 && rest[0] == '.') ||
+			(partlen == 2 && rest[0] == '.' && rest[1] == '.'))
+			return -EINVAL;
+
+		if ((name = strndup(rest, partlen)) == NULL)
+			return -ENOMEM;
+		node = newcgdir(node, name, perms, uid, gid);
+		free(name);
+		if (!node)
+			return -ENOMEM;
+
+		rest += partlen;
+		while (*rest == '/')
+			rest++;
+	}
+
+	*out = node;
+	return 0;
+}
+
 static char *
 nodefullpath_internal(cg_node_t *node)
 {
@@ -418,78 +846,270 @@ nodefullpath(cg_node_t *node)
 		return nodefullpath_internal(node);
 }
 
+void
+nodeattrchanged(cg_node_t *node)
+{
+	node->attrset = true;
+	if (cgmgr.persisting)
+		persist_setattr(node);
+}
+
 /* Check if a CGroup node has any PIDs, or if any of its subnodes do. */
 static bool
 nodepopulated(cg_node_t *node)
 {
-	bool populated = false;
-	pid_hash_entry_t *entry, *tmp2;
-	cg_node_t *subnode;
+	return node->nsubpids > 0;
+}
 
-	HASH_ITER(hh, cgmgr.pidcg, entry, tmp2)
-	if (entry->node == node)
+bool
+nodewithin(cg_node_t *node, cg_node_t *ancestor)
+{
+	for (; node; node = node->parent)
+		if (node == ancestor)
+			return true;
+	return false;
+}
+
+bool
+nodemayaccess(const cg_cred_t *cred, cg_node_t *node, mode_t mode)
+{
+	if (cred->uid == 0)
 		return true;
+	else if (cred->uid == node->attr.st_uid)
+		return (node->attr.st_mode & (mode << 6)) == (mode << 6);
+	else if (cred->gid == node->attr.st_gid)
+		return (node->attr.st_mode & (mode << 3)) == (mode << 3);
+	else
+		return (node->attr.st_mode & mode) == mode;
+}
 
-	LIST_FOREACH (subnode, &node->subnodes, entries)
-		if (nodepopulated(subnode))
-			return true;
+/*
+ * Does a writer own a process, i.e. is its UID the process's real or effective
+ * UID? Returns 0 if so, -ESRCH if the process is gone, or else -EPERM.
+ */
+static int
+ownspid(const cg_cred_t *cred, pid_t pid)
+{
+	uid_t ruid, euid;
+	int r;
 
-	return false;
+	if ((r = proctab_owner(pid, &ruid, &euid)) == -ESRCH)
+		return r;
+	else if (r < 0 || (cred->uid != ruid && cred->uid != euid))
+		return -EPERM;
+	return 0;
 }
 
-char *
-procsfiletxt(cg_node_t *node)
+/* Find the nearest CGroup holding both of two CGroups. */
+static cg_node_t *
+commonancestor(cg_node_t *a, cg_node_t *b)
 {
-	char *txt = NULL;
-	char linebuf[33];
-	size_t curlen = 0;
-	pid_hash_entry_t *entry, *tmp2;
+	for (; a; a = a->parent)
+		if (nodewithin(b, a))
+			return a;
+	return cgmgr.rootnode;
+}
 
-	HASH_ITER(hh, cgmgr.pidcg, entry, tmp2)
-	{
-		if (entry->node == node->parent) {
-			char *newtxt;
+/*
+ * Linux's rule for migration: a writer other than root must own the process,
+ * and be able to write the cgroup.procs of both the destination and the
+ * nearest CGroup holding it and the process's present CGroup. So a delegatee
+ * can move only its own processes, and only within its delegated subtree.
+ */
+int
+mayattach(const cg_cred_t *cred, cg_node_t *node, pid_t pid)
+{
+	pid_hash_entry_t *entry;
+	cg_node_t *from = cgmgr.rootnode, *procs;
+	uintptr_t pidp = pid;
+	int r;
 
-			curlen += sprintf(linebuf, "%lld\n",
-				(long long)entry->pid);
-			newtxt = realloc(txt, curlen + 1);
-			if (!newtxt) {
-				free(txt);
-				warnx("Out of memory");
-				return NULL;
-			}
+	if (!cred || cred->uid == 0)
+		return 0;
 
-			if (!txt) {
-				txt = newtxt;
-				txt[0] = '\0';
-			} else
-				txt = newtxt;
+	procs = lookupfile(node, "cgroup.procs");
+	if (!procs || !nodemayaccess(cred, procs, S_IWOTH))
+		return -EACCES;
 
-			strcat(txt, linebuf);
-		}
-	}
+	if ((r = ownspid(cred, pid)) < 0)
+		return r;
 
-	return txt ? txt : strdup("");
+	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	if (entry)
+		from = entry->node;
+	procs = lookupfile(commonancestor(from, node), "cgroup.procs");
+	if (!procs || !nodemayaccess(cred, procs, S_IWOTH))
+		return -EACCES;
+
+	return 0;
 }
 
-char *
-nodetxt(cg_node_t *node)
+/*
+ * May a writer signal every process in a CGroup's subtree? One other than root
+ * must own them all, lest it signal processes which others put there.
+ */
+static int
+maysignal(const cg_cred_t *cred, cg_node_t *node)
 {
-	if (node->type == CGN_PID_CGROUP) {
-		pid_hash_entry_t *entry;
-		uintptr_t pidp = node->parent->pid;
-		char *buf;
+	pid_hash_entry_t *entry, *tmp;
 
-		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	if (!cred || cred->uid == 0)
+		return 0;
 
-		if (!entry)
-			/* untracked are in root CGroup by default */
-			asprintf(&buf, "1:name=systemd:/\n");
-		else {
-			char *path = nodefullpath(entry->node);
+	HASH_ITER(hh, cgmgr.pidcg, entry, tmp)
+	if (entry->pid != getpid() && nodewithin(entry->node, node) &&
+		ownspid(cred, entry->pid) == -EPERM)
+		return -EPERM;
 
-			if (!path)
-				return NULL;
+	return 0;
+}
+
+/*
+ * SIGKILL every process in a CGroup's subtree, in one pass over the PID map.
+ * The subtree is then marked as dying, so that anything which joins it before
+ * it empties (e.g. a child forked before its parent died) is killed too.
+ */
+static int
+killcg(cg_node_t *node)
+{
+	pid_hash_entry_t *entry, *tmp;
+
+	if (node == cgmgr.rootnode)
+		return -EINVAL;
+
+	HASH_ITER(hh, cgmgr.pidcg, entry, tmp)
+	if (entry->pid != getpid() && nodewithin(entry->node, node))
+		signalpid(entry->pid, SIGKILL);
+
+	if (nodepopulated(node) && !node->killing) {
+		node->killing = true;
+		cgmgr.nkilling++;
+	}
+
+	return 0;
+}
+
+/*
+ * Enforce pids.max on a newly forked PID: if its CGroup or any ancestor is
+ * now over its limit, kill it and count the event on the CGroup whose limit
+ * was exceeded. Costs O(depth), as the subtree counts are kept up to date.
+ */
+static void
+forklimit(cg_node_t *node, pid_t pid)
+{
+	for (; node; node = node->parent)
+		if (node->pidsmax >= 0 && node->nsubpids > node->pidsmax) {
+			node->pidsevents++;
+			signalpid(pid, SIGKILL);
+			return;
+		}
+}
+
+/*
+ * Notify of the frozen state having changed for a CGroup and those of its
+ * descendants which aren't frozen in their own right.
+ */
+static void
+notify_frozen(cg_node_t *node)
+{
+	cg_node_t *subnode;
+
+	notify_cgevents(node);
+	LIST_FOREACH (subnode, &node->subnodes, entries)
+		if (subnode->type == CGN_CG_DIR && !subnode->frozen)
+			notify_frozen(subnode);
+}
+
+/*
+ * Freeze or thaw a CGroup's subtree. Freezing sends SIGSTOP to every process
+ * within, and anything that joins the subtree later is stopped as it is
+ * attached. Thawing sends SIGCONT to every process that isn't still frozen
+ * by another CGroup.
+ */
+static int
+freezecg(cg_node_t *node, bool freeze)
+{
+	pid_hash_entry_t *entry, *tmp;
+	bool wasfrozen = nodefrozen(node);
+
+	if (node == cgmgr.rootnode)
+		return -EINVAL;
+	else if (node->frozen == freeze)
+		return 0;
+
+	node->frozen = freeze;
+	cgmgr.nfrozen += freeze ? 1 : -1;
+
+	if (nodefrozen(node) == wasfrozen)
+		return 0; /* an ancestor keeps it frozen */
+
+	HASH_ITER(hh, cgmgr.pidcg, entry, tmp)
+	if (entry->pid != getpid() && nodewithin(entry->node, node)) {
+		if (freeze)
+			signalpid(entry->pid, SIGSTOP);
+		else if (!nodefrozen(entry->node))
+			signalpid(entry->pid, SIGCONT);
+	}
+
+	if (cgmgr.ncgevsubs)
+		notify_frozen(node);
+
+	return 0;
+}
+
+char *
+procsfiletxt(cg_node_t *node)
+{
+	char *txt = NULL;
+	char linebuf[33];
+	size_t curlen = 0;
+	pid_hash_entry_t *entry, *tmp2;
+
+	HASH_ITER(hh, cgmgr.pidcg, entry, tmp2)
+	{
+		if (entry->node == node->parent) {
+			char *newtxt;
+
+			curlen += sprintf(linebuf, "%lld\n",
+				(long long)entry->pid);
+			newtxt = realloc(txt, curlen + 1);
+			if (!newtxt) {
+				free(txt);
+				warnx("Out of memory");
+				return NULL;
+			}
+
+			if (!txt) {
+				txt = newtxt;
+				txt[0] = '\0';
+			} else
+				txt = newtxt;
+
+			strcat(txt, linebuf);
+		}
+	}
+
+	return txt ? txt : strdup("");
+}
+
+char *
+nodetxt(cg_node_t *node)
+{
+	if (node->type == CGN_PID_CGROUP) {
+		pid_hash_entry_t *entry;
+		uintptr_t pidp = node->parent->pid;
+		char *buf;
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+
+		if (!entry)
+			/* untracked are in root CGroup by default */
+			asprintf(&buf, "1:name=systemd:/\n");
+		else {
+			char *path = nodefullpath(entry->node);
+
+			if (!path)
+				return NULL;
 
 			asprintf(&buf, "1:name=systemd:%s\n", path);
 			free(path);
@@ -499,58 +1119,596 @@ nodetxt(cg_node_t *node)
 
 	} else if (node->type == CGN_EVENTS) {
 		char *buf;
-		return NULL;
+
+		if (asprintf(&buf, "populated %d\nfrozen %d\n",
+			    nodepopulated(node->parent),
+			    nodefrozen(node->parent)) < 0)
+			return NULL;
+
+		return buf;
+	} else if (node->type == CGN_FREEZE)
+		return strdup(node->parent->frozen ? "1\n" : "0\n");
+	else if (node->type == CGN_NOTIFY_ON_RELEASE)
+		return strdup(node->parent->notify ? "1\n" : "0\n");
+	else if (node->type == CGN_AUTOREMOVE)
+		return strdup(node->parent->autoremove ? "1\n" : "0\n");
+	else if (node->type == CGN_RELEASE_AGENT) {
+		char *buf;
+
+		if (asprintf(&buf, "%s\n",
+			    node->parent->agent ? node->parent->agent : "") < 0)
+			return NULL;
+
+		return buf;
+	}
+	else if (node->type == CGN_PIDS_CURRENT ||
+		node->type == CGN_PIDS_MAX || node->type == CGN_PIDS_EVENTS) {
+		cg_node_t *cg = node->parent;
+		char *buf;
+		int r;
+
+		if (node->type == CGN_PIDS_CURRENT)
+			r = asprintf(&buf, "%u\n", cg->nsubpids);
+		else if (node->type == CGN_PIDS_EVENTS)
+			r = asprintf(&buf, "max %lu\n", cg->pidsevents);
+		else if (cg->pidsmax < 0)
+			r = asprintf(&buf, "max\n");
+		else
+			r = asprintf(&buf, "%ld\n", cg->pidsmax);
+
+		return r < 0 ? NULL : buf;
+	} else if (node->type == CGN_CPU_STAT ||
+		node->type == CGN_MEMORY_CURRENT) {
+		cg_node_t *cg = node->parent;
+		char *buf;
+		int r;
+
+		proctab_sample();
+
+		if (node->type == CGN_CPU_STAT)
+			r = asprintf(&buf,
+				"usage_usec %" PRIu64 "\nuser_usec %" PRIu64
+				"\nsystem_usec %" PRIu64 "\n",
+				cg->utime + cg->stime, cg->utime, cg->stime);
+		else
+			r = asprintf(&buf, "%" PRIu64 "\n", cg->rss);
+
+		return r < 0 ? NULL : buf;
+	} else if (node->type == CGN_STAT) {
+		cg_node_t *cg = node->parent;
+		char *buf;
+
+		if (asprintf(&buf,
+			    "nr_descendants %u\nnr_procs %u\nnr_subtree_procs %u\n"
+			    "nr_forks %lu\nnr_exits %lu\nnr_exits_normal %lu\n"
+			    "nr_exits_signaled %lu\n",
+			    cg->ndescendants, cg->npids, cg->nsubpids, cg->nforks,
+			    cg->nexits, cg->nexits - cg->nsigexits,
+			    cg->nsigexits) < 0)
+			return NULL;
+
+		return buf;
+	}
+	else if (node->type == CGN_DAEMON_STATS) {
+		char *buf;
+
+		if (asprintf(&buf,
+			    "tracked_pids %u\ninstances %u\n"
+			    "reserve_pids %u\nreserve_pids_taken %lu\n"
+			    "reserve_paths %u\nreserve_paths_taken %lu\n"
+			    "mkdir_refused %lu\n"
+			    "release_spawned %lu\nrelease_failed %lu\n"
+			    "release_coalesced %lu\nrelease_dropped %lu\n"
+			    "reconcile_runs %lu\nreconcile_walks %lu\n"
+			    "reconcile_adopted %lu\nreconcile_stale %lu\n"
+			    "persist_snapshots %lu\npersist_syncs %lu\n"
+			    "persist_overflows %lu\npersist_errors %lu\n"
+			    "sched_rounds %lu\nsched_events %lu\n"
+			    "sched_full_batches %lu\n"
+			    "sched_event_lag_total_us %" PRIu64 "\n"
+			    "sched_event_lag_max_us %" PRIu64 "\n"
+			    "sched_requests %lu\nsched_shares_spent %lu\n"
+			    "sched_request_lag_total_us %" PRIu64 "\n"
+			    "sched_request_lag_max_us %" PRIu64 "\n"
+			    "sched_request_time_max_us %" PRIu64 "\n",
+			    HASH_COUNT(cgmgr.pidcg), cgmgr.ninsts,
+			    reserve_stats.pids,
+			    reserve_stats.pidstaken, reserve_stats.paths,
+			    reserve_stats.pathstaken, reserve_stats.mkdirrefused,
+			    release_stats.spawned, release_stats.failed,
+			    release_stats.coalesced, release_stats.dropped,
+			    reconcile_stats.runs, reconcile_stats.walks,
+			    reconcile_stats.adopted, reconcile_stats.stale,
+			    persist_stats.snapshots,
+			    persist_stats.syncs, persist_stats.overflows,
+			    persist_stats.errors, sched_stats.rounds,
+			    sched_stats.events, sched_stats.fullbatches,
+			    sched_stats.eventlag, sched_stats.eventlagmax,
+			    sched_stats.requests, sched_stats.sharesspent,
+			    sched_stats.requestlag, sched_stats.requestlagmax,
+			    sched_stats.requesttimemax) < 0)
+			return NULL;
+
+		return buf;
 	} else if (node->type == CGN_PROCS)
 		return procsfiletxt(node);
+	else if (node->type == CGN_KILL)
+		return strdup("");
 	else
 		return NULL;
 }
 
 int
-attachpid(cg_node_t *node, pid_t pid)
+nodewrite(cg_node_t *node, const char *buf, size_t len, const cg_cred_t *cred)
+{
+	char txt[32], *end;
+	long val;
+	int r;
+
+	/* an open file of a removed CGroup */
+	if (node->todel || (node->parent && node->parent->todel))
+		return -ENODEV;
+
+	if (node->type == CGN_RELEASE_AGENT) {
+		char *agent;
+
+		/* an absolute path, or nothing to disable it */
+		if (len > 0 && buf[len - 1] == '\n')
+			len--;
+		if (len > 0 && buf[0] != '/')
+			return -EINVAL;
+		if ((agent = strndup(buf, len)) == NULL)
+			return -ENOMEM;
+
+		if ((r = release_setagent(agent)) < 0) {
+			free(agent);
+			return r;
+		}
+
+		free(node->parent->agent);
+		node->parent->agent = len > 0 ? agent : NULL;
+		if (len == 0)
+			free(agent);
+		return 0;
+	}
+
+	/* the other writable files take a single number */
+	if (len >= sizeof txt)
+		return -EINVAL;
+	while (len > 0 && isspace((unsigned char)buf[len - 1]))
+		len--;
+	memcpy(txt, buf, len);
+	txt[len] = '\0';
+
+	if (node->type == CGN_PIDS_MAX && !strcmp(txt, "max"))
+		val = -1;
+	else {
+		errno = 0;
+		val = strtol(txt, &end, 10);
+		if (end == txt || *end != '\0' || errno == ERANGE)
+			return -EINVAL;
+		/* pids.max is made unlimited only by "max" */
+		if (node->type == CGN_PIDS_MAX && val < 0)
+			return -EINVAL;
+	}
+
+	switch (node->type) {
+	case CGN_PROCS:
+		if (val <= 0 || (pid_t)val != val)
+			return -EINVAL;
+		else if ((r = mayattach(cred, node->parent, val)) < 0)
+			return r;
+		r = attachpid(node->parent, val);
+		if (r < 0)
+			return r;
+		if (cgmgr.nattachsubs)
+			notify_attach(val, 0, node->parent, CGRPFS_EV_MIGRATE);
+		return 0;
+
+	case CGN_KILL:
+		if (val != 1)
+			return -EINVAL;
+		else if ((r = maysignal(cred, node->parent)) < 0)
+			return r;
+		return killcg(node->parent);
+
+	case CGN_FREEZE:
+		if (val != 0 && val != 1)
+			return -EINVAL;
+		else if ((r = maysignal(cred, node->parent)) < 0)
+			return r;
+		return freezecg(node->parent, val);
+
+	case CGN_NOTIFY_ON_RELEASE:
+		if (val != 0 && val != 1)
+			return -EINVAL;
+		node->parent->notify = val;
+		return 0;
+
+	case CGN_AUTOREMOVE:
+		if (val != 0 && val != 1)
+			return -EINVAL;
+		/* takes effect when it next empties */
+		node->parent->autoremove = val;
+		return 0;
+
+	case CGN_PIDS_MAX:
+		/* no more PIDs can exist than a pid_t can number */
+		if ((pid_t)val != val)
+			return -EINVAL;
+		if (node->parent->pidsmax < 0 && val >= 0)
+			cgmgr.nlimited++;
+		else if (node->parent->pidsmax >= 0 && val < 0)
+			cgmgr.nlimited--;
+		node->parent->pidsmax = val;
+		return 0;
+
+	default:
+		return -ENODEV;
+	}
+}
+
+/* Stop or continue a PID that moved between CGroups, as freezing requires */
+static void
+freezemoved(pid_t pid, cg_node_t *from, cg_node_t *to)
+{
+	if (nodefrozen(to))
+		signalpid(pid, SIGSTOP);
+	else if (from && nodefrozen(from))
+		signalpid(pid, SIGCONT);
+}
+
+/*
+ * Attach a PID to a CGroup; born says whether it was forked within it, or
+ * moved into it.
+ */
+static int
+trackpid(cg_node_t *node, pid_t pid, bool born)
 {
-	struct kevent kev;
 	int r;
 	pid_hash_entry_t *entry;
+	cg_node_t *oldnode = NULL;
 
 	assert(node->type == CGN_CG_DIR);
+
+	if (cgmgr.nfrozen) {
+		uintptr_t pidp = pid;
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		if (entry)
+			oldnode = entry->node;
+	}
+
 	r = addpidhash(pid, node, &entry);
 
 	if (r < 0)
 		warnx("Failed to add PID %lld", (long long)pid);
 	else if (r == 0) {
 		warnx("Existing entry for %lld\n", (long long)pid);
+		if (cgmgr.nkilling && killingancestor(node))
+			signalpid(pid, SIGKILL);
+		else if (cgmgr.nfrozen)
+			freezemoved(pid, oldnode, node);
 		return 0;
 	}
 
 	/* new PID - must be tracked */
-	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT | NOTE_TRACK, 0, NULL);
-	r = kevent(cgmgr.kq, &kev, 1, NULL, 0, NULL);
+	r = ev_track(pid);
 
 	if (r < 0) {
 		int olderrno = errno;
 		/* delete untrackable PID */
-		HASH_DEL(cgmgr.pidcg, entry);
-		free(entry);
+		dropentry(entry);
 		errno = olderrno;
 		warn("Failed to watch PID %lld", (long long)pid);
 		return -olderrno;
-	} else if (r >= 0)
+	} else if (r >= 0) {
+		/* children it had before it was moved here stay where they are */
+		if (!born)
+			entry->since = wallms();
+		/* newcomers to a dying subtree die too */
+		if (cgmgr.nkilling && killingancestor(node))
+			signalpid(pid, SIGKILL);
+		else if (cgmgr.nfrozen)
+			freezemoved(pid, NULL, node);
 		return 1;
+	}
 
 	return -errno;
 }
 
+int
+attachpid(cg_node_t *node, pid_t pid)
+{
+	int r = trackpid(node, pid, false);
+
+	if (r >= 0 && cgmgr.persisting)
+		persist_attach(node, pid);
+
+	return r;
+}
+
+pid_hash_entry_t *
+placepid(cg_node_t *node, pid_t pid)
+{
+	pid_hash_entry_t *entry;
+
+	if (addpidhash(pid, node, &entry) < 0) {
+		warnx("Failed to add PID %lld", (long long)pid);
+		return NULL;
+	}
+
+	return entry;
+}
+
 void
-notify_exit(pid_t pid, int wstat)
+forgetpid(pid_t pid)
+{
+	pid_hash_entry_t *entry;
+	uintptr_t pidp = pid;
+
+	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	if (entry)
+		dropentry(entry);
+}
+
+size_t
+trackpids(const pid_t *pids, size_t n, uint64_t since)
+{
+	pid_hash_entry_t *entry;
+	size_t ntracked = 0;
+	int *errors;
+
+	if ((errors = malloc(n * sizeof *errors)) == NULL) {
+		warn("Failed to allocate batch; tracking singly");
+		for (size_t i = 0; i < n; i++)
+			if (ev_track(pids[i]) < 0)
+				forgetpid(pids[i]);
+			else
+				ntracked++;
+		return ntracked;
+	}
+
+	ev_trackmany(pids, errors, n);
+
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t pidp = pids[i];
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		if (!entry)
+			continue;
+		else if (errors[i] != 0) {
+			/* ESRCH: exited meanwhile */
+			if (errors[i] != ESRCH) {
+				errno = errors[i];
+				warn("Failed to watch PID %lld",
+					(long long)pids[i]);
+			}
+			dropentry(entry);
+			continue;
+		}
+
+		entry->since = since;
+		ntracked++;
+	}
+
+	free(errors);
+	return ntracked;
+}
+
+/* Account for a fork within a CGroup, once the child is in the PID map. */
+static void
+forked(cg_node_t *node, pid_t pid, pid_t ppid)
+{
+	if (cgmgr.persisting)
+		persist_fork(pid, ppid);
+
+	for (cg_node_t *n = node; n; n = n->parent)
+		n->nforks++;
+	if (cgmgr.nlimited)
+		forklimit(node, pid);
+	if (cgmgr.nattachsubs)
+		notify_attach(pid, ppid, node, CGRPFS_EV_FORK);
+}
+
+int
+adoptpid(cg_node_t *node, pid_t pid, pid_t ppid)
+{
+	int r = trackpid(node, pid, true);
+
+	if (r <= 0)
+		return r;
+
+	forked(node, pid, ppid);
+
+	return r;
+}
+
+pid_hash_entry_t *
+placeforked(cg_node_t *node, pid_t pid, pid_t ppid)
+{
+	pid_hash_entry_t *entry = placepid(node, pid);
+
+	if (!entry)
+		return NULL;
+
+	if (cgmgr.nkilling && killingancestor(node))
+		signalpid(pid, SIGKILL);
+	else if (cgmgr.nfrozen)
+		freezemoved(pid, NULL, node);
+	forked(node, pid, ppid);
+
+	return entry;
+}
+
+/*
+ * Get the path of a CGroup as a listener sees it, given its full path; an
+ * instance's listeners see paths relative to its root.
+ */
+static const char *
+listenerpath(listener_t *listener, const char *path)
+{
+	if (!listener->inst || !path)
+		return path;
+
+	for (cg_node_t *n = listener->inst->root; n->parent; n = n->parent)
+		if ((path = strchr(path + 1, '/')) == NULL)
+			return "/";
+
+	return path;
+}
+
+/* Should a listener hear of events in a CGroup? */
+static bool
+listenerwants(listener_t *listener, cg_node_t *node)
+{
+	return !listener->inst || nodewithin(node, listener->inst->root);
+}
+
+/* drop a listener, e.g. because it disconnected */
+static void
+dellistener(listener_t *listener)
+{
+	if (listener->subflags & CGRPFS_SUB_ATTACH)
+		cgmgr.nattachsubs--;
+	if (listener->subflags & CGRPFS_SUB_PATH)
+		cgmgr.npathsubs--;
+	if (listener->subflags & CGRPFS_SUB_CGEVENTS)
+		cgmgr.ncgevsubs--;
+	LIST_REMOVE(listener, listeners);
+	close(listener->fd);
+	free(listener);
+}
+
+/* the first sequence number still retained in the history */
+static uint64_t
+oldestseq(void)
+{
+	return cgmgr.seq >= CGRPFS_HISTORY_MAX ?
+		cgmgr.seq - CGRPFS_HISTORY_MAX + 1 :
+		1;
+}
+
+/* send a gap marker to a listener */
+static ssize_t
+sendgap(listener_t *listener)
+{
+	struct cgrpfs_event gap;
+
+	memset(&gap, 0, sizeof gap);
+	gap.type = CGRPFS_EV_GAP;
+	gap.len = sizeof gap;
+	gap.seq = oldestseq();
+	return send(listener->fd, &gap, gap.len, MSG_NOSIGNAL);
+}
+
+/*
+ * Handle the result of sending to a listener; returns false if the listener
+ * was dropped. One whose socket buffer is full isn't keeping up, and the
+ * daemon mustn't wait for it: it's told that it lost events, then
+ * disconnected, to resume or resynchronise when it reconnects.
+ */
+static bool
+sent(listener_t *listener, ssize_t r)
+{
+	if (r < 0 && errno == EAGAIN) {
+		int bufsize;
+		socklen_t len = sizeof bufsize;
+
+		warnx("Dropping listener not keeping up with events");
+		/* the marker won't fit without a little more room */
+		if (listener->subscribed &&
+			getsockopt(listener->fd, SOL_SOCKET, SO_SNDBUF, &bufsize,
+			    &len) == 0) {
+			bufsize += 4096;
+			setsockopt(listener->fd, SOL_SOCKET, SO_SNDBUF, &bufsize,
+			    sizeof bufsize);
+			sendgap(listener);
+		}
+		dellistener(listener);
+		return false;
+	} else if (r < 0 && errno == EPIPE) {
+		/* remove the listener that disconnected */
+		dellistener(listener);
+		return false;
+	} else if (r < 0)
+		warn("Failed to send notification");
+
+	return true;
+}
+
+/* send a record to a listener; returns false if the listener was dropped */
+static bool
+sendrecord(listener_t *listener, const void *rec, size_t len)
+{
+	return sent(listener, send(listener->fd, rec, len, MSG_NOSIGNAL));
+}
+
+/*
+ * Send an event to a listener, with the cgroup path appended if the listener
+ * wants it and it's known. Returns false if the listener was dropped.
+ */
+static bool
+sendevent(listener_t *listener, const struct cgrpfs_event *ev,
+	const char *path)
+{
+	struct cgrpfs_event hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t pathlen;
+
+	if (!path || !(listener->subflags & CGRPFS_SUB_PATH) ||
+		(pathlen = strlen(path) + 1) > UINT16_MAX - sizeof hdr)
+		return sendrecord(listener, ev, ev->len);
+
+	hdr = *ev;
+	hdr.len = sizeof hdr + pathlen;
+	hdr.flags |= CGRPFS_EVF_PATH;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = (void *)path;
+	iov[1].iov_len = pathlen;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	return sent(listener, sendmsg(listener->fd, &msg, MSG_NOSIGNAL));
+}
+
+/* Notify listeners of an exit from the given CGroup, and record it. */
+static void
+notify_exit(pid_t pid, int wstat, cg_node_t *node)
 {
 	siginfo_t si;
+	struct cgrpfs_event *ev;
+	char **path;
 	listener_t *val, *tmp;
 
+	ev = &cgmgr.history[++cgmgr.seq % CGRPFS_HISTORY_MAX];
+	memset(ev, 0, sizeof *ev);
+	ev->type = CGRPFS_EV_EXIT;
+	ev->len = sizeof *ev;
+	ev->seq = cgmgr.seq;
+	ev->pid = pid;
+	ev->cgid = node->id;
+
+	/*
+	 * The path is kept only if it may be wanted: by a listener now, or to
+	 * filter a replay to an instance's listeners. Otherwise, or if out of
+	 * memory, it is NULL, and a replay looks the CGroup up by its ID.
+	 */
+	path = &cgmgr.histpath[cgmgr.seq % CGRPFS_HISTORY_MAX];
+	reserve_freepath(*path);
+	*path = cgmgr.npathsubs || cgmgr.ninsts ? reserve_path(node) : NULL;
+
 	si.si_pid = pid;
 	si.si_signo = SIGCHLD;
 
-	if (WIFEXITED(wstat)) {
+	if (wstat == CGRPFS_WSTAT_LOST)
+		ev->flags |= CGRPFS_EVF_LOST;
+	else if (WIFEXITED(wstat)) {
 		si.si_code = CLD_EXITED;
 		si.si_status = WEXITSTATUS(wstat);
 	} else if (WIFSIGNALED(wstat)) {
@@ -558,89 +1716,190 @@ notify_exit(pid_t pid, int wstat)
 		si.si_status = WTERMSIG(wstat);
 	}
 
+	if (!(ev->flags & CGRPFS_EVF_LOST)) {
+		ev->code = si.si_code;
+		ev->status = si.si_status;
+	}
+
+	/* a siginfo_t can't say the status is unknown, so it isn't sent */
+	LIST_FOREACH_SAFE (val, &cgmgr.listeners, listeners, tmp) {
+		if (!listenerwants(val, node))
+			continue;
+		else if (val->subscribed)
+			sendevent(val, ev, listenerpath(val, *path));
+		else if (!(ev->flags & CGRPFS_EVF_LOST))
+			sendrecord(val, &si, sizeof si);
+	}
+}
+
+void
+notify_attach(pid_t pid, pid_t ppid, cg_node_t *node, enum cgrpfs_evtype type)
+{
+	struct cgrpfs_event ev;
+	char *path = NULL;
+	listener_t *val, *tmp;
+
+	memset(&ev, 0, sizeof ev);
+	ev.type = type;
+	ev.len = sizeof ev;
+	ev.seq = cgmgr.seq;
+	ev.pid = pid;
+	ev.ppid = ppid;
+	ev.cgid = node->id;
+
+	LIST_FOREACH_SAFE (val, &cgmgr.listeners, listeners, tmp) {
+		if (!(val->subflags & CGRPFS_SUB_ATTACH) ||
+			!listenerwants(val, node))
+			continue;
+		if (!path && (val->subflags & CGRPFS_SUB_PATH))
+			path = nodefullpath(node);
+		sendevent(val, &ev, listenerpath(val, path));
+	}
+
+	free(path);
+}
+
+void
+notify_cgevents(cg_node_t *node)
+{
+	struct cgrpfs_event ev;
+	char *path = NULL;
+	listener_t *val, *tmp;
+
+	memset(&ev, 0, sizeof ev);
+	ev.type = CGRPFS_EV_CGEVENTS;
+	ev.len = sizeof ev;
+	ev.seq = cgmgr.seq;
+	ev.cgid = node->id;
+	if (nodepopulated(node))
+		ev.status |= CGRPFS_CGEV_POPULATED;
+	if (nodefrozen(node))
+		ev.status |= CGRPFS_CGEV_FROZEN;
+
 	LIST_FOREACH_SAFE (val, &cgmgr.listeners, listeners, tmp) {
-		ssize_t r = send(val->fd, &si, sizeof si, MSG_NOSIGNAL);
-		if (r < 0 && errno == EPIPE) {
-			/* remove the listener that disconnected */
-			LIST_REMOVE(val, listeners);
-			free(val);
-		} else if (r < 0)
-			warn("Failed to send exit notification");
+		if (!(val->subflags & CGRPFS_SUB_CGEVENTS) ||
+			!listenerwants(val, node))
+			continue;
+		if (!path && (val->subflags & CGRPFS_SUB_PATH))
+			path = nodefullpath(node);
+		sendevent(val, &ev, listenerpath(val, path));
 	}
+
+	free(path);
 }
 
 int
 detachpid(pid_t pid, int wstat, bool untrack)
 {
-	struct kevent kev;
 	cg_node_t *node;
 	pid_hash_entry_t *entry;
 	uintptr_t pidp = pid;
 
-	if (untrack) {
-		int r;
-
-		EV_SET(&kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
-		r = kevent(cgmgr.kq, &kev, 1, NULL, 0, NULL);
-		if (r < 0)
-			warn("Failed to untrack PID %lld", (long long)pid);
-	}
+	if (untrack && ev_untrack(pid) < 0)
+		warn("Failed to untrack PID %lld", (long long)pid);
 
 	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
 	if (!entry)
 		warnx("Lost PID without a parent CGroup\n");
 	else {
-		HASH_DEL(cgmgr.pidcg, entry);
-		free(entry);
+		node = entry->node;
+		dropentry(entry);
+		if (cgmgr.persisting)
+			persist_exit(pid);
+		/* an exit that was missed wasn't seen, so isn't counted */
+		if (!untrack && wstat != CGRPFS_WSTAT_LOST)
+			for (cg_node_t *n = node; n; n = n->parent) {
+				n->nexits++;
+				if (WIFSIGNALED(wstat))
+					n->nsigexits++;
+			}
 		if (!untrack)
-			notify_exit(pid, wstat);
+			notify_exit(pid, wstat, node);
 	}
 
 	return 0;
 }
 
-void
-cgmgr_init(void)
+int
+cgmgr_bind(const char *path)
 {
-	struct sockaddr_un sun = { .sun_family = AF_UNIX,
-		.sun_path = "/var/run/cgrpfs.notify" };
-	struct kevent kev;
-#ifdef CGRPFS_THREADED
-	int r;
-	pthread_t thrd;
-#endif
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
 
-	cgmgr.kq = kqueue();
-	if ((cgmgr.kq = kqueue()) < 0)
-		errx(EXIT_FAILURE, "Failed to open kernel queue.");
+	if (strlen(path) >= sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	snprintf(sun.sun_path, sizeof sun.sun_path, "%s", path);
 
-#ifdef CGRPFS_THREADED
-	if (pthread_mutex_init(&cgmgr.lock, NULL) < 0)
-		err(EXIT_FAILURE, "Failed to initialise mutex");
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
 
-	r = pthread_create(&thrd, NULL, kqueue_thread, NULL);
-	if (r != 0)
-		errx(EXIT_FAILURE, "pthread_create failed: %s", strerror(r));
-#endif
+	unlink(sun.sun_path);
 
-	cgmgr.notifyfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
-	if (cgmgr.notifyfd < 0)
-		err(EXIT_FAILURE, "failed to create listener socket");
+	if (bind(fd, (struct sockaddr *)&sun, SUN_LEN(&sun)) < 0 ||
+		listen(fd, 10) < 0) {
+		int olderrno = errno;
 
-	unlink(sun.sun_path);
+		close(fd);
+		errno = olderrno;
+		return -1;
+	}
+
+	return fd;
+}
+
+int
+cgmgr_listen(const char *path)
+{
+	int fd = cgmgr_bind(path);
 
-	if (bind(cgmgr.notifyfd, (struct sockaddr *)&sun, SUN_LEN(&sun)) < 0)
-		err(EXIT_FAILURE, "failed to bind listener socket");
+	if (fd < 0)
+		err(EXIT_FAILURE, "failed to set up listener socket %s",
+			path);
 
-	if (listen(cgmgr.notifyfd, 10) < 0)
-		err(EXIT_FAILURE, "failed to listen on listener socket");
+	if (ev_watchfd(fd, NULL) < 0)
+		err(EXIT_FAILURE, "Failed to watch listener FD");
 
-	EV_SET(&kev, cgmgr.notifyfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-	if ((kevent(cgmgr.kq, &kev, 1, NULL, 0, NULL)) < 0)
-		err(EXIT_FAILURE,
-			"Failed to add event for notify FD to Kernel Queue");
+	return fd;
+}
+
+void
+cgmgr_unlisten(cg_inst_t *inst)
+{
+	listener_t *val, *tmp;
+
+	LIST_FOREACH_SAFE (val, &cgmgr.listeners, listeners, tmp)
+		if (val->inst == inst)
+			dellistener(val);
+}
+
+void
+cgmgr_initstate(void)
+{
+	struct timespec ts;
 
 	cgmgr.pidcg = NULL;
+	cgmgr.notifyfd = cgmgr.controlfd = cgmgr.handofffd = cgmgr.fsfd = -1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cgmgr.epoch = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	cgmgr.seq = 0;
+	cgmgr.nextid = 1;
+	cgmgr.nattachsubs = 0;
+	cgmgr.npathsubs = 0;
+	cgmgr.nkilling = 0;
+	cgmgr.nfrozen = 0;
+	cgmgr.nlimited = 0;
+	cgmgr.ncgevsubs = 0;
+	TAILQ_INIT(&cgmgr.reaps);
+	LIST_INIT(&cgmgr.listeners);
+	LIST_INIT(&cgmgr.controls);
+	LIST_INIT(&cgmgr.insts);
+	cgmgr.ninsts = 0;
+
+	reserve_init();
 
 	cgmgr.rootnode = newcgdir(NULL, NULL, 0755, 0, 0);
 	if (!cgmgr.rootnode)
@@ -652,12 +1911,48 @@ cgmgr_init(void)
 		errx(EXIT_FAILURE, "Failed to allocate meta node.");
 
 	cgmgr.metanode->attr.st_mode = S_IFDIR | 0755;
+}
 
-	LIST_INIT(&cgmgr.listeners);
+void
+cgmgr_init(void)
+{
+	bool tookover;
+
+	if ((cgmgr.evfd = ev_init()) < 0)
+		err(EXIT_FAILURE, "Failed to set up event backend");
+
+	cgmgr_initstate();
+	trace_init(getenv("CGRPFS_TRACE"));
+	/* a predecessor's state is fresher than any saved */
+	tookover = handoff_take(getenv("CGRPFS_HANDOFF"));
+	/* once its epoch is inherited; meanwhile its table is still there */
+	shm_init();
+	persist_init(getenv("CGRPFS_STATE"), !tookover);
+	if (!tookover)
+		proctab_adopt(getenv("CGRPFS_ADOPT_MAP"));
+	persist_start();
+
+	/* or else they were handed over */
+	if (cgmgr.notifyfd < 0)
+		cgmgr.notifyfd = cgmgr_listen(CGRPFS_NOTIFY_PATH);
+	if (cgmgr.controlfd < 0)
+		ctl_init();
+	release_init();
+	/* soon, for any fork made while the running processes were adopted */
+	proctab_suspect(0);
+	armreconciletimer(CGRPFS_RECONCILE_DELAY);
+
+#ifdef CGRPFS_LOCKING
+	if (pthread_mutex_init(&cgmgr.lock, NULL) < 0)
+		err(EXIT_FAILURE, "Failed to initialise mutex");
+#endif
+#ifdef CGRPFS_THREADED
+	cgmgr_startevents();
+#endif
 }
 
 void
-cgmgr_accept(void)
+cgmgr_accept(int fd, cg_inst_t *inst)
 {
 	listener_t *listener = malloc(sizeof *listener);
 
@@ -666,12 +1961,197 @@ cgmgr_accept(void)
 		return;
 	}
 
-	listener->fd = accept(cgmgr.notifyfd, NULL, 0);
+	/* a listener that doesn't keep up mustn't block the daemon */
+	listener->fd = accept4(fd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (listener->fd < 0) {
 		warn("Failed to accept listener");
 		free(listener);
 		return;
 	}
 
+	listener->control = false;
+	listener->subscribed = false;
+	listener->subflags = 0;
+	listener->passive = false;
+	listener->inst = inst;
+
+	/* watch for a subscription message or disconnection */
+	if (ev_watchfd(listener->fd, listener) < 0) {
+		warn("Failed to watch listener");
+		close(listener->fd);
+		free(listener);
+		return;
+	}
+
 	LIST_INSERT_HEAD(&cgmgr.listeners, listener, listeners);
 }
+
+/* Find the CGroup with an ID within a subtree, or NULL if it's gone. */
+static cg_node_t *
+findcg(cg_node_t *node, uint64_t id)
+{
+	cg_node_t *subnode, *found;
+
+	if (node->id == id)
+		return node;
+
+	LIST_FOREACH (subnode, &node->subnodes, entries)
+		if (subnode->type == CGN_CG_DIR &&
+			(found = findcg(subnode, id)) != NULL)
+			return found;
+
+	return NULL;
+}
+
+/* Send a resuming listener the events it missed, or a gap marker. */
+static void
+replay(listener_t *listener, uint64_t epoch, uint64_t after)
+{
+	char *root = NULL, *found = NULL;
+	size_t rootlen;
+
+	if (epoch != cgmgr.epoch || after > cgmgr.seq ||
+		after + 1 < oldestseq()) {
+		sent(listener, sendgap(listener));
+		return;
+	}
+
+	/* an instance's listeners only missed the events within it */
+	if (listener->inst &&
+		(root = nodefullpath(listener->inst->root)) == NULL)
+		return;
+	rootlen = root ? strlen(root) : 0;
+
+	for (uint64_t seq = after + 1; seq <= cgmgr.seq; seq++) {
+		size_t i = seq % CGRPFS_HISTORY_MAX;
+		struct cgrpfs_event *ev = &cgmgr.history[i];
+		const char *path = cgmgr.histpath[i];
+		cg_node_t *node;
+
+		/* not kept when it happened; the CGroup's path now will do */
+		free(found);
+		found = NULL;
+		if (!path && (root || (listener->subflags & CGRPFS_SUB_PATH)) &&
+			(node = findcg(cgmgr.rootnode, ev->cgid)) != NULL)
+			path = found = nodefullpath(node);
+
+		if (root &&
+			(!path || strncmp(path, root, rootlen) != 0 ||
+				(path[rootlen] != '/' && path[rootlen] != '\0')))
+			continue;
+
+		if (!sendevent(listener, ev, listenerpath(listener, path)))
+			break;
+	}
+
+	free(found);
+	free(root);
+}
+
+/* Read a subscription message from a listener. */
+static void
+listener_read(listener_t *listener)
+{
+	struct cgrpfs_subscribe sub;
+	struct cgrpfs_hello hello;
+	ssize_t r;
+
+	r = recv(listener->fd, &sub, sizeof sub, 0);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	else if (r <= 0) {
+		/* disconnected */
+		dellistener(listener);
+		return;
+	} else if (r != sizeof sub || sub.version != CGRPFS_PROTO_VERSION) {
+		warnx("Bad subscription from listener");
+		dellistener(listener);
+		return;
+	}
+
+	if (listener->subscribed) {
+		warnx("Listener subscribed twice");
+		dellistener(listener);
+		return;
+	}
+
+	listener->subscribed = true;
+	listener->subflags = sub.flags;
+	if (sub.flags & CGRPFS_SUB_ATTACH)
+		cgmgr.nattachsubs++;
+	if (sub.flags & CGRPFS_SUB_PATH)
+		cgmgr.npathsubs++;
+	if (sub.flags & CGRPFS_SUB_CGEVENTS)
+		cgmgr.ncgevsubs++;
+
+	memset(&hello, 0, sizeof hello);
+	hello.type = CGRPFS_EV_HELLO;
+	hello.len = sizeof hello;
+	hello.version = CGRPFS_PROTO_VERSION;
+	hello.epoch = cgmgr.epoch;
+	hello.seq = cgmgr.seq;
+	if (!sendrecord(listener, &hello, hello.len))
+		return;
+
+	if (sub.flags & CGRPFS_SUB_RESUME)
+		replay(listener, sub.epoch, sub.after);
+}
+
+void
+cgmgr_event(cg_event_t *ev)
+{
+	if (cgmgr.tracing && ev->kind != CGE_READ)
+		trace_event(ev);
+
+	if (ev->kind == CGE_READ && ev->ident == cgmgr.notifyfd)
+		cgmgr_accept(cgmgr.notifyfd, NULL);
+	else if (ev->kind == CGE_READ && ev->ident == cgmgr.controlfd)
+		ctl_accept();
+	else if (ev->kind == CGE_READ && ((listener_t *)ev->udata)->control)
+		ctl_read(ev->udata);
+	else if (ev->kind == CGE_READ && ((listener_t *)ev->udata)->passive)
+		cgmgr_accept(ev->ident, ((listener_t *)ev->udata)->inst);
+	else if (ev->kind == CGE_READ)
+		listener_read(ev->udata);
+	else if (ev->kind == CGE_FORK) {
+		pid_hash_entry_t *entry;
+		uintptr_t ppidp = ev->data; /* parent pid */
+
+		/* find parent pid's node */
+		HASH_FIND_PTR(cgmgr.pidcg, &ppidp, entry);
+
+		if (!entry) {
+			/* the parent's own fork was missed */
+			warnx("Couldn't find containing CGroup of PID %lld",
+				(long long)ev->data);
+			proctab_suspect(ev->data);
+			reconcilesoon();
+		} else
+			adoptpid(entry->node, ev->ident, ev->data);
+	} else if (ev->kind == CGE_EXIT)
+		detachpid(ev->ident, ev->data, false);
+	else if (ev->kind == CGE_TRACKERR) {
+		if (!reconcilepending)
+			warnx("A tracked fork may have been missed");
+		/* the parent, if the backend knows it */
+		proctab_suspect(ev->ident);
+		reconcilesoon();
+	} else if (ev->kind == CGE_TIMER && ev->ident == CGT_REAP)
+		reapexpired();
+	else if (ev->kind == CGE_TIMER && ev->ident == CGT_RECONCILE) {
+		uint64_t now = nowms();
+		bool full = now - lastsweep >= CGRPFS_RECONCILE_INTERVAL;
+
+		reconcilepending = false;
+		/* the outcome of a reconciliation isn't in a trace */
+		if (cgmgr.replaying || proctab_reconcile(full))
+			lastsweep = now;
+		/* a walk doesn't put off the routine sweep */
+		armreconciletimer(lastsweep + CGRPFS_RECONCILE_INTERVAL - now);
+	} else if (ev->kind == CGE_TIMER && ev->ident == CGT_SNAPSHOT)
+		persist_snapshot();
+	else if (ev->kind == CGE_TIMER && ev->ident == CGT_HANDOFF)
+		; /* left over from a failed handoff */
+	else
+		assert(!"Unreached");
+}
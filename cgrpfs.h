@@ -12,7 +12,19 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 
-#ifdef CGRPFS_THREADED
+/* glibc's sys/queue.h lacks this */
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar)                              \
+	for ((var) = LIST_FIRST((head));                                       \
+		(var) && ((tvar) = LIST_NEXT((var), field), 1); (var) = (tvar))
+#endif
+
+/* FUSE daemons with worker threads lock as the threaded ones always do */
+#if defined(CGRPFS_THREADED) || defined(CGRPFS_WORKERS)
+#define CGRPFS_LOCKING
+#endif
+
+#ifdef CGRPFS_LOCKING
 #include <pthread.h>
 
 #define CGMGR_LOCKED                                                           \
@@ -24,26 +36,44 @@ void _unlock_cgmgr_(int *unused);
 #define CGMGR_LOCKED
 #endif
 
+#include "cgrpfs_proto.h"
+#include "cgrpfs_trace.h"
 #include "uthash.h"
 
 /* an entry in the pid => node hashtable */
 typedef struct pid_hash_entry {
 	uintptr_t pid;
 	struct cg_node *node;
+	uint64_t since; /* ms since the Epoch it was attached, or 0 if forked */
+	unsigned seen; /* last reconciliation which found it running */
+	uint64_t utime, stime; /* CPU usec, as last sampled */
 	UT_hash_handle hh;
 } pid_hash_entry_t;
 
+/* the credentials of a writer, for checking what it may do to the tree */
+typedef struct cg_cred {
+	uid_t uid;
+	gid_t gid;
+} cg_cred_t;
+
 typedef struct poll_request {
 	LIST_ENTRY(poll_request) pollreqs;
 
 	struct cg_node *node;
 } poll_request_t;
 
-/* a listener for emptiness/exit events */
+/* a listener for emptiness/exit events, or a control socket client */
 typedef struct listener {
 	LIST_ENTRY(listener) listeners;
 
 	int fd;
+	bool control; /* is it connected to the control socket? */
+	uid_t uid; /* credentials of the peer */
+	gid_t gid;
+	bool subscribed; /* has it switched to the sequenced protocol? */
+	uint32_t subflags; /* CGRPFS_SUB_* flags it subscribed with */
+	bool passive; /* is it an instance's notify server socket? */
+	struct cg_inst *inst; /* instance it listens to, or NULL for all */
 } listener_t;
 
 /* kind of CGroupFS node */
@@ -53,6 +83,16 @@ typedef enum cg_nodetype {
 	CGN_PROCS, /* cgroup.procs file */
 	CGN_RELEASE_AGENT, /* release_agent file */
 	CGN_NOTIFY_ON_RELEASE, /* notify_on_release file */
+	CGN_KILL, /* cgroup.kill file */
+	CGN_FREEZE, /* cgroup.freeze file */
+	CGN_PIDS_CURRENT, /* pids.current file */
+	CGN_PIDS_MAX, /* pids.max file */
+	CGN_PIDS_EVENTS, /* pids.events file */
+	CGN_CPU_STAT, /* cpu.stat file */
+	CGN_MEMORY_CURRENT, /* memory.current file */
+	CGN_STAT, /* cgroup.stat file */
+	CGN_AUTOREMOVE, /* cgroup.autoremove file */
+	CGN_DAEMON_STATS, /* cgrpfs.stats file */
 	CGN_CG_DIR, /* cgroup directory */
 	CGN_PID_ROOT_DIR, /* cgroup.meta root dir */
 	CGN_PID_DIR, /* cgroup.meta/$pid directory */
@@ -62,6 +102,7 @@ typedef enum cg_nodetype {
 /* node for all entries in the CGroupFS */
 typedef struct cg_node {
 	LIST_ENTRY(cg_node) entries;
+	TAILQ_ENTRY(cg_node) reapentries; /* in cgmgr.reaps, if reaping */
 
 	char *name;
 	cg_nodetype_t type;
@@ -77,25 +118,92 @@ typedef struct cg_node {
 	LIST_HEAD(cg_node_list, cg_node) subnodes;
 
 	/* for cgroup dirs */
-	bool notify;
-	char *agent;
+	uint64_t id; /* stable ID, never reused */
+	unsigned npids; /* PIDs directly within */
+	unsigned nsubpids; /* PIDs within it or any descendant */
+	unsigned ndescendants; /* CGroups below it */
+	unsigned long nforks; /* forks ever tracked within its subtree */
+	unsigned long nexits; /* exits ever seen within its subtree */
+	unsigned long nsigexits; /* of those, how many were by a signal */
+	bool killing; /* SIGKILL anything that joins until it empties? */
+	bool frozen; /* has 1 been written to its cgroup.freeze? */
+	long pidsmax; /* pids.max, or -1 if unlimited */
+	unsigned long pidsevents; /* forks killed for exceeding pids.max */
+	uint64_t utime, stime; /* CPU usec of PIDs within, as last sampled */
+	uint64_t exitutime, exitstime; /* CPU usec of PIDs that exited in it */
+	uint64_t rss; /* resident bytes of PIDs within, as last sampled */
+	bool autoremove; /* delete it once it has been empty a while? */
+	bool reaping; /* is it queued for deletion? */
+	uint64_t reapat; /* when to delete it, in monotonic ms */
+	bool notify; /* run the release agent when it empties? */
+	char *agent; /* release agent, for the root CGroup */
+	bool attrset; /* has its mode or owner been changed? */
+	unsigned snapidx; /* its index in the last snapshot taken */
+	unsigned nmounts; /* instances rooted at it or below */
 } cg_node_t;
 
+/*
+ * An instance: a further mount, e.g. for a container, serving the subtree of
+ * one CGroup as a hierarchy of its own. It shares the event loop and PID map,
+ * and its notify socket sees only events within the subtree.
+ */
+typedef struct cg_inst {
+	LIST_ENTRY(cg_inst) insts;
+
+	cg_node_t *root; /* CGroup at its root */
+	char *mountpoint;
+	char *notifypath; /* its notify socket, or NULL */
+	listener_t server; /* notify server, if fd isn't -1 */
+	void *fs; /* the filesystem session serving it */
+} cg_inst_t;
+
+/* words of filesystem session parameters kept for a handoff */
+#define CGRPFS_FSINFO_MAX 8
+
 /* the cgfs manager singleton */
 typedef struct cgmgr {
 	struct fuse *fuse;
 	char *mountpoint;
 	int mt; /* is it multithreaded? */
-	int kq; /* kernel queue fd */
+	int evfd; /* event backend fd */
 	int notifyfd; /* notification server fd for exit and emptiness events */
+	int controlfd; /* control server fd for queries */
+	int handofffd; /* server fd for a successor to take over, or -1 */
+	int fsfd; /* filesystem device handed over by a predecessor, or -1 */
+	/* parameters of the filesystem session, opaque to the core */
+	uint32_t fsinfo[CGRPFS_FSINFO_MAX];
 
 	LIST_HEAD(listeners, listener) listeners;
+	LIST_HEAD(controls, listener) controls; /* control socket clients */
+	LIST_HEAD(insts, cg_inst) insts; /* instances mounted */
+	unsigned ninsts;
+
+	uint64_t epoch; /* identifies this run, for resuming listeners */
+	uint64_t seq; /* last event sequence number assigned */
+	struct cgrpfs_event history[CGRPFS_HISTORY_MAX]; /* ring, by seq */
+	char *histpath[CGRPFS_HISTORY_MAX]; /* cgroup path of each, if known */
+
+	uint64_t nextid; /* next cgroup ID to assign */
+	int nattachsubs; /* how many listeners want attach events? */
+	int npathsubs; /* how many listeners want cgroup paths? */
+	int nkilling; /* how many CGroups are being killed? */
+	int nfrozen; /* how many CGroups are frozen? */
+	int nlimited; /* how many CGroups have a pids.max? */
+	int ncgevsubs; /* how many listeners want cgroup.events changes? */
+
+	bool tracing; /* is a trace being recorded? */
+	bool persisting; /* are changes being journalled? */
+	bool replaying; /* replaying a trace; never touch the PIDs in it */
+	unsigned reconcilegen; /* reconciliations with the process table run */
 
 	pid_hash_entry_t *pidcg; /* map pid => node */
 
+	/* emptied autoremove CGroups, in order of deletion time */
+	TAILQ_HEAD(reaps, cg_node) reaps;
+
 	cg_node_t *rootnode, *metanode;
 
-#ifdef CGRPFS_THREADED
+#ifdef CGRPFS_LOCKING
 	pthread_mutex_t lock;
 	/*
 	 * TODO: If it turns out adding events to kqueue from another thread is
@@ -114,10 +222,302 @@ typedef struct cgn_filedesc {
 	char *buf; /* file contents - pre-filled on open() for consistency */
 } cg_filedesc_t;
 
+/* event backend timer identifiers */
+enum cg_timer {
+	CGT_REAP = 1, /* next autoremove CGroup is due for deletion */
+	CGT_RECONCILE, /* PID map is due for reconciliation */
+	CGT_SNAPSHOT, /* state is due for a snapshot */
+	CGT_HANDOFF, /* marks the end of events queued during a handoff */
+};
+
+/* kind of event from the event backend */
+typedef enum cg_evkind {
+	CGE_READ, /* an fd is readable; ident is the fd */
+	CGE_TIMER, /* a timer fired; ident is its cg_timer */
+	CGE_FORK, /* a tracked PID forked; ident is the child, data the parent */
+	CGE_EXIT, /* a tracked PID exited; ident is the PID, data its status */
+	CGE_TRACKERR, /* a fork may have been missed */
+} cg_evkind_t;
+
+/* an event from the event backend */
+typedef struct cg_event {
+	cg_evkind_t kind;
+	uintptr_t ident;
+	intptr_t data;
+	void *udata; /* as given to ev_watchfd */
+} cg_event_t;
+
+/*
+ * The event backend, which watches fds, runs timers, and tracks processes and
+ * all their descendants. One implementation is built in: Kernel Queues on the
+ * BSDs (cgrpfs_ev_kqueue.c), the proc connector on Linux (cgrpfs_ev_linux.c).
+ */
+
+/* set up the backend; returns an fd which is readable when events wait */
+int ev_init(void);
+/* watch an fd for readability; it is unwatched when closed */
+int ev_watchfd(int fd, void *udata);
+/* stop watching an fd, e.g. one also open in another process */
+int ev_unwatchfd(int fd);
+/* (re)arm a one-shot timer to fire in ms milliseconds */
+int ev_settimer(enum cg_timer id, uint64_t ms);
+/* track a PID and, from now on, all its descendants */
+int ev_track(pid_t pid);
+/*
+ * track many PIDs at once, as with ev_track; errors[i] is set to 0 or the
+ * errno for pids[i]
+ */
+void ev_trackmany(const pid_t *pids, int *errors, size_t n);
+/* stop tracking a PID */
+int ev_untrack(pid_t pid);
+/* wait for an event; returns 1, 0 if interrupted, or -1 on error */
+int ev_wait(cg_event_t *ev);
+/* take an event if one is pending; returns 1, 0 if none is, or -1 on error */
+int ev_poll(cg_event_t *ev);
+
+/* counts kept by the FUSE daemon's scheduler, for tuning its budgets */
+typedef struct sched_stats {
+	unsigned long rounds; /* rounds of events, then requests */
+	unsigned long events; /* process events handled */
+	unsigned long fullbatches; /* rounds whose batch of events was full */
+	uint64_t eventlag, eventlagmax; /* us from read to handled */
+	unsigned long requests; /* filesystem requests served */
+	unsigned long sharesspent; /* times a session used its whole share */
+	uint64_t requestlag, requestlagmax; /* us from seen ready to served */
+	uint64_t requesttimemax; /* most us spent on requests in a round */
+} sched_stats_t;
+
+extern sched_stats_t sched_stats;
+
 /* set up the cgmgr */
 void cgmgr_init(void);
-/* accept a connection on the notify passive socket */
-void cgmgr_accept(void);
+#ifdef CGRPFS_LOCKING
+/* handle events on a thread of their own, as threaded builds always do */
+void cgmgr_startevents(void);
+#endif
+/* set up the CGroup tree and PID map alone, as cgmgr_init does */
+void cgmgr_initstate(void);
+/* accept a connection on a notify passive socket, of inst if it is set */
+void cgmgr_accept(int fd, cg_inst_t *inst);
+/* handle an event not belonging to the FUSE channel */
+void cgmgr_event(cg_event_t *ev);
+/* create a listening seqpacket socket at path and watch it for connections */
+int cgmgr_listen(const char *path);
+/* create a listening seqpacket socket at path; returns it, or -1 */
+int cgmgr_bind(const char *path);
+/* disconnect the listeners of an instance */
+void cgmgr_unlisten(cg_inst_t *inst);
+
+/* create the shared-memory PID => CGroup table */
+void shm_init(void);
+/* is the shared-memory slot for a CGroup ID free? */
+bool shm_slotfree(uint64_t id);
+/* publish which CGroup a PID belongs to (or none if node is NULL) */
+void shm_setpid(pid_t pid, cg_node_t *node);
+/* publish the path of a CGroup */
+void shm_setcg(cg_node_t *node);
+/* republish the paths of a CGroup and its descendants, e.g. after rename */
+void shm_setcgtree(cg_node_t *node);
+/* withdraw a CGroup from the shared-memory table */
+void shm_delcg(cg_node_t *node);
+
+/* milliseconds an autoremove CGroup must stay empty before it is deleted */
+#define CGRPFS_REAP_GRACE 2000
+
+/* minimum milliseconds between samples of the process table */
+#define CGRPFS_SAMPLE_INTERVAL 1000
+
+/* refresh every CGroup's CPU and memory figures, if they are stale */
+void proctab_sample(void);
+/* get the real and effective UIDs of a process; returns 0 or -errno */
+int proctab_owner(pid_t pid, uid_t *ruid, uid_t *euid);
+
+/* milliseconds between routine reconciliations of the PID map */
+#define CGRPFS_RECONCILE_INTERVAL 60000
+/* milliseconds to wait after a fork may have been missed, to gather more */
+#define CGRPFS_RECONCILE_DELAY 100
+/* most processes with missed forks to walk from, before sweeping instead */
+#define CGRPFS_RECONCILE_SUSPECTS 64
+
+/* counts kept by the reconciler */
+typedef struct reconcile_stats {
+	unsigned long runs; /* sweeps of the whole process table run */
+	unsigned long walks; /* walks of the subtrees of suspects run */
+	unsigned long adopted; /* processes found whose fork was missed */
+	unsigned long stale; /* PIDs dropped whose exit was missed */
+} reconcile_stats_t;
+
+extern reconcile_stats_t reconcile_stats;
+
+/*
+ * Note that a fork by a process may have been missed, or if pid is 0, that
+ * anything may have been, so that the next reconciliation sweeps.
+ */
+void proctab_suspect(pid_t pid);
+/*
+ * Bring the PID map in line with the process table. A sweep, made if full is
+ * set or anything may have been missed, reads the whole table: it tracks
+ * processes whose fork was missed, and drops PIDs whose exit was. Otherwise,
+ * only the processes noted by proctab_suspect are reconciled, by walking the
+ * subtrees of their nearest tracked ancestors. Returns whether it swept.
+ */
+bool proctab_reconcile(bool full);
+/*
+ * Attach every running process: to the CGroup named for it in the map at
+ * mappath, if set, whose lines are "PID /path"; or else to the CGroup it was
+ * recovered to, or its parent's, or the root CGroup. Recovered PIDs which are
+ * no longer running are forgotten.
+ */
+void proctab_adopt(const char *mappath);
+
+/* counts kept by the release agent spawner */
+typedef struct release_stats {
+	unsigned long spawned; /* agents started */
+	unsigned long failed; /* agents that failed to start or exited nonzero */
+	unsigned long coalesced; /* releases merged with one already queued */
+	unsigned long dropped; /* releases dropped for want of queue space */
+} release_stats_t;
+
+extern release_stats_t release_stats;
+
+/* start the release agent spawner thread */
+void release_init(void);
+/* set the release agent; an empty string disables it. returns 0 or -errno */
+int release_setagent(const char *agent);
+/*
+ * queue a run of the release agent for a CGroup that has emptied, if it has
+ * notify_on_release set and an agent is set
+ */
+void release_enqueue(cg_node_t *node);
+
+/* levels of the emergency memory reserve */
+typedef struct reserve_stats {
+	unsigned pids; /* PID entries left in reserve */
+	unsigned paths; /* exit event path buffers left in reserve */
+	unsigned long pidstaken; /* PID entries ever taken from reserve */
+	unsigned long pathstaken; /* path buffers ever taken from reserve */
+	unsigned long mkdirrefused; /* CGroups refused while it was low */
+} reserve_stats_t;
+
+extern reserve_stats_t reserve_stats;
+
+/* preallocate the emergency memory reserve */
+void reserve_init(void);
+/* is the reserve low enough that new CGroups should be refused? */
+bool reserve_low(void);
+/* allocate a PID entry, from the reserve if malloc fails */
+pid_hash_entry_t *reserve_pidentry(void);
+/* free a PID entry, returning it to the reserve if that isn't full */
+void reserve_freepidentry(pid_hash_entry_t *entry);
+/* get the full path of a node, in a reserved buffer if malloc fails */
+char *reserve_path(cg_node_t *node);
+/* free a path from reserve_path */
+void reserve_freepath(char *path);
+
+/* milliseconds between fsyncs of the journal, bounding what a crash loses */
+#define CGRPFS_PERSIST_SYNC 1000
+/* milliseconds between snapshots, if anything has changed */
+#define CGRPFS_PERSIST_INTERVAL 600000
+/* bytes of journal after which a snapshot is taken early */
+#define CGRPFS_PERSIST_JOURNALMAX (16 * 1024 * 1024)
+/* bytes of journal to buffer before giving up until the next snapshot */
+#define CGRPFS_PERSIST_BUFMAX (64 * 1024 * 1024)
+
+/* counts kept by the state persister */
+typedef struct persist_stats {
+	unsigned long snapshots; /* snapshots written */
+	unsigned long syncs; /* fsyncs of the journal */
+	unsigned long overflows; /* times the journal buffer filled up */
+	unsigned long errors; /* failures to write the snapshot or journal */
+} persist_stats_t;
+
+extern persist_stats_t persist_stats;
+
+/*
+ * Use the directory dir, if it is set, to save state; if recover is set, first
+ * recover the state saved there.
+ */
+void persist_init(const char *dir, bool recover);
+/* start saving state, once what was recovered has been checked */
+void persist_start(void);
+/* take a snapshot, if anything has changed since the last */
+void persist_snapshot(void);
+/* journal changes to the state; only call these if cgmgr.persisting */
+void persist_mkdir(cg_node_t *node);
+void persist_rmdir(cg_node_t *node);
+void persist_rename(cg_node_t *node, const char *oldname);
+void persist_setattr(cg_node_t *node);
+void persist_attach(cg_node_t *node, pid_t pid);
+void persist_fork(pid_t pid, pid_t ppid);
+void persist_exit(pid_t pid);
+/* wait until everything journalled so far has been written out */
+void persist_flush(void);
+/*
+ * Encode the whole state, including the settings of control files and the IDs
+ * of CGroups, for a handoff. Returns a buffer to free, or NULL.
+ */
+char *persist_encode(size_t *lenout);
+/* apply state encoded by persist_encode; returns 0 or -1 if malformed */
+int persist_decode(const char *data, size_t len);
+
+/* socket at which a running daemon listens for a successor to take over */
+#define CGRPFS_HANDOFF_PATH "/var/run/cgrpfs.handoff"
+
+/* start listening for a successor */
+void handoff_listen(void);
+/*
+ * Hand over the state, the filesystem device fsfd and all sockets to a
+ * successor connecting to the handoff socket. Returns 0 once the successor has
+ * taken over, when the caller should exit without unmounting, or -1 if it
+ * failed, when the caller carries on.
+ */
+int handoff_give(int fsfd);
+/*
+ * Take over from the running daemon, if want is set. Returns whether it did;
+ * if so, cgmgr.fsfd and cgmgr.fsinfo hold the filesystem session.
+ */
+bool handoff_take(const char *want);
+
+/*
+ * Mount an instance at mountpoint serving the CGroup at path, which is created
+ * if need be, and listening at notifypath if that is set. Unless uid is -1, the
+ * CGroup and its files are given to uid and gid. Returns 0 or -errno, with
+ * *out set to the instance.
+ */
+int inst_mount(const char *path, const char *mountpoint,
+	const char *notifypath, uid_t uid, gid_t gid, cg_inst_t **out);
+/* unmount the instance mounted at mountpoint; returns 0 or -errno */
+int inst_unmountat(const char *mountpoint);
+/* unmount an instance, e.g. once its filesystem session has ended */
+void inst_unmount(cg_inst_t *inst);
+/* handle a write through an instance, as nodewrite; returns 0 or -errno */
+int inst_write(cg_inst_t *inst, cg_node_t *node, const char *buf, size_t len,
+	const cg_cred_t *cred);
+
+/*
+ * Provided by the front end: start serving an instance at its mountpoint,
+ * setting inst->fs, or stop and unmount it. fs_mount returns 0 or -errno.
+ */
+int fs_mount(cg_inst_t *inst);
+void fs_unmount(cg_inst_t *inst);
+
+/* start recording a trace to path, if it is set */
+void trace_init(const char *path);
+/* record an event from the backend; only call if cgmgr.tracing */
+void trace_event(const cg_event_t *ev);
+/*
+ * Record a filesystem operation; only call if cgmgr.tracing. data is the new
+ * path of a rename, or the data of a write.
+ */
+void trace_op(enum cgrpfs_trace_type type, const char *path, int32_t arg,
+	const void *data, size_t len);
+
+/* set up the control socket */
+void ctl_init(void);
+/* accept a connection on the control passive socket */
+void ctl_accept(void);
+/* handle a request from a control socket client */
+void ctl_read(listener_t *client);
 
 /* Create a new node and initialise it enough to let delnode not fail */
 cg_node_t *newnode(cg_node_t *parent, const char *name, cg_nodetype_t type);
@@ -132,22 +532,94 @@ void removenode(cg_node_t *node);
  */
 void delnode(cg_node_t *node);
 
+/*
+ * Hold a node and its ancestors for an open file handle, so that if they are
+ * removed they are only marked for deletion.
+ */
+void nodehold(cg_node_t *node);
+/* Drop a hold from nodehold, deleting any of them that were removed meanwhile */
+void noderelease(cg_node_t *node);
+
 /* Lookup a node by filename within another node. */
 cg_node_t *lookupfile(cg_node_t *node, const char *filename);
 /* Lookup a node by path, or the second-last node of that path */
 cg_node_t *lookupnode(const char *path, bool secondlast);
+/* Likewise, with the path relative to root */
+cg_node_t *lookupnodeat(cg_node_t *root, const char *path, bool secondlast);
+/*
+ * Find the deepest existing node along a path. *rest is set to the part of the
+ * path below that node, which is empty if the whole path exists.
+ */
+cg_node_t *lookupprefix(const char *path, const char **rest);
+/* Likewise, with the path relative to root */
+cg_node_t *lookupprefixat(cg_node_t *root, const char *path, const char **rest);
+/*
+ * Create CGroup directories for each component of the relative path rest
+ * under node, as with mkdir -p. On success *out is the last one created.
+ */
+int mkcgdirs(cg_node_t *node, const char *rest, mode_t perms, uid_t uid,
+	gid_t gid, cg_node_t **out);
 /* Get full path of node */
 char *nodefullpath(cg_node_t *node);
+/* Note that a node's mode or owner has been changed */
+void nodeattrchanged(cg_node_t *node);
+/* Is node the CGroup ancestor, or one of its descendants? */
+bool nodewithin(cg_node_t *node, cg_node_t *ancestor);
 
 /* Get file contents of node. */
 char *nodetxt(cg_node_t *node);
 /* Get cgroups.proc file contents for node */
 char *procsfiletxt(cg_node_t *node);
 
+/*
+ * Handle a write to a pseudo-file by a writer with credentials cred, or by the
+ * daemon itself if cred is NULL; returns 0 or -errno
+ */
+int nodewrite(cg_node_t *node, const char *buf, size_t len,
+	const cg_cred_t *cred);
+/* May a writer access a node in the way given (a mask of S_IWOTH etc.)? */
+bool nodemayaccess(const cg_cred_t *cred, cg_node_t *node, mode_t mode);
+/* May a writer move a PID into a CGroup? Returns 0 or -errno */
+int mayattach(const cg_cred_t *cred, cg_node_t *node, pid_t pid);
+
 /* Attach a PID to a CGroup */
 int attachpid(cg_node_t *node, pid_t pid);
-/* Detach a PID from its owner CGroup and stop tracking it if untrack set */
+/* Attach a PID forked by ppid within a CGroup, as on a fork event */
+int adoptpid(cg_node_t *node, pid_t pid, pid_t ppid);
+/* Like adoptpid, but placing the PID as with placepid; it must be tracked */
+pid_hash_entry_t *placeforked(cg_node_t *node, pid_t pid, pid_t ppid);
+/*
+ * Put a PID in a CGroup without tracking it, e.g. while recovering state. It
+ * must then be tracked with trackpids or forgotten. Returns its entry or NULL.
+ */
+pid_hash_entry_t *placepid(cg_node_t *node, pid_t pid);
+/* Remove a PID placed with placepid, without any event */
+void forgetpid(pid_t pid);
+/*
+ * Track PIDs already placed, all in one batch, forgetting those that can't be.
+ * since is a time, in ms since the Epoch, by which they were all running.
+ * Returns how many are tracked.
+ */
+size_t trackpids(const pid_t *pids, size_t n, uint64_t since);
+/*
+ * Notify listeners of the state in a CGroup's cgroup.events. Only call this if
+ * cgmgr.ncgevsubs is nonzero.
+ */
+void notify_cgevents(cg_node_t *node);
+/* wait status of a PID whose exit was missed, so its status is unknown */
+#define CGRPFS_WSTAT_LOST (-1)
+
+/*
+ * Detach a PID from its owner CGroup and stop tracking it if untrack set.
+ * wstat is its wait status, or CGRPFS_WSTAT_LOST.
+ */
 int detachpid(pid_t pid, int wstat, bool untrack);
+/*
+ * Notify listeners that a PID joined a CGroup. Only call this if
+ * cgmgr.nattachsubs is nonzero; ppid is 0 for migrations.
+ */
+void notify_attach(pid_t pid, pid_t ppid, cg_node_t *node,
+	enum cgrpfs_evtype type);
 
 extern cgmgr_t cgmgr;
 
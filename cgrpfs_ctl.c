@@ -0,0 +1,607 @@
+/*
+ * Control socket for CGrpFS, answering requests without FUSE round trips.
+ *
+ * Requests are handled as kernel queue events, so in threaded builds each is
+ * handled entirely under the cgmgr lock.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+/* a reply under construction */
+typedef struct ctl_reply {
+	char *buf;
+	size_t len; /* length used */
+	size_t size; /* length allocated */
+} ctl_reply_t;
+
+/* how to undo one batched operation */
+typedef struct batch_undo {
+	cg_node_t *node; /* CGroup created or changed, or NULL if neither */
+	bool created; /* was it created, or only changed? */
+	struct stat attr; /* its attributes before it was changed */
+} batch_undo_t;
+
+static char reqbuf[CGRPFS_CTL_MSGMAX];
+
+/* Get the credentials of the peer of a Unix domain socket. */
+static int
+peercred(int fd, uid_t *uid, gid_t *gid)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return -1;
+	*uid = cred.uid;
+	*gid = cred.gid;
+	return 0;
+#else
+	return getpeereid(fd, uid, gid);
+#endif
+}
+
+/* Grow a reply by len bytes, returning the offset of the new space. */
+static ssize_t
+reply_grow(ctl_reply_t *reply, size_t len)
+{
+	size_t off = reply->len;
+
+	if (reply->len + len > reply->size) {
+		size_t newsize = reply->size ? reply->size : 4096;
+		char *newbuf;
+
+		while (newsize < reply->len + len)
+			newsize *= 2;
+
+		newbuf = realloc(reply->buf, newsize);
+		if (!newbuf)
+			return -1;
+
+		reply->buf = newbuf;
+		reply->size = newsize;
+	}
+
+	reply->len += len;
+	return off;
+}
+
+void
+ctl_init(void)
+{
+	cgmgr.controlfd = cgmgr_listen(CGRPFS_CONTROL_PATH);
+
+	/*
+	 * Queries reveal no more than cgroup.meta, and batches are checked
+	 * against the peer's credentials, so anyone may connect.
+	 */
+	if (chmod(CGRPFS_CONTROL_PATH, 0666) < 0)
+		warn("Failed to set permissions of control socket");
+}
+
+void
+ctl_accept(void)
+{
+	int bufsize = CGRPFS_CTL_BUFSIZE;
+	listener_t *client = malloc(sizeof *client);
+
+	if (!client) {
+		warn("Failed to allocate control client");
+		return;
+	}
+
+	/* a client that doesn't read its replies mustn't block the daemon */
+	client->fd = accept4(cgmgr.controlfd, NULL, 0,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client->fd < 0) {
+		warn("Failed to accept control client");
+		free(client);
+		return;
+	}
+
+	if (peercred(client->fd, &client->uid, &client->gid) < 0) {
+		warn("Failed to get credentials of control client");
+		close(client->fd);
+		free(client);
+		return;
+	}
+
+	client->control = true;
+	client->subscribed = false;
+	client->subflags = 0;
+	client->passive = false;
+	client->inst = NULL;
+
+	/* replies to batched requests can be large */
+	if (setsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, &bufsize,
+		    sizeof bufsize) < 0)
+		warn("Failed to raise control client's send buffer size");
+
+	if (ev_watchfd(client->fd, client) < 0) {
+		warn("Failed to watch control client");
+		close(client->fd);
+		free(client);
+		return;
+	}
+
+	LIST_INSERT_HEAD(&cgmgr.controls, client, listeners);
+}
+
+static void
+delclient(listener_t *client)
+{
+	LIST_REMOVE(client, listeners);
+	close(client->fd);
+	free(client);
+}
+
+/* a queried PID's CGroup, and its index among those queried */
+typedef struct query_ent {
+	cg_node_t *node;
+	uint32_t i;
+} query_ent_t;
+
+/* Order queried PIDs by CGroup, so that those sharing one are adjacent. */
+static int
+querycmp(const void *a, const void *b)
+{
+	const query_ent_t *qa = a, *qb = b;
+
+	if (qa->node->id != qb->node->id)
+		return qa->node->id < qb->node->id ? -1 : 1;
+	return qa->i < qb->i ? -1 : qa->i > qb->i;
+}
+
+/* Answer a batch of PID => CGroup queries. */
+static int
+ctl_query(const struct cgrpfs_ctl_req *req, size_t len, ctl_reply_t *reply)
+{
+	const int32_t *pids = (const int32_t *)(req + 1);
+	struct cgrpfs_pidinfo *info;
+	query_ent_t *ents;
+	uint32_t nents = 0;
+	ssize_t infooff;
+
+	if (req->count > CGRPFS_QUERY_MAX ||
+		len != sizeof *req + req->count * sizeof *pids)
+		return -EINVAL;
+
+	infooff = reply_grow(reply, req->count * sizeof(struct cgrpfs_pidinfo));
+	ents = calloc(req->count ? req->count : 1, sizeof *ents);
+	if (infooff < 0 || !ents) {
+		free(ents);
+		return -ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < req->count; i++) {
+		pid_hash_entry_t *entry;
+		uintptr_t pidp = pids[i];
+		cg_node_t *node = NULL;
+
+		info = (struct cgrpfs_pidinfo *)(reply->buf + infooff) + i;
+		memset(info, 0, sizeof *info);
+		info->pid = pids[i];
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		if (pids[i] <= 0)
+			info->error = EINVAL;
+		else if (entry)
+			node = entry->node;
+		else if (kill(pids[i], 0) < 0 && errno == ESRCH)
+			info->error = ESRCH;
+		else
+			/* untracked are in root CGroup by default */
+			node = cgmgr.rootnode;
+
+		if (node) {
+			info->cgid = node->id;
+			ents[nents].node = node;
+			ents[nents++].i = i;
+		}
+	}
+
+	/* many PIDs share a CGroup; only send its path once */
+	qsort(ents, nents, sizeof *ents, querycmp);
+
+	for (uint32_t j = 0; j < nents;) {
+		cg_node_t *node = ents[j].node;
+		char *path = nodefullpath(node);
+		ssize_t pathoff = -1;
+		size_t pathlen = 0;
+
+		if (path) {
+			pathlen = strlen(path);
+			if ((pathoff = reply_grow(reply, pathlen + 1)) >= 0)
+				memcpy(reply->buf + pathoff, path, pathlen + 1);
+			free(path);
+		}
+
+		/* the reply may have moved as it grew */
+		for (; j < nents && ents[j].node == node; j++) {
+			info = (struct cgrpfs_pidinfo *)(reply->buf + infooff) +
+				ents[j].i;
+			if (pathoff < 0)
+				info->error = ENOMEM;
+			else {
+				info->pathoff = pathoff;
+				info->pathlen = pathlen;
+			}
+		}
+	}
+
+	free(ents);
+
+	return req->count;
+}
+
+/* May the client access a node in the way given (a mask of S_IWOTH etc.)? */
+static bool
+mayaccess(listener_t *client, cg_node_t *node, mode_t mode)
+{
+	cg_cred_t cred = { client->uid, client->gid };
+
+	return nodemayaccess(&cred, node, mode);
+}
+
+/*
+ * Find the first CGroup a mkdir of rest below node created, even if it then
+ * failed, or NULL if none.
+ */
+static cg_node_t *
+mkdirtop(cg_node_t *node, const char *rest)
+{
+	cg_node_t *deepest = lookupprefixat(node, rest, &rest);
+
+	if (deepest == node)
+		return NULL;
+	while (deepest->parent != node)
+		deepest = deepest->parent;
+	return deepest;
+}
+
+/* Apply one batched operation, noting in undo how to undo it. */
+static int
+batch_op(listener_t *client, const struct cgrpfs_batch_op *op,
+	const char *path, batch_undo_t *undo)
+{
+	const char *rest;
+	cg_node_t *node = lookupprefix(path, &rest), *dir;
+	cg_cred_t cred = { client->uid, client->gid };
+	uid_t uid;
+	gid_t gid;
+	int r;
+
+	if (op->type == CGRPFS_BOP_MKDIR) {
+		uid = op->uid == (uint32_t)-1 ? client->uid : op->uid;
+		gid = op->gid == (uint32_t)-1 ? client->gid : op->gid;
+
+		if (*rest == '\0')
+			return node->type == CGN_CG_DIR ? 0 : -EEXIST;
+		else if (node->type != CGN_CG_DIR)
+			return -ENOTDIR;
+		else if (!mayaccess(client, node, S_IWOTH))
+			return -EACCES;
+		else if (client->uid != 0 &&
+			(uid != client->uid || gid != client->gid))
+			return -EPERM;
+
+		r = mkcgdirs(node, rest, op->mode & 07777, uid, gid, &dir);
+		undo->node = mkdirtop(node, rest);
+		undo->created = true;
+		return r;
+	}
+
+	if (*rest != '\0')
+		return -ENOENT;
+	else if (node->type != CGN_CG_DIR)
+		return -ENOTDIR;
+
+	switch (op->type) {
+	case CGRPFS_BOP_CHOWN:
+		if (client->uid != 0)
+			return -EPERM;
+		undo->node = node;
+		undo->attr = node->attr;
+		if (op->uid != (uint32_t)-1)
+			node->attr.st_uid = op->uid;
+		if (op->gid != (uint32_t)-1)
+			node->attr.st_gid = op->gid;
+		nodeattrchanged(node);
+		return 0;
+
+	case CGRPFS_BOP_CHMOD:
+		if (client->uid != 0 && client->uid != node->attr.st_uid)
+			return -EPERM;
+		undo->node = node;
+		undo->attr = node->attr;
+		node->attr.st_mode &= ~(07777);
+		node->attr.st_mode |= op->mode & 07777;
+		nodeattrchanged(node);
+		return 0;
+
+	case CGRPFS_BOP_ATTACH:
+		if (op->pid <= 0)
+			return -EINVAL;
+		else if ((r = mayattach(&cred, node, op->pid)) < 0)
+			return r;
+
+		r = attachpid(node, op->pid);
+		if (r < 0)
+			return r;
+		if (cgmgr.nattachsubs)
+			notify_attach(op->pid, 0, node, CGRPFS_EV_MIGRATE);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Remove a CGroup created by a batch, and those the batch created within it,
+ * but for any a PID has since been attached within, as attaching can't be
+ * undone.
+ */
+static void
+prunecreated(cg_node_t *node)
+{
+	cg_node_t *subnode, *tmp;
+
+	if (node->nsubpids == 0) {
+		removenode(node);
+		return;
+	}
+
+	LIST_FOREACH_SAFE (subnode, &node->subnodes, entries, tmp)
+		if (subnode->type == CGN_CG_DIR)
+			prunecreated(subnode);
+}
+
+/* Undo the operations of a stopped batch, latest first. */
+static void
+batch_undo(batch_undo_t *undo, uint32_t n)
+{
+	while (n-- > 0) {
+		cg_node_t *node = undo[n].node;
+
+		if (!node)
+			continue;
+		else if (!undo[n].created) {
+			node->attr.st_mode = undo[n].attr.st_mode;
+			node->attr.st_uid = undo[n].attr.st_uid;
+			node->attr.st_gid = undo[n].attr.st_gid;
+			nodeattrchanged(node);
+		} else
+			prunecreated(node);
+	}
+}
+
+/* Apply a batch of operations, giving a result for each. */
+static int
+ctl_batch(listener_t *client, const struct cgrpfs_ctl_req *req, size_t len,
+	ctl_reply_t *reply)
+{
+	size_t off = sizeof *req;
+	ssize_t resoff;
+	batch_undo_t *undo;
+	bool stopped = false;
+
+	if (req->count > CGRPFS_BATCH_MAX)
+		return -EINVAL;
+
+	/* validate the whole batch before applying any of it */
+	for (uint32_t i = 0; i < req->count; i++) {
+		const struct cgrpfs_batch_op *op;
+
+		if (len - off < sizeof *op)
+			return -EINVAL;
+		op = (const struct cgrpfs_batch_op *)(reqbuf + off);
+		if (op->len <= sizeof *op || op->len > len - off ||
+			(op->len & 7) != 0 ||
+			memchr(op + 1, '\0', op->len - sizeof *op) == NULL)
+			return -EINVAL;
+		off += op->len;
+	}
+
+	resoff = reply_grow(reply, req->count * sizeof(int32_t));
+	undo = calloc(req->count ? req->count : 1, sizeof *undo);
+	if (resoff < 0 || !undo) {
+		free(undo);
+		return -ENOMEM;
+	}
+
+	off = sizeof *req;
+	for (uint32_t i = 0; i < req->count; i++) {
+		const struct cgrpfs_batch_op *op;
+		int32_t result;
+
+		op = (const struct cgrpfs_batch_op *)(reqbuf + off);
+		off += op->len;
+
+		if (stopped)
+			result = ECANCELED;
+		else
+			result = -batch_op(client, op, (const char *)(op + 1),
+				&undo[i]);
+
+		if (result && (req->flags & CGRPFS_BATCH_STOP) && !stopped) {
+			/* what the failed operation did by then goes too */
+			batch_undo(undo, i + 1);
+			stopped = true;
+		}
+
+		memcpy(reply->buf + resoff + i * sizeof result, &result,
+			sizeof result);
+	}
+
+	free(undo);
+	return req->count;
+}
+
+/* Take the next NUL-terminated string of a request, or NULL. */
+static const char *
+takestr(const char **p, const char *end)
+{
+	const char *s = *p, *nul = memchr(s, '\0', end - s);
+
+	if (!nul)
+		return NULL;
+	*p = nul + 1;
+	return s;
+}
+
+/* Mount an instance. */
+static int
+ctl_mount(listener_t *client, const struct cgrpfs_ctl_req *req, size_t len,
+	ctl_reply_t *reply)
+{
+	const struct cgrpfs_mount *m = (const struct cgrpfs_mount *)(req + 1);
+	const char *p = (const char *)(m + 1), *end = reqbuf + len;
+	const char *path, *mountpoint, *notifypath;
+	cg_inst_t *inst;
+	ssize_t idoff;
+	int r;
+
+	if (client->uid != 0)
+		return -EPERM;
+	else if (req->count != 1 || len < sizeof *req + sizeof *m ||
+		(path = takestr(&p, end)) == NULL ||
+		(mountpoint = takestr(&p, end)) == NULL ||
+		(notifypath = takestr(&p, end)) == NULL)
+		return -EINVAL;
+
+	if ((idoff = reply_grow(reply, sizeof inst->root->id)) < 0)
+		return -ENOMEM;
+	if ((r = inst_mount(path, mountpoint, notifypath, m->uid, m->gid,
+		     &inst)) < 0)
+		return r;
+
+	memcpy(reply->buf + idoff, &inst->root->id, sizeof inst->root->id);
+	return 1;
+}
+
+/* Unmount an instance. */
+static int
+ctl_unmount(listener_t *client, const struct cgrpfs_ctl_req *req, size_t len)
+{
+	const char *p = (const char *)(req + 1), *end = reqbuf + len;
+	const char *mountpoint;
+
+	if (client->uid != 0)
+		return -EPERM;
+	else if (req->count != 1 || (mountpoint = takestr(&p, end)) == NULL)
+		return -EINVAL;
+
+	return inst_unmountat(mountpoint);
+}
+
+/*
+ * Send a reply, disconnecting a client that has gone or isn't reading its
+ * replies. Returns 0 or an errno value.
+ */
+static int
+sendreply(listener_t *client, const void *buf, size_t len)
+{
+	int error;
+
+	if (send(client->fd, buf, len, MSG_NOSIGNAL) >= 0)
+		return 0;
+
+	error = errno;
+	if (error == EPIPE)
+		delclient(client);
+	else if (error == EAGAIN) {
+		/* it isn't reading its replies; don't wait for it */
+		warnx("Dropping control client not reading replies");
+		delclient(client);
+	} else if (error != EMSGSIZE) {
+		errno = error;
+		warn("Failed to send control reply");
+	}
+
+	return error;
+}
+
+void
+ctl_read(listener_t *client)
+{
+	struct cgrpfs_ctl_req *req = (struct cgrpfs_ctl_req *)reqbuf;
+	struct cgrpfs_ctl_reply *hdr;
+	ctl_reply_t reply = { NULL, 0, 0 };
+	struct iovec iov = { .iov_base = reqbuf, .iov_len = sizeof reqbuf };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t len;
+	int r;
+
+	len = recvmsg(client->fd, &msg, 0);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	else if (len <= 0) {
+		/* disconnected */
+		delclient(client);
+		return;
+	} else if (len < sizeof *req) {
+		warnx("Short request from control client");
+		delclient(client);
+		return;
+	}
+
+	if (reply_grow(&reply, sizeof *hdr) < 0) {
+		struct cgrpfs_ctl_reply nomem;
+
+		/* the client must still have an answer */
+		warnx("Out of memory");
+		memset(&nomem, 0, sizeof nomem);
+		nomem.op = req->op;
+		nomem.cookie = req->cookie;
+		nomem.error = ENOMEM;
+		sendreply(client, &nomem, sizeof nomem);
+		return;
+	}
+
+	if (msg.msg_flags & MSG_TRUNC)
+		r = -E2BIG;
+	else if (req->op == CGRPFS_OP_QUERY)
+		r = ctl_query(req, len, &reply);
+	else if (req->op == CGRPFS_OP_BATCH)
+		r = ctl_batch(client, req, len, &reply);
+	else if (req->op == CGRPFS_OP_MOUNT)
+		r = ctl_mount(client, req, len, &reply);
+	else if (req->op == CGRPFS_OP_UNMOUNT)
+		r = ctl_unmount(client, req, len);
+	else
+		r = -EOPNOTSUPP;
+
+	hdr = (struct cgrpfs_ctl_reply *)reply.buf;
+	memset(hdr, 0, sizeof *hdr);
+	hdr->op = req->op;
+	hdr->cookie = req->cookie;
+	if (r < 0) {
+		hdr->error = -r;
+		reply.len = sizeof *hdr;
+	} else
+		hdr->count = r;
+
+	if (sendreply(client, reply.buf, reply.len) == EMSGSIZE) {
+		/* too large for the socket buffer */
+		hdr->error = E2BIG;
+		hdr->count = 0;
+		sendreply(client, hdr, sizeof *hdr);
+	}
+
+	free(reply.buf);
+}
@@ -0,0 +1,162 @@
+/*
+ * Kernel Queues event backend.
+ *
+ * Processes are tracked with the process filter and NOTE_TRACK, which has the
+ * kernel attach the filter to every descendant as it is forked.
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cgrpfs.h"
+
+/* most PIDs to register with one kevent() call */
+#define TRACKBATCH 256
+
+static int kq = -1;
+
+int
+ev_init(void)
+{
+	if ((kq = kqueue()) < 0)
+		return -1;
+	return kq;
+}
+
+int
+ev_watchfd(int fd, void *udata)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+int
+ev_unwatchfd(int fd)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+int
+ev_settimer(enum cg_timer id, uint64_t ms)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, id, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, ms, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+int
+ev_track(pid_t pid)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT | NOTE_TRACK, 0, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+void
+ev_trackmany(const pid_t *pids, int *errors, size_t n)
+{
+#ifdef EV_RECEIPT
+	static struct kevent changes[TRACKBATCH], receipts[TRACKBATCH];
+
+	for (size_t i = 0; i < n; i += TRACKBATCH) {
+		size_t m = n - i < TRACKBATCH ? n - i : TRACKBATCH;
+		int r;
+
+		/* a receipt for each, carrying its error, instead of events */
+		for (size_t j = 0; j < m; j++) {
+			EV_SET(&changes[j], pids[i + j], EVFILT_PROC,
+				EV_ADD | EV_RECEIPT, NOTE_EXIT | NOTE_TRACK, 0,
+				(void *)(uintptr_t)(i + j));
+			errors[i + j] = 0;
+		}
+
+		r = kevent(kq, changes, m, receipts, m, NULL);
+		if (r < 0) {
+			for (size_t j = 0; j < m; j++)
+				errors[i + j] = errno;
+			continue;
+		}
+
+		for (int k = 0; k < r; k++)
+			if (receipts[k].flags & EV_ERROR)
+				errors[(uintptr_t)receipts[k].udata] =
+					receipts[k].data;
+	}
+#else
+	for (size_t i = 0; i < n; i++)
+		errors[i] = ev_track(pids[i]) < 0 ? errno : 0;
+#endif
+}
+
+int
+ev_untrack(pid_t pid)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+/* Get an event, waiting for one for up to timeout, or forever if NULL. */
+static int
+getevent(cg_event_t *ev, const struct timespec *timeout)
+{
+	struct kevent kev;
+	int r;
+
+	for (;;) {
+		r = kevent(kq, NULL, 0, &kev, 1, timeout);
+
+		if (r < 0)
+			return errno == EINTR ? 0 : -1;
+		else if (r == 0 && timeout)
+			return 0;
+		else if (r == 0)
+			continue;
+
+		ev->ident = kev.ident;
+		ev->data = kev.data;
+		ev->udata = kev.udata;
+
+		if (kev.filter == EVFILT_READ)
+			ev->kind = CGE_READ;
+		else if (kev.filter == EVFILT_TIMER)
+			ev->kind = CGE_TIMER;
+		else if (kev.fflags & NOTE_CHILD)
+			ev->kind = CGE_FORK; /* data is the parent PID */
+		else if (kev.fflags & NOTE_EXIT)
+			ev->kind = CGE_EXIT; /* data is the wait status */
+		else if (kev.fflags & NOTE_TRACKERR)
+			ev->kind = CGE_TRACKERR;
+		else
+			continue;
+
+		return 1;
+	}
+}
+
+int
+ev_wait(cg_event_t *ev)
+{
+	return getevent(ev, NULL);
+}
+
+int
+ev_poll(cg_event_t *ev)
+{
+	static const struct timespec now = { 0, 0 };
+
+	return getevent(ev, &now);
+}
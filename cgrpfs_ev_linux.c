@@ -0,0 +1,357 @@
+/*
+ * Linux event backend, for building, testing and benchmarking CGrpFS on Linux.
+ *
+ * fds are watched with epoll and timers are timerfds. Processes are tracked
+ * with the proc connector, which reports every fork and exit on the system
+ * over netlink; a bitmap of tracked PIDs filters these down to the tracked
+ * processes and their descendants, as NOTE_TRACK does for Kernel Queues.
+ * The exit status is taken from the exit event itself. (A pidfd cannot yield
+ * the status of a process that isn't our child.) Reading the proc connector
+ * requires CAP_NET_ADMIN.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+/* the number of timer identifiers */
+#define NTIMERS 8
+
+/* kinds of epoll registration, kept in the top bits of the epoll data */
+enum { REG_FD = 1, REG_TIMER, REG_NETLINK };
+#define REG(kind, val) ((uint64_t)(kind) << 32 | (uint32_t)(val))
+#define REGKIND(data) ((data) >> 32)
+#define REGVAL(data) ((uint32_t)(data))
+
+static int epfd = -1;
+static int nlfd = -1;
+static int timerfds[NTIMERS];
+
+/* udata of each watched fd, indexed by fd */
+static void **fdudata;
+static size_t nfdudata;
+
+/* bitmap of tracked PIDs */
+static uint64_t *tracked;
+static uint32_t pidmax;
+
+static bool
+istracked(pid_t pid)
+{
+	if (pid <= 0 || (uint32_t)pid >= pidmax)
+		return false;
+	return __atomic_load_n(&tracked[pid / 64], __ATOMIC_RELAXED) &
+		(1ULL << (pid % 64));
+}
+
+static void
+settracked(pid_t pid, bool on)
+{
+	if (pid <= 0 || (uint32_t)pid >= pidmax)
+		return;
+	if (on)
+		__atomic_fetch_or(&tracked[pid / 64], 1ULL << (pid % 64),
+			__ATOMIC_RELAXED);
+	else
+		__atomic_fetch_and(&tracked[pid / 64], ~(1ULL << (pid % 64)),
+			__ATOMIC_RELAXED);
+}
+
+/* Subscribe to the proc connector's fork and exit events. */
+static int
+nlsubscribe(void)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC };
+	struct {
+		struct nlmsghdr nlh;
+		struct cn_msg cn;
+		enum proc_cn_mcast_op op;
+	} __attribute__((packed)) msg;
+	int bufsize = 4 * 1024 * 1024;
+
+	nlfd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (nlfd < 0)
+		return -1;
+
+	/* fork storms produce events faster than we might read them */
+	if (setsockopt(nlfd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize,
+		    sizeof bufsize) < 0 &&
+		setsockopt(nlfd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+			sizeof bufsize) < 0)
+		warn("Failed to raise proc connector receive buffer size");
+
+	if (bind(nlfd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof msg);
+	msg.nlh.nlmsg_len = sizeof msg;
+	msg.nlh.nlmsg_type = NLMSG_DONE;
+	msg.cn.id.idx = CN_IDX_PROC;
+	msg.cn.id.val = CN_VAL_PROC;
+	msg.cn.len = sizeof msg.op;
+	msg.op = PROC_CN_MCAST_LISTEN;
+
+	if (send(nlfd, &msg, sizeof msg, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+int
+ev_init(void)
+{
+	struct epoll_event epev;
+	FILE *f;
+
+	pidmax = 4194304 + 1; /* PID_MAX_LIMIT */
+	if ((f = fopen("/proc/sys/kernel/pid_max", "r")) != NULL) {
+		if (fscanf(f, "%u", &pidmax) == 1)
+			pidmax++;
+		fclose(f);
+	}
+
+	tracked = calloc((pidmax + 63) / 64, sizeof *tracked);
+	if (!tracked)
+		return -1;
+
+	for (int i = 0; i < NTIMERS; i++)
+		timerfds[i] = -1;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+
+	if (nlsubscribe() < 0)
+		return -1;
+
+	epev.events = EPOLLIN;
+	epev.data.u64 = REG(REG_NETLINK, nlfd);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, nlfd, &epev) < 0)
+		return -1;
+
+	return epfd;
+}
+
+int
+ev_watchfd(int fd, void *udata)
+{
+	struct epoll_event epev;
+
+	if ((size_t)fd >= nfdudata) {
+		size_t n = fd + 64;
+		void **newudata = realloc(fdudata, n * sizeof *fdudata);
+
+		if (!newudata)
+			return -1;
+		fdudata = newudata;
+		nfdudata = n;
+	}
+	fdudata[fd] = udata;
+
+	epev.events = EPOLLIN;
+	epev.data.u64 = REG(REG_FD, fd);
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev);
+}
+
+int
+ev_unwatchfd(int fd)
+{
+	/* the registration outlives close() while another process has it */
+	return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int
+ev_settimer(enum cg_timer id, uint64_t ms)
+{
+	struct itimerspec its = { .it_value = { .tv_sec = ms / 1000,
+				      .tv_nsec = (ms % 1000) * 1000000 } };
+
+	if (id >= NTIMERS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* zero would disarm it instead */
+	if (ms == 0)
+		its.it_value.tv_nsec = 1;
+
+	if (timerfds[id] < 0) {
+		struct epoll_event epev;
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+		if (fd < 0)
+			return -1;
+
+		epev.events = EPOLLIN;
+		epev.data.u64 = REG(REG_TIMER, id);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+			close(fd);
+			return -1;
+		}
+		timerfds[id] = fd;
+	}
+
+	return timerfd_settime(timerfds[id], 0, &its, NULL);
+}
+
+int
+ev_track(pid_t pid)
+{
+	/* like the process filter, refuse PIDs that don't exist */
+	if (kill(pid, 0) < 0 && errno == ESRCH)
+		return -1;
+
+	settracked(pid, true);
+	return 0;
+}
+
+void
+ev_trackmany(const pid_t *pids, int *errors, size_t n)
+{
+	/* no system call per PID to save, beyond the existence check */
+	for (size_t i = 0; i < n; i++)
+		errors[i] = ev_track(pids[i]) < 0 ? errno : 0;
+}
+
+int
+ev_untrack(pid_t pid)
+{
+	settracked(pid, false);
+	return 0;
+}
+
+/* Read a proc connector message; returns 1 if it gave an event for us. */
+static int
+nlread(cg_event_t *ev)
+{
+	char buf[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct proc_event *pev;
+	ssize_t len;
+
+	len = recv(nlfd, buf, sizeof buf, 0);
+	if (len < 0 && errno == ENOBUFS) {
+		/* the kernel dropped events; forks may have been missed */
+		ev->kind = CGE_TRACKERR;
+		ev->ident = 0;
+		return 1;
+	} else if (len < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type != NLMSG_DONE)
+			continue;
+
+		pev = (struct proc_event *)((struct cn_msg *)NLMSG_DATA(nlh))
+			      ->data;
+
+		switch (pev->what) {
+		case PROC_EVENT_FORK:
+			/* new threads aren't new processes */
+			if (pev->event_data.fork.child_pid !=
+				pev->event_data.fork.child_tgid)
+				continue;
+			else if (!istracked(pev->event_data.fork.parent_tgid))
+				continue;
+
+			settracked(pev->event_data.fork.child_tgid, true);
+			ev->kind = CGE_FORK;
+			ev->ident = pev->event_data.fork.child_tgid;
+			ev->data = pev->event_data.fork.parent_tgid;
+			return 1;
+
+		case PROC_EVENT_EXIT:
+			/* only the whole process's exit matters */
+			if (pev->event_data.exit.process_pid !=
+				pev->event_data.exit.process_tgid)
+				continue;
+			else if (!istracked(pev->event_data.exit.process_tgid))
+				continue;
+
+			settracked(pev->event_data.exit.process_tgid, false);
+			ev->kind = CGE_EXIT;
+			ev->ident = pev->event_data.exit.process_tgid;
+			ev->data = pev->event_data.exit.exit_code;
+			return 1;
+
+		default:
+			continue;
+		}
+	}
+
+	return 0;
+}
+
+/* Get an event, waiting for one for up to timeout ms, or forever if -1. */
+static int
+getevent(cg_event_t *ev, int timeout)
+{
+	struct epoll_event epev;
+	uint64_t expirations;
+	int r;
+
+	for (;;) {
+		r = epoll_wait(epfd, &epev, 1, timeout);
+
+		if (r < 0)
+			return errno == EINTR ? 0 : -1;
+		else if (r == 0 && timeout >= 0)
+			return 0;
+		else if (r == 0)
+			continue;
+
+		switch (REGKIND(epev.data.u64)) {
+		case REG_FD:
+			ev->kind = CGE_READ;
+			ev->ident = REGVAL(epev.data.u64);
+			ev->data = 0;
+			ev->udata = fdudata[ev->ident];
+			return 1;
+
+		case REG_TIMER:
+			ev->kind = CGE_TIMER;
+			ev->ident = REGVAL(epev.data.u64);
+			ev->data = 0;
+			ev->udata = NULL;
+			/* timers are one-shot, so this only clears it */
+			if (read(timerfds[ev->ident], &expirations,
+				    sizeof expirations) < 0)
+				continue;
+			return 1;
+
+		case REG_NETLINK:
+			ev->udata = NULL;
+			if ((r = nlread(ev)) != 0)
+				return r;
+			continue;
+		}
+	}
+}
+
+int
+ev_wait(cg_event_t *ev)
+{
+	return getevent(ev, -1);
+}
+
+int
+ev_poll(cg_event_t *ev)
+{
+	return getevent(ev, 0);
+}
@@ -0,0 +1,69 @@
+/*
+ * Null event backend, for cgrpfs-replay.
+ *
+ * Nothing is watched or tracked; events come from the trace being replayed
+ * instead.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "cgrpfs.h"
+
+int
+ev_init(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+ev_watchfd(int fd, void *udata)
+{
+	return 0;
+}
+
+int
+ev_unwatchfd(int fd)
+{
+	return 0;
+}
+
+int
+ev_settimer(enum cg_timer id, uint64_t ms)
+{
+	return 0;
+}
+
+int
+ev_track(pid_t pid)
+{
+	return 0;
+}
+
+void
+ev_trackmany(const pid_t *pids, int *errors, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		errors[i] = 0;
+}
+
+int
+ev_untrack(pid_t pid)
+{
+	return 0;
+}
+
+int
+ev_wait(cg_event_t *ev)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+ev_poll(cg_event_t *ev)
+{
+	errno = ENOSYS;
+	return -1;
+}
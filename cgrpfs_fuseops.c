@@ -12,17 +12,75 @@
 
 #include "cgrpfs.h"
 
+/* the instance being served, or NULL for the main mount */
+static cg_inst_t *
+opinst(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+/* the root CGroup of the mount being served */
+static cg_node_t *
+oproot(void)
+{
+	cg_inst_t *inst = opinst();
+
+	return inst ? inst->root : cgmgr.rootnode;
+}
+
+/* Get the full path of a path within an instance, for a trace. */
+static char *
+instpath(const char *root, const char *path)
+{
+	char *fullpath;
+
+	if (!strcmp(path, "/"))
+		return strdup(root);
+	else if (asprintf(&fullpath, "%s%s", root, path) < 0)
+		return NULL;
+
+	return fullpath;
+}
+
+/* Record an operation, as trace_op, by the full path of its node. */
+static void
+optrace(enum cgrpfs_trace_type type, const char *path, int32_t arg,
+	const void *data, size_t len)
+{
+	cg_inst_t *inst = opinst();
+	char *root, *fullpath, *fulldata = NULL;
+
+	if (!inst) {
+		trace_op(type, path, arg, data, len);
+		return;
+	} else if ((root = nodefullpath(inst->root)) == NULL)
+		return;
+
+	/* the new path of a rename is within the instance too */
+	fullpath = instpath(root, path);
+	if (type == CGRPFS_TR_RENAME)
+		data = fulldata = instpath(root, data);
+
+	if (fullpath && (type != CGRPFS_TR_RENAME || fulldata))
+		trace_op(type, fullpath, arg, data, len);
+
+	free(root);
+	free(fullpath);
+	free(fulldata);
+}
+
 static int
 cg_chmod(const char *path, mode_t mode)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
 
 	if (!node)
 		return -ENOENT;
 
 	node->attr.st_mode &= ~(07777);
 	node->attr.st_mode |= mode;
+	nodeattrchanged(node);
 
 	return 0;
 }
@@ -31,7 +89,7 @@ static int
 cg_chown(const char *path, uid_t uid, gid_t gid)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
 
 	if (!node)
 		return -ENOENT;
@@ -40,6 +98,7 @@ cg_chown(const char *path, uid_t uid, gid_t gid)
 		node->attr.st_uid = uid;
 	if (gid != -1)
 		node->attr.st_gid = gid;
+	nodeattrchanged(node);
 
 	return 0;
 }
@@ -48,7 +107,7 @@ static int
 cg_getattr(const char *path, struct stat *st)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
 
 	if (!node)
 		return -ENOENT;
@@ -62,29 +121,32 @@ static int
 cg_open(const char *path, struct fuse_file_info *fi)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
 	cg_filedesc_t *filedesc;
 
+	if (cgmgr.tracing)
+		optrace(CGRPFS_TR_READ, path, 0, NULL, 0);
+
 	if (!node)
 		return -ENOENT;
+	else if (S_ISDIR(node->attr.st_mode))
+		return -EISDIR;
 
 	filedesc = malloc(sizeof *filedesc);
 	if (!filedesc)
 		return -ENOMEM;
 	filedesc->node = node;
-	filedesc->buf = NULL;
 
 	fi->fh = (uintptr_t)filedesc;
 	fi->direct_io = 1;
 
-	if (node->type != CGN_PROCS && node->type != CGN_PID_CGROUP)
-		return -ENOTSUP;
-
 	filedesc->buf = nodetxt(node);
 	if (!filedesc->buf) {
 		free(filedesc);
 		return -ENOMEM;
-			}
+	}
+
+	nodehold(node);
 
 	return 0;
 }
@@ -104,7 +166,7 @@ static int
 cg_read(const char *path, char *buf, size_t len, off_t off,
 	struct fuse_file_info *fi)
 {
-	CGMGR_LOCKED;
+	/* the text is the open file's own, so this needs no lock */
 	cg_filedesc_t *filedesc = (void *)fi->fh;
 	size_t maxlen;
 
@@ -133,23 +195,20 @@ cg_write(const char *path, const char *buf, size_t len, off_t off,
 	CGMGR_LOCKED;
 	cg_filedesc_t *filedesc = (void *)fi->fh;
 	cg_node_t *node = filedesc->node;
+	struct fuse_context *ctx = fuse_get_context();
+	cg_cred_t cred = { ctx->uid, ctx->gid };
+	int r;
 
 	assert(node);
 
-	if (node->type == CGN_PROCS) {
-		long pid;
-		int r;
-
-		if (sscanf(buf, "%ld\n", &pid) < 1)
-			return -EINVAL;
-
-		r = attachpid(node->parent, pid);
+	if (cgmgr.tracing)
+		optrace(CGRPFS_TR_WRITE, path, 0, buf, len);
 
-		if (r < 0)
-			return r;
-		return len;
-	} else
-		return -ENODEV;
+	r = opinst() ? inst_write(opinst(), node, buf, len, &cred) :
+		       nodewrite(node, buf, len, &cred);
+	if (r < 0)
+		return r;
+	return len;
 }
 
 static int
@@ -159,6 +218,7 @@ cg_release(const char *path, struct fuse_file_info *fi)
 	cg_filedesc_t *filedesc = (void *)fi->fh;
 
 	assert(filedesc);
+	noderelease(filedesc->node);
 	free(filedesc->buf);
 	free(filedesc);
 
@@ -169,7 +229,7 @@ static int
 cg_opendir(const char *path, struct fuse_file_info *fi)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
 
 	if (!node)
 		return -ENOENT;
@@ -178,6 +238,17 @@ cg_opendir(const char *path, struct fuse_file_info *fi)
 		return -ENOTDIR;
 
 	fi->fh = (uintptr_t)node;
+	nodehold(node);
+
+	return 0;
+}
+
+static int
+cg_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	CGMGR_LOCKED;
+
+	noderelease((cg_node_t *)fi->fh);
 
 	return 0;
 }
@@ -204,42 +275,42 @@ int
 cg_mkdir(const char *path, mode_t mode)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	const char *rest;
+	cg_node_t *node = lookupprefixat(oproot(), path, &rest);
 	cg_node_t *newdir;
 	struct fuse_context *ctx = fuse_get_context();
-	char *dirname = strrchr(path, '/');
-
-	if (node != NULL)
-		return -EEXIST;
 
-	/* get containing node */
-	node = lookupnode(path, true);
+	if (cgmgr.tracing)
+		optrace(CGRPFS_TR_MKDIR, path, 0755 & ~ctx->umask, NULL, 0);
 
-	if (!node)
+	if (*rest == '\0')
+		return -EEXIST;
+	else if (strchr(rest, '/') != NULL)
 		return -ENOENT;
 	else if (node->type != CGN_CG_DIR)
 		return -ENOTSUP;
 
-	newdir = newcgdir(node, dirname + 1, 0755 & ~ctx->umask, ctx->uid,
-		ctx->gid);
-	if (!newdir)
-		return -ENOMEM;
-
-	return 0;
+	return mkcgdirs(node, rest, 0755 & ~ctx->umask, ctx->uid, ctx->gid,
+		&newdir);
 }
 
 static int
 cg_rmdir(const char *path)
 {
 	CGMGR_LOCKED;
-	cg_node_t *node = lookupnode(path, false);
+	cg_node_t *node = lookupnodeat(oproot(), path, false);
+
+	if (cgmgr.tracing)
+		optrace(CGRPFS_TR_RMDIR, path, 0, NULL, 0);
 
 	if (!node)
 		return -ENOENT;
-	else if (node->type != CGN_CG_DIR || node == cgmgr.rootnode)
+	else if (node->type != CGN_CG_DIR || node == oproot())
 		return -ENOTSUP;
+	else if (node->nmounts)
+		return -EBUSY;
 
-	delnode(node);
+	removenode(node);
 
 	return 0;
 }
@@ -248,9 +319,13 @@ static int
 cg_rename(const char *oldpath, const char *newpath)
 {
 	CGMGR_LOCKED;
-	cg_node_t *old = lookupnode(oldpath, false);
-	cg_node_t *newparent = lookupnode(newpath, true);
+	cg_node_t *old = lookupnodeat(oproot(), oldpath, false);
+	cg_node_t *newparent = lookupnodeat(oproot(), newpath, true);
 	char *dirname = strrchr(newpath, '/');
+	char *oldname;
+
+	if (cgmgr.tracing)
+		optrace(CGRPFS_TR_RENAME, oldpath, 0, newpath, 0);
 
 	if (!old || !newparent)
 		return -ENOENT;
@@ -259,8 +334,12 @@ cg_rename(const char *oldpath, const char *newpath)
 	else if (old->type != CGN_CG_DIR || newparent->type != CGN_CG_DIR)
 		return -EOPNOTSUPP;
 
-	free(old->name);
-	old->name = strdup(dirname);
+	oldname = old->name;
+	old->name = strdup(dirname + 1);
+	shm_setcgtree(old);
+	if (cgmgr.persisting)
+		persist_rename(old, oldname);
+	free(oldname);
 
 	return 0;
 }
@@ -277,6 +356,7 @@ struct fuse_operations cgops = {
 	.write = cg_write,
 	.release = cg_release,
 	.opendir = cg_opendir,
+	.releasedir = cg_releasedir,
 	.readdir = cg_readdir,
 	.mkdir = cg_mkdir,
 	.rmdir = cg_rmdir,
@@ -0,0 +1,788 @@
+/*
+ * Live upgrade, by handing the running daemon's state, filesystem device and
+ * sockets over to a successor.
+ *
+ * The successor connects to CGRPFS_HANDOFF_PATH. The running daemon stops
+ * serving and sends it, over SCM_RIGHTS, the filesystem device, the listening
+ * sockets and every connected client, along with the state as encoded by
+ * persist_encode(). From then on it holds back the process events it receives
+ * rather than applying them. The successor places the PIDs it was given and
+ * tracks them all in one batch, and then asks for the events held back, which
+ * it applies, tracking any children they name. This is repeated until an
+ * exchange names no PID the successor couldn't track, so every exit is seen by
+ * one daemon or the other. The successor then starts serving, and the
+ * predecessor exits without unmounting.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+#define HANDOFF_MAGIC 0x4347484f /* "CGHO" */
+#define HANDOFF_VERSION 1
+/* bytes of state per message */
+#define HANDOFF_CHUNK 32768
+/* socket buffer size, which bounds a message on some BSDs */
+#define HANDOFF_BUFSIZE (4 * HANDOFF_CHUNK)
+/* fds per message */
+#define HANDOFF_FDMAX 64
+/* events per message */
+#define HANDOFF_EVMAX 1024
+/* exchanges of events before giving up on those still exiting */
+#define HANDOFF_ROUNDS 16
+/* seconds to wait for the other daemon */
+#define HANDOFF_TIMEOUT 30
+
+/* requests of the successor */
+enum { HO_READY = 1, HO_DONE };
+
+/* the first message, carrying the filesystem device and listening sockets */
+struct handoff_hdr {
+	uint32_t magic; /* HANDOFF_MAGIC */
+	uint32_t version; /* HANDOFF_VERSION */
+	int32_t pid; /* of the predecessor */
+	uint32_t nclients; /* listeners and control clients */
+	uint64_t stopped; /* monotonic ns at which the predecessor stopped */
+	uint64_t epoch, seq, nextid;
+	uint64_t len; /* of the state which follows */
+	uint32_t fsinfo[CGRPFS_FSINFO_MAX];
+};
+
+/* a listener or control client; its fd follows separately */
+struct handoff_client {
+	uint32_t uid, gid;
+	uint32_t subflags;
+	uint8_t control, subscribed;
+};
+
+/* a batch of held-back process events; another follows if more is set */
+struct handoff_events {
+	uint32_t n;
+	uint32_t more;
+	struct handoff_event {
+		int32_t kind;
+		int32_t pid;
+		int64_t data;
+	} ev[HANDOFF_EVMAX];
+};
+
+/* PIDs placed by the successor which exited before it could track them */
+static pid_t *gone;
+static size_t ngone, gonesize;
+
+static uint64_t
+monons(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Set up a connection between the daemons. */
+static void
+setupsock(int sock)
+{
+	struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+	int bufsize = HANDOFF_BUFSIZE;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize,
+		    sizeof bufsize) < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize,
+			sizeof bufsize) < 0)
+		warn("Failed to raise handoff socket buffer sizes");
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0)
+		warn("Failed to set handoff socket timeouts");
+}
+
+/* Send a message with up to HANDOFF_FDMAX fds. */
+static int
+sendfds(int sock, const void *data, size_t len, const int *fds, size_t nfds)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(HANDOFF_FDMAX * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { (void *)data, len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t r;
+
+	if (nfds > 0) {
+		memset(&cmsg, 0, sizeof cmsg);
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), fds, nfds * sizeof(int));
+	}
+
+	while ((r = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+		;
+
+	return r == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive a message, and the fds it carries into fds, which has room for
+ * HANDOFF_FDMAX. Returns the length of the message, or -1.
+ */
+static ssize_t
+recvfds(int sock, void *data, size_t len, int *fds, size_t *nfds)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(HANDOFF_FDMAX * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { data, len };
+	struct msghdr msg = { .msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof cmsg.buf };
+	struct cmsghdr *c;
+	ssize_t r;
+
+	*nfds = 0;
+
+	while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 &&
+		errno == EINTR)
+		;
+	if (r < 0)
+		return -1;
+
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(fds + *nfds, CMSG_DATA(c), n * sizeof(int));
+		*nfds += n;
+	}
+
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return r;
+}
+
+void
+handoff_listen(void)
+{
+	cgmgr.handofffd = cgmgr_listen(CGRPFS_HANDOFF_PATH);
+
+	/* whoever connects is given everything */
+	if (chmod(CGRPFS_HANDOFF_PATH, 0600) < 0)
+		warn("Failed to set permissions of handoff socket");
+}
+
+/* Stop, or resume, watching everything a successor is to take over. */
+static void
+watchall(int fsfd, bool on)
+{
+	int fds[] = { fsfd, cgmgr.notifyfd, cgmgr.controlfd, cgmgr.handofffd };
+	listener_t *l;
+
+	for (size_t i = 0; i < sizeof fds / sizeof *fds; i++)
+		if ((on ? ev_watchfd(fds[i], NULL) : ev_unwatchfd(fds[i])) < 0)
+			warn("Failed to %s fd %d", on ? "watch" : "unwatch",
+				fds[i]);
+
+	LIST_FOREACH (l, &cgmgr.listeners, listeners)
+		if ((on ? ev_watchfd(l->fd, l) : ev_unwatchfd(l->fd)) < 0)
+			warn("Failed to %s listener", on ? "watch" : "unwatch");
+	LIST_FOREACH (l, &cgmgr.controls, listeners)
+		if ((on ? ev_watchfd(l->fd, l) : ev_unwatchfd(l->fd)) < 0)
+			warn("Failed to %s control client",
+				on ? "watch" : "unwatch");
+}
+
+/* Encode everything but the fds, counting the clients whose fds follow. */
+static char *
+encode(uint64_t *lenout, uint32_t *nclients)
+{
+	char *state, *blob = NULL;
+	size_t statelen, len;
+	listener_t *l;
+	FILE *f;
+
+	if ((state = persist_encode(&statelen)) == NULL)
+		return NULL;
+	if ((f = open_memstream(&blob, &len)) == NULL) {
+		free(state);
+		return NULL;
+	}
+
+	fwrite(cgmgr.mountpoint, strlen(cgmgr.mountpoint) + 1, 1, f);
+	fwrite(cgmgr.history, sizeof cgmgr.history, 1, f);
+	for (size_t i = 0; i < CGRPFS_HISTORY_MAX; i++) {
+		const char *path = cgmgr.histpath[i] ? cgmgr.histpath[i] : "";
+
+		fwrite(path, strlen(path) + 1, 1, f);
+	}
+
+	*nclients = 0;
+	LIST_FOREACH (l, &cgmgr.listeners, listeners) {
+		struct handoff_client c = { 0, 0, l->subflags, false,
+			l->subscribed };
+
+		fwrite(&c, sizeof c, 1, f);
+		(*nclients)++;
+	}
+	LIST_FOREACH (l, &cgmgr.controls, listeners) {
+		struct handoff_client c = { l->uid, l->gid, 0, true, false };
+
+		fwrite(&c, sizeof c, 1, f);
+		(*nclients)++;
+	}
+
+	fwrite(state, statelen, 1, f);
+	free(state);
+
+	if (ferror(f)) {
+		fclose(f);
+		free(blob);
+		return NULL;
+	} else if (fclose(f) != 0) {
+		free(blob);
+		return NULL;
+	}
+
+	*lenout = len;
+	return blob;
+}
+
+/* Send the fds of all the clients, in the order encode() counted them. */
+static int
+sendclients(int sock)
+{
+	int fds[HANDOFF_FDMAX];
+	uint32_t n = 0;
+	listener_t *l;
+
+	LIST_FOREACH (l, &cgmgr.listeners, listeners) {
+		fds[n++] = l->fd;
+		if (n == HANDOFF_FDMAX) {
+			if (sendfds(sock, &n, sizeof n, fds, n) < 0)
+				return -1;
+			n = 0;
+		}
+	}
+	LIST_FOREACH (l, &cgmgr.controls, listeners) {
+		fds[n++] = l->fd;
+		if (n == HANDOFF_FDMAX) {
+			if (sendfds(sock, &n, sizeof n, fds, n) < 0)
+				return -1;
+			n = 0;
+		}
+	}
+
+	return n > 0 ? sendfds(sock, &n, sizeof n, fds, n) : 0;
+}
+
+/*
+ * Hold back the events which have arrived by now, as marked by a timer set to
+ * fire at once.
+ */
+static int
+drain(cg_event_t **held, size_t *nheld, size_t *size)
+{
+	cg_event_t ev;
+	int r;
+
+	if (ev_settimer(CGT_HANDOFF, 0) < 0)
+		return -1;
+
+	for (;;) {
+		if ((r = ev_wait(&ev)) < 0)
+			return -1;
+		else if (r == 0)
+			continue;
+		else if (ev.kind == CGE_TIMER && ev.ident == CGT_HANDOFF)
+			return 0;
+		else if (ev.kind == CGE_READ)
+			continue; /* another successor; it must wait */
+
+		if (*nheld == *size) {
+			size_t newsize = *size ? *size * 2 : 256;
+			cg_event_t *newheld = realloc(*held,
+				newsize * sizeof **held);
+
+			if (!newheld)
+				return -1;
+			*held = newheld;
+			*size = newsize;
+		}
+		(*held)[(*nheld)++] = ev;
+	}
+}
+
+/* Send the process events among those held back. */
+static int
+sendevents(int sock, const cg_event_t *evs, size_t n)
+{
+	static struct handoff_events batch;
+	size_t i = 0;
+
+	do {
+		batch.n = 0;
+		for (; i < n && batch.n < HANDOFF_EVMAX; i++) {
+			/* timers are the successor's own business */
+			if (evs[i].kind != CGE_FORK &&
+				evs[i].kind != CGE_EXIT &&
+				evs[i].kind != CGE_TRACKERR)
+				continue;
+			batch.ev[batch.n].kind = evs[i].kind;
+			batch.ev[batch.n].pid = evs[i].ident;
+			batch.ev[batch.n].data = evs[i].data;
+			batch.n++;
+		}
+		batch.more = i < n;
+
+		if (send(sock, &batch,
+			    offsetof(struct handoff_events, ev) +
+				    batch.n * sizeof batch.ev[0],
+			    0) < 0)
+			return -1;
+	} while (batch.more);
+
+	return 0;
+}
+
+int
+handoff_give(int fsfd)
+{
+	struct handoff_hdr hdr;
+	int fds[] = { fsfd, cgmgr.notifyfd, cgmgr.controlfd };
+	cg_event_t *held = NULL;
+	size_t nheld = 0, heldsize = 0, nsent = 0;
+	char *blob = NULL;
+	uint32_t req;
+	int sock;
+
+	if ((sock = accept4(cgmgr.handofffd, NULL, 0, SOCK_CLOEXEC)) < 0) {
+		warn("Failed to accept successor");
+		return -1;
+	}
+	setupsock(sock);
+
+	/* their sessions would need taking over too */
+	if (cgmgr.ninsts > 0) {
+		warnx("Can't hand over while instances are mounted");
+		close(sock);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.stopped = monons();
+
+	/* nothing is journalled while the successor catches up */
+	persist_flush();
+	watchall(fsfd, false);
+
+	if ((blob = encode(&hdr.len, &hdr.nclients)) == NULL) {
+		warn("Failed to encode state for successor");
+		goto fail;
+	}
+
+	hdr.magic = HANDOFF_MAGIC;
+	hdr.version = HANDOFF_VERSION;
+	hdr.pid = getpid();
+	hdr.epoch = cgmgr.epoch;
+	hdr.seq = cgmgr.seq;
+	hdr.nextid = cgmgr.nextid;
+	memcpy(hdr.fsinfo, cgmgr.fsinfo, sizeof hdr.fsinfo);
+
+	if (sendfds(sock, &hdr, sizeof hdr, fds, 3) < 0)
+		goto failsend;
+	for (uint64_t off = 0; off < hdr.len; off += HANDOFF_CHUNK)
+		if (send(sock, blob + off,
+			    hdr.len - off < HANDOFF_CHUNK ? hdr.len - off :
+							    HANDOFF_CHUNK,
+			    0) < 0)
+			goto failsend;
+	if (sendclients(sock) < 0)
+		goto failsend;
+
+	free(blob);
+	blob = NULL;
+
+	/* each request comes once the successor has tracked what it knows */
+	while (recv(sock, &req, sizeof req, 0) == sizeof req) {
+		if (req == HO_DONE) {
+			printf("Handed over to successor in %.1f ms\n",
+				(monons() - hdr.stopped) / 1e6);
+			close(sock);
+			free(held);
+			return 0;
+		} else if (req != HO_READY)
+			break;
+
+		if (drain(&held, &nheld, &heldsize) < 0 ||
+			sendevents(sock, held + nsent, nheld - nsent) < 0)
+			goto failsend;
+		nsent = nheld;
+	}
+
+	warnx("Successor gave up");
+	goto fail;
+
+failsend:
+	warn("Failed to hand over to successor");
+fail:
+	free(blob);
+	close(sock);
+	watchall(fsfd, true);
+
+	/* what was held back is handled now, as if it had just arrived */
+	for (size_t i = 0; i < nheld; i++)
+		cgmgr_event(&held[i]);
+	free(held);
+
+	return -1;
+}
+
+/* Take len bytes from the state at *p, or NULL if too few are left. */
+static const char *
+take(const char **p, const char *end, size_t len)
+{
+	const char *r = *p;
+
+	if ((size_t)(end - r) < len)
+		return NULL;
+	*p += len;
+	return r;
+}
+
+/* Take a NUL-terminated string from the state at *p. */
+static const char *
+takestr(const char **p, const char *end)
+{
+	size_t len = strnlen(*p, end - *p);
+
+	return len < (size_t)(end - *p) ? take(p, end, len + 1) : NULL;
+}
+
+/* Resume a listener or control client. */
+static void
+addclient(int fd, const struct handoff_client *c)
+{
+	listener_t *l = malloc(sizeof *l);
+
+	if (!l) {
+		warn("Failed to allocate listener");
+		close(fd);
+		return;
+	}
+
+	l->fd = fd;
+	l->control = c->control;
+	l->uid = c->uid;
+	l->gid = c->gid;
+	l->subscribed = c->subscribed;
+	l->subflags = c->subflags;
+	l->passive = false;
+	l->inst = NULL;
+
+	if (ev_watchfd(fd, l) < 0) {
+		warn("Failed to watch listener");
+		close(fd);
+		free(l);
+		return;
+	}
+
+	if (l->control) {
+		LIST_INSERT_HEAD(&cgmgr.controls, l, listeners);
+		return;
+	}
+
+	LIST_INSERT_HEAD(&cgmgr.listeners, l, listeners);
+	if (l->subflags & CGRPFS_SUB_ATTACH)
+		cgmgr.nattachsubs++;
+	if (l->subflags & CGRPFS_SUB_PATH)
+		cgmgr.npathsubs++;
+	if (l->subflags & CGRPFS_SUB_CGEVENTS)
+		cgmgr.ncgevsubs++;
+}
+
+/* Restore what encode() encoded, and receive and resume the clients. */
+static void
+restore(int sock, const struct handoff_hdr *hdr, const char *blob)
+{
+	const char *p = blob, *end = blob + hdr->len;
+	const struct handoff_client *clients;
+	const char *mountpoint, *history, *state;
+	int fds[HANDOFF_FDMAX];
+	uint32_t n, nclients = 0;
+	size_t nfds;
+
+	if ((mountpoint = takestr(&p, end)) == NULL ||
+		(history = take(&p, end, sizeof cgmgr.history)) == NULL)
+		errx(EXIT_FAILURE, "Malformed handoff");
+
+	if ((cgmgr.mountpoint = strdup(mountpoint)) == NULL)
+		err(EXIT_FAILURE, "Failed to allocate mountpoint");
+
+	memcpy(cgmgr.history, history, sizeof cgmgr.history);
+	for (size_t i = 0; i < CGRPFS_HISTORY_MAX; i++) {
+		const char *path = takestr(&p, end);
+
+		if (!path)
+			errx(EXIT_FAILURE, "Malformed handoff");
+		cgmgr.histpath[i] = *path ? strdup(path) : NULL;
+	}
+
+	clients = (const struct handoff_client *)take(&p, end,
+		hdr->nclients * sizeof *clients);
+	if (!clients)
+		errx(EXIT_FAILURE, "Malformed handoff");
+
+	state = p;
+	if (persist_decode(state, end - state) < 0)
+		errx(EXIT_FAILURE, "Malformed handoff state");
+	/* after making the CGroups, which took new IDs meanwhile */
+	cgmgr.nextid = hdr->nextid;
+
+	while (nclients < hdr->nclients) {
+		if (recvfds(sock, &n, sizeof n, fds, &nfds) != sizeof n ||
+			n != nfds || nclients + n > hdr->nclients)
+			errx(EXIT_FAILURE, "Failed to receive clients");
+		for (size_t i = 0; i < nfds; i++)
+			addclient(fds[i], &clients[nclients++]);
+	}
+}
+
+/* Is a PID among those which exited before they could be tracked? */
+static bool
+takegone(pid_t pid)
+{
+	for (size_t i = 0; i < ngone; i++)
+		if (gone[i] == pid) {
+			gone[i] = gone[--ngone];
+			return true;
+		}
+
+	return false;
+}
+
+/* Note that a placed PID exited before it could be tracked. */
+static void
+addgone(pid_t pid)
+{
+	if (ngone == gonesize) {
+		size_t newsize = gonesize ? gonesize * 2 : 64;
+		pid_t *newgone = realloc(gone, newsize * sizeof *gone);
+
+		if (!newgone)
+			err(EXIT_FAILURE, "Failed to allocate PIDs");
+		gone = newgone;
+		gonesize = newsize;
+	}
+	gone[ngone++] = pid;
+}
+
+/*
+ * Track placed PIDs, running since the given time. Those which have exited are
+ * kept until their exits arrive from the predecessor.
+ */
+static void
+track(const pid_t *pids, size_t n, uint64_t since)
+{
+	pid_hash_entry_t *entry;
+	int *errors;
+
+	if (n == 0)
+		return;
+	if ((errors = malloc(n * sizeof *errors)) == NULL)
+		err(EXIT_FAILURE, "Failed to allocate batch");
+
+	ev_trackmany(pids, errors, n);
+
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t pidp = pids[i];
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		if (!entry)
+			continue;
+		else if (errors[i] == 0)
+			entry->since = since;
+		else if (errors[i] == ESRCH)
+			addgone(pids[i]);
+		else {
+			errno = errors[i];
+			warn("Failed to watch PID %lld", (long long)pids[i]);
+			forgetpid(pids[i]);
+		}
+	}
+
+	free(errors);
+}
+
+/*
+ * Apply the events the predecessor held back. Returns how many new PIDs they
+ * named, which might have children the predecessor has yet to report.
+ */
+static size_t
+catchup(int sock)
+{
+	static struct handoff_events batch;
+	pid_hash_entry_t *entry;
+	size_t nnew = 0;
+	ssize_t r;
+
+	do {
+		r = recv(sock, &batch, sizeof batch, 0);
+		if (r < (ssize_t)offsetof(struct handoff_events, ev) ||
+			batch.n > HANDOFF_EVMAX ||
+			(size_t)r < offsetof(struct handoff_events, ev) +
+					batch.n * sizeof batch.ev[0])
+			errx(EXIT_FAILURE, "Failed to receive held events");
+
+		for (uint32_t i = 0; i < batch.n; i++) {
+			cg_event_t ev = { batch.ev[i].kind, batch.ev[i].pid,
+				batch.ev[i].data, NULL };
+			uintptr_t pidp = ev.ident, ppidp = ev.data;
+			pid_t pid = ev.ident;
+
+			if (ev.kind == CGE_EXIT) {
+				/* and drop the event we might also have */
+				detachpid(pid, ev.data, !takegone(pid));
+				continue;
+			} else if (ev.kind != CGE_FORK) {
+				cgmgr_event(&ev);
+				continue;
+			}
+
+			HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+			if (entry)
+				continue;
+			HASH_FIND_PTR(cgmgr.pidcg, &ppidp, entry);
+			if (!entry) {
+				cgmgr_event(&ev);
+				continue;
+			}
+
+			if (placeforked(entry->node, pid, ev.data)) {
+				track(&pid, 1, 0);
+				nnew++;
+			}
+		}
+	} while (batch.more);
+
+	return nnew;
+}
+
+bool
+handoff_take(const char *want)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct handoff_hdr hdr;
+	pid_hash_entry_t *entry, *tmp;
+	struct timespec now;
+	uint32_t req = HO_READY;
+	int sock, fds[HANDOFF_FDMAX];
+	size_t nfds, npids = 0, round;
+	pid_t *pids;
+	char *blob;
+
+	if (!want || *want == '\0')
+		return false;
+
+#if defined(CGRPFS_THREADED) || defined(CGRPFS_PUFFS)
+	/* there is no taking over a FUSE or PUFFS session here */
+	errx(EXIT_FAILURE, "This build of CGrpFS cannot take over another");
+#endif
+
+	snprintf(sun.sun_path, sizeof sun.sun_path, "%s", CGRPFS_HANDOFF_PATH);
+
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+		err(EXIT_FAILURE, "Failed to create handoff socket");
+	if (connect(sock, (struct sockaddr *)&sun, SUN_LEN(&sun)) < 0)
+		err(EXIT_FAILURE, "Failed to reach running daemon at %s",
+			CGRPFS_HANDOFF_PATH);
+	setupsock(sock);
+
+	if (recvfds(sock, &hdr, sizeof hdr, fds, &nfds) != sizeof hdr ||
+		hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+		nfds != 3)
+		errx(EXIT_FAILURE, "Running daemon sent no usable handoff");
+
+	cgmgr.fsfd = fds[0];
+	cgmgr.notifyfd = fds[1];
+	cgmgr.controlfd = fds[2];
+	memcpy(cgmgr.fsinfo, hdr.fsinfo, sizeof cgmgr.fsinfo);
+	/* listeners resume, and the shared-memory table is stamped with it */
+	cgmgr.epoch = hdr.epoch;
+	cgmgr.seq = hdr.seq;
+
+	if ((blob = malloc(hdr.len)) == NULL)
+		err(EXIT_FAILURE, "Failed to allocate handoff state");
+	for (uint64_t off = 0; off < hdr.len;) {
+		ssize_t r = recv(sock, blob + off, hdr.len - off, 0);
+
+		if (r <= 0)
+			err(EXIT_FAILURE, "Failed to receive handoff state");
+		off += r;
+	}
+
+	restore(sock, &hdr, blob);
+	free(blob);
+
+	if (ev_watchfd(cgmgr.notifyfd, NULL) < 0 ||
+		ev_watchfd(cgmgr.controlfd, NULL) < 0)
+		err(EXIT_FAILURE, "Failed to watch listener FD");
+
+	/* everything handed over was running when the predecessor stopped */
+	clock_gettime(CLOCK_REALTIME, &now);
+	if ((pids = malloc((HASH_COUNT(cgmgr.pidcg) + 1) * sizeof *pids)) ==
+		NULL)
+		err(EXIT_FAILURE, "Failed to allocate PIDs");
+	HASH_ITER (hh, cgmgr.pidcg, entry, tmp)
+		pids[npids++] = entry->pid;
+	track(pids, npids,
+		(uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	free(pids);
+
+	for (round = 0; round < HANDOFF_ROUNDS; round++) {
+		if (send(sock, &req, sizeof req, 0) < 0)
+			err(EXIT_FAILURE, "Failed to ask for held events");
+		if (catchup(sock) == 0 && ngone == 0)
+			break;
+	}
+
+	/* still exiting after all that; their exits are lost */
+	while (ngone > 0) {
+		warnx("Lost exit of PID %lld", (long long)gone[0]);
+		detachpid(gone[0], CGRPFS_WSTAT_LOST, false);
+		takegone(gone[0]);
+	}
+	free(gone);
+
+	req = HO_DONE;
+	if (send(sock, &req, sizeof req, 0) < 0)
+		err(EXIT_FAILURE, "Failed to complete handoff");
+	close(sock);
+
+	printf("Took over %u CGroups and %u PIDs from PID %d, %.1f ms after "
+	       "it stopped serving\n",
+		cgmgr.rootnode->ndescendants, HASH_COUNT(cgmgr.pidcg),
+		(int)hdr.pid, (monons() - hdr.stopped) / 1e6);
+
+	return true;
+}
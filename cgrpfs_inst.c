@@ -0,0 +1,206 @@
+/*
+ * Instances: further mounts, each serving the subtree of one CGroup as a
+ * hierarchy of its own, e.g. for a jail or container.
+ *
+ * An instance costs only its subtree, its filesystem session and, if wanted,
+ * its notify socket; the event loop, PID map and everything else are shared
+ * with the main mount. Like a Linux CGroup namespace, an instance can't name
+ * anything outside its subtree, nor move a PID in from outside it.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+static cg_inst_t *
+findinst(const char *mountpoint)
+{
+	cg_inst_t *inst;
+
+	LIST_FOREACH (inst, &cgmgr.insts, insts)
+		if (!strcmp(inst->mountpoint, mountpoint))
+			return inst;
+
+	return NULL;
+}
+
+/*
+ * Give a CGroup to a user, as on Linux delegation: the directory, so it may
+ * make CGroups below, and cgroup.procs, so it may move PIDs among them. Its
+ * limits are left to the owner of its parent.
+ */
+static void
+delegate(cg_node_t *node, uid_t uid, gid_t gid)
+{
+	cg_node_t *procs = lookupfile(node, "cgroup.procs");
+
+	node->attr.st_uid = uid;
+	node->attr.st_gid = gid;
+	nodeattrchanged(node);
+
+	if (procs) {
+		procs->attr.st_uid = uid;
+		procs->attr.st_gid = gid;
+		nodeattrchanged(procs);
+	}
+}
+
+/* Start listening at an instance's notify socket. */
+static int
+listeninst(cg_inst_t *inst, uid_t uid, gid_t gid)
+{
+	listener_t *server = &inst->server;
+
+	if ((server->fd = cgmgr_bind(inst->notifypath)) < 0)
+		return -errno;
+
+	/* it reveals nothing beyond the subtree */
+	if (uid != (uid_t)-1 && chown(inst->notifypath, uid, gid) < 0)
+		warn("Failed to set owner of %s", inst->notifypath);
+
+	server->control = false;
+	server->subscribed = false;
+	server->subflags = 0;
+	server->passive = true;
+	server->inst = inst;
+
+	if (ev_watchfd(server->fd, server) < 0) {
+		int olderrno = errno;
+
+		close(server->fd);
+		unlink(inst->notifypath);
+		server->fd = -1;
+		return -olderrno;
+	}
+
+	return 0;
+}
+
+static void
+freeinst(cg_inst_t *inst)
+{
+	if (inst->server.fd >= 0) {
+		close(inst->server.fd);
+		unlink(inst->notifypath);
+	}
+
+	free(inst->mountpoint);
+	free(inst->notifypath);
+	free(inst);
+}
+
+int
+inst_mount(const char *path, const char *mountpoint, const char *notifypath,
+	uid_t uid, gid_t gid, cg_inst_t **out)
+{
+	const char *rest;
+	cg_node_t *node = lookupprefix(path, &rest);
+	cg_inst_t *inst;
+	int r;
+
+	if (*path != '/' || *mountpoint != '/')
+		return -EINVAL;
+	else if (findinst(mountpoint) ||
+		(cgmgr.mountpoint && !strcmp(cgmgr.mountpoint, mountpoint)))
+		return -EBUSY;
+	else if (node->type != CGN_CG_DIR)
+		return -ENOTDIR;
+
+	if (*rest != '\0' &&
+		(r = mkcgdirs(node, rest, 0755, uid == (uid_t)-1 ? 0 : uid,
+			 uid == (uid_t)-1 ? 0 : gid, &node)) < 0)
+		return r;
+	/* the whole tree is the main mount's */
+	if (node == cgmgr.rootnode)
+		return -EINVAL;
+
+	if ((inst = calloc(1, sizeof *inst)) == NULL)
+		return -ENOMEM;
+	inst->root = node;
+	inst->server.fd = -1;
+	if ((inst->mountpoint = strdup(mountpoint)) == NULL ||
+		(notifypath && *notifypath &&
+			(inst->notifypath = strdup(notifypath)) == NULL)) {
+		freeinst(inst);
+		return -ENOMEM;
+	}
+
+	if (uid != (uid_t)-1)
+		delegate(node, uid, gid);
+
+	if ((inst->notifypath && (r = listeninst(inst, uid, gid)) < 0) ||
+		(r = fs_mount(inst)) < 0) {
+		freeinst(inst);
+		return r;
+	}
+
+	for (cg_node_t *n = node; n; n = n->parent)
+		n->nmounts++;
+	LIST_INSERT_HEAD(&cgmgr.insts, inst, insts);
+	cgmgr.ninsts++;
+
+	*out = inst;
+	return 0;
+}
+
+void
+inst_unmount(cg_inst_t *inst)
+{
+	fs_unmount(inst);
+	cgmgr_unlisten(inst);
+
+	for (cg_node_t *n = inst->root; n; n = n->parent)
+		n->nmounts--;
+	LIST_REMOVE(inst, insts);
+	cgmgr.ninsts--;
+
+	freeinst(inst);
+}
+
+int
+inst_unmountat(const char *mountpoint)
+{
+	cg_inst_t *inst = findinst(mountpoint);
+
+	if (!inst)
+		return -ENOENT;
+
+	inst_unmount(inst);
+	return 0;
+}
+
+int
+inst_write(cg_inst_t *inst, cg_node_t *node, const char *buf, size_t len,
+	const cg_cred_t *cred)
+{
+	pid_hash_entry_t *entry;
+	uintptr_t pidp;
+	char txt[32];
+	long pid;
+
+	if (node->type != CGN_PROCS)
+		return nodewrite(node, buf, len, cred);
+
+	if (len >= sizeof txt)
+		return -EINVAL;
+	memcpy(txt, buf, len);
+	txt[len] = '\0';
+	if (sscanf(txt, "%ld", &pid) < 1 || pid <= 0)
+		return -EINVAL;
+
+	/* as on Linux, a PID outside the namespace can't be found */
+	pidp = pid;
+	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	if (!entry || !nodewithin(entry->node, inst->root))
+		return -ENOENT;
+
+	return nodewrite(node, buf, len, cred);
+}
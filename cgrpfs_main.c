@@ -1,5 +1,8 @@
 #include <sys/types.h>
-#include <sys/event.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
@@ -8,23 +11,484 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cgrpfs.h"
 
 cgmgr_t cgmgr;
 
+#ifdef __linux__
+/* make an fd another device of an fd's connection, as clone_fd in libfuse 3 */
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+/* the most worker threads CGRPFS_WORKERS may ask for */
+#define WORKERS_MAX 64
+
+/* process events handled before requests are served, unless overridden */
+#define EVENT_BATCH 64
+/* requests served to each ready session in a round, unless overridden */
+#define REQUEST_SHARE 8
+
+/* what the kernel told us in its INIT request, kept in cgmgr.fsinfo */
+enum { FSI_MAJOR, FSI_MINOR, FSI_READAHEAD, FSI_CAPABLE };
+
+/* the kernel's INIT request, as replayed to a session taking over */
+struct fsinit_in {
+	uint32_t len, opcode;
+	uint64_t unique, nodeid;
+	uint32_t uid, gid, pid, padding;
+	uint32_t major, minor, max_readahead, flags;
+};
+
+/* replies to the replayed INIT request are not for the kernel */
+static bool swallow;
+
+/* instances, by the fd of their session's channel */
+static cg_inst_t **fdinsts;
+static size_t nfdinsts;
+
+/* a thread serving requests to the main mount */
+struct worker {
+	pthread_t thrd;
+	struct fuse_chan *ch; /* a channel of its own, or else the session's */
+	char *buf;
+	size_t bufsize;
+};
+
+/* the worker pool, if there is one; loop() serves everything otherwise */
+static struct worker *workers;
+static unsigned nworkers;
+static sem_t workerdone; /* posted by each worker on leaving */
+
+/* a process event read by loop(), and when */
+struct queued {
+	cg_event_t ev;
+	uint64_t since;
+};
+
+/* a session with requests waiting, and since when */
+struct ready {
+	int fd; /* of its channel, or -1 if it was unmounted */
+	uint64_t since;
+};
+
+/* the budgets of each round of loop(), from CGRPFS_EVENT_BATCH and _SHARE */
+static unsigned eventbatch, requestshare;
+
+/* process events read in this round */
+static struct queued *queue;
+static size_t nqueued;
+
+/* sessions seen ready in this round */
+static struct ready *ready;
+static size_t nready, readysize;
+
+static void *
+fsinit(struct fuse_conn_info *conn)
+{
+	/* only the main mount's session is handed over */
+	if (fuse_get_context()->private_data)
+		return fuse_get_context()->private_data;
+
+	cgmgr.fsinfo[FSI_MAJOR] = conn->proto_major;
+	cgmgr.fsinfo[FSI_MINOR] = conn->proto_minor;
+	cgmgr.fsinfo[FSI_READAHEAD] = conn->max_readahead;
+	/* the capability bits are the kernel's INIT flags */
+	cgmgr.fsinfo[FSI_CAPABLE] = conn->capable;
+
+	return fuse_get_context()->private_data;
+}
+
+static int
+chanreceive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	/* a worker's clone isn't in the session, so it keeps it as data */
+	struct fuse_session *se = fuse_chan_data(*chp) ?
+		fuse_chan_data(*chp) :
+		fuse_chan_session(*chp);
+	ssize_t r;
+
+	do
+		r = read(fuse_chan_fd(*chp), buf, size);
+	while (r < 0 && errno == ENOENT); /* the request was interrupted */
+
+	if (r < 0 && errno == ENODEV) {
+		/* unmounted */
+		fuse_session_exit(se);
+		return 0;
+	}
+
+	return r < 0 ? -errno : r;
+}
+
+static int
+chansend(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	if (swallow || !iov)
+		return 0;
+
+	return writev(fuse_chan_fd(ch), iov, count) < 0 ? -errno : 0;
+}
+
+static void
+chandestroy(struct fuse_chan *ch)
+{
+	close(fuse_chan_fd(ch));
+}
+
+/* Keep only the options for the library, the mount being made already. */
+static int
+libopt(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	return key == FUSE_OPT_KEY_OPT && fuse_is_lib_option(arg);
+}
+
+/* Serve the filesystem device taken over from a predecessor. */
+static void
+takeover(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan_ops ops = { chanreceive, chansend, chandestroy };
+	struct fsinit_in init = {
+		.len = sizeof init,
+		.opcode = 26, /* FUSE_INIT */
+		.major = cgmgr.fsinfo[FSI_MAJOR],
+		.minor = cgmgr.fsinfo[FSI_MINOR],
+		.max_readahead = cgmgr.fsinfo[FSI_READAHEAD],
+		.flags = cgmgr.fsinfo[FSI_CAPABLE],
+	};
+	struct fuse_chan *ch;
+	int fg;
+
+	if (fuse_parse_cmdline(&args, NULL, &cgmgr.mt, &fg) < 0 ||
+		fuse_opt_parse(&args, NULL, NULL, libopt) < 0)
+		errx(EXIT_FAILURE, "Failed to parse options");
+
+	ch = fuse_chan_new(&ops, cgmgr.fsfd, 0x21000, NULL);
+	if (!ch)
+		errx(EXIT_FAILURE, "Failed to create FUSE channel");
+
+	cgmgr.fuse = fuse_new(ch, &args, &cgops, sizeof(cgops), NULL);
+	fuse_opt_free_args(&args);
+	if (!cgmgr.fuse)
+		errx(EXIT_FAILURE, "Failed to create FUSE session");
+
+	/* the kernel's INIT was answered long ago; the new session needs it */
+	swallow = true;
+	fuse_session_process(fuse_get_session(cgmgr.fuse), (char *)&init,
+		sizeof init, ch);
+	swallow = false;
+
+	if (fuse_daemonize(fg) < 0 ||
+		fuse_set_signal_handlers(fuse_get_session(cgmgr.fuse)) < 0)
+		errx(EXIT_FAILURE, "Failed to set up FUSE session");
+}
+
+int
+fs_mount(cg_inst_t *inst)
+{
+	char *argv[] = { "cgrpfs", "-o", "allow_other,default_permissions",
+		NULL };
+	struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	int fd;
+
+	/* instances are served by loop() alone */
+	if (nworkers > 0)
+		return -EOPNOTSUPP;
+
+	/* the mount options are taken, and the library's left */
+	ch = fuse_mount(inst->mountpoint, &args);
+	fuse = ch ? fuse_new(ch, &args, &cgops, sizeof(cgops), inst) : NULL;
+	fuse_opt_free_args(&args);
+	if (!fuse) {
+		if (ch)
+			fuse_unmount(inst->mountpoint, ch);
+		return -EIO;
+	}
+
+	fd = fuse_chan_fd(ch);
+	if (fd >= nfdinsts) {
+		size_t newn = fd + 64;
+		cg_inst_t **newfdinsts = realloc(fdinsts,
+			newn * sizeof *fdinsts);
+
+		if (!newfdinsts) {
+			fuse_unmount(inst->mountpoint, ch);
+			fuse_destroy(fuse);
+			return -ENOMEM;
+		}
+		memset(newfdinsts + nfdinsts, 0,
+			(newn - nfdinsts) * sizeof *fdinsts);
+		fdinsts = newfdinsts;
+		nfdinsts = newn;
+	}
+
+	if (ev_watchfd(fd, NULL) < 0) {
+		int olderrno = errno;
+
+		fuse_unmount(inst->mountpoint, ch);
+		fuse_destroy(fuse);
+		return -olderrno;
+	}
+
+	fdinsts[fd] = inst;
+	inst->fs = fuse;
+
+	return 0;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+	struct fuse *fuse = inst->fs;
+	struct fuse_chan *ch;
+
+	ch = fuse_session_next_chan(fuse_get_session(fuse), NULL);
+	fdinsts[fuse_chan_fd(ch)] = NULL;
+	for (size_t i = 0; i < nready; i++)
+		if (ready[i].fd == fuse_chan_fd(ch))
+			ready[i].fd = -1;
+	fuse_unmount(inst->mountpoint, ch);
+	fuse_destroy(fuse);
+}
+
+/*
+ * Serve a request to an instance, with buf as in loop(); returns false if its
+ * session has ended.
+ */
+static bool
+serveinst(cg_inst_t *inst, char **buf, size_t *bufsize)
+{
+	struct fuse_session *se = fuse_get_session(inst->fs);
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	struct fuse_buf fbuf;
+	int r;
+
+	if (fuse_chan_bufsize(ch) > *bufsize) {
+		char *newbuf = realloc(*buf, fuse_chan_bufsize(ch));
+
+		if (!newbuf)
+			errx(EXIT_FAILURE, "Failed to allocate buffer");
+		*buf = newbuf;
+		*bufsize = fuse_chan_bufsize(ch);
+	}
+
+	memset(&fbuf, 0, sizeof fbuf);
+	fbuf.mem = *buf;
+	fbuf.size = *bufsize;
+
+	r = fuse_session_receive_buf(se, &fbuf, &ch);
+	if (r == -EINTR || r == -EAGAIN)
+		return true;
+	else if (r <= 0 || fuse_session_exited(se))
+		return false;
+
+	fuse_session_process_buf(se, &fbuf, ch);
+	return true;
+}
+
+/* Get the monotonic time in microseconds. */
+static uint64_t
+nowus(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Does a session have another request waiting? */
+static bool
+pending(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/* Mark a session ready; returns true if it already was. */
+static bool
+markready(int fd)
+{
+	for (size_t i = 0; i < nready; i++)
+		if (ready[i].fd == fd)
+			return true;
+
+	if (nready == readysize) {
+		size_t newsize = readysize ? readysize * 2 : 8;
+		struct ready *newready = realloc(ready,
+			newsize * sizeof *ready);
+
+		if (!newready)
+			errx(EXIT_FAILURE, "Failed to allocate buffer");
+		ready = newready;
+		readysize = newsize;
+	}
+
+	ready[nready].fd = fd;
+	ready[nready++].since = nowus();
+	return false;
+}
+
+/* Handle the process events queued in this round. */
+static void
+runevents(void)
+{
+	for (size_t i = 0; i < nqueued; i++) {
+		uint64_t lag = nowus() - queue[i].since;
+
+		sched_stats.eventlag += lag;
+		if (lag > sched_stats.eventlagmax)
+			sched_stats.eventlagmax = lag;
+		cgmgr_event(&queue[i].ev);
+	}
+
+	sched_stats.events += nqueued;
+	nqueued = 0;
+}
+
+/*
+ * Read what is ready, waiting for the first of it: process events are queued,
+ * up to the batch, and sessions with requests are marked ready. Anything else,
+ * such as a client's message, is handled at once, after the events queued
+ * before it. fd is the main session's. Returns 0 if the wait was interrupted,
+ * 2 if the filesystem was handed over, or else 1.
+ */
+static int
+gather(int fd)
+{
+	cg_event_t ev;
+	unsigned idle = 0;
+	bool block = true;
+	int r;
+
+	while (nqueued < eventbatch) {
+		r = block ? ev_wait(&ev) : ev_poll(&ev);
+
+		if (r < 0)
+			err(EXIT_FAILURE, "Failed to wait for events");
+		else if (r == 0)
+			return block ? 0 : 1;
+		block = false;
+
+		if (ev.kind == CGE_READ &&
+			(ev.ident == fd ||
+				(ev.ident < nfdinsts && fdinsts[ev.ident]))) {
+			/* sessions stay ready, so a cycle of them is all */
+			if (markready(ev.ident) && ++idle >= nready)
+				break;
+			continue;
+		}
+		idle = 0;
+
+		if (ev.kind != CGE_READ) {
+			queue[nqueued].ev = ev;
+			queue[nqueued++].since = nowus();
+			continue;
+		}
+
+		runevents();
+		if (ev.ident != cgmgr.handofffd)
+			cgmgr_event(&ev);
+		else if (handoff_give(fd) == 0)
+			return 2;
+	}
+
+	sched_stats.fullbatches += nqueued == eventbatch;
+	return 1;
+}
+
+/*
+ * Serve each session marked ready up to its share of requests, with buf as in
+ * loop(). fd is the main session's.
+ */
+static void
+serveready(int fd, char **buf, size_t *bufsize)
+{
+	struct fuse_session *se = fuse_get_session(cgmgr.fuse);
+	uint64_t start = nowus(), lag;
+
+	for (size_t i = 0; i < nready && !fuse_session_exited(se); i++) {
+		unsigned n = 0;
+
+		/* unmounted by an earlier request */
+		if (ready[i].fd < 0)
+			continue;
+
+		lag = nowus() - ready[i].since;
+		sched_stats.requestlag += lag;
+		if (lag > sched_stats.requestlagmax)
+			sched_stats.requestlagmax = lag;
+
+		do {
+			struct fuse_chan *tmpch;
+			struct fuse_buf fbuf = {
+				.mem = *buf,
+				.size = *bufsize,
+			};
+			int r;
+
+			n++;
+			if (ready[i].fd != fd) {
+				cg_inst_t *inst = fdinsts[ready[i].fd];
+
+				/* unmounted from outside */
+				if (!serveinst(inst, buf, bufsize)) {
+					inst_unmount(inst);
+					break;
+				}
+				continue;
+			}
+
+			tmpch = fuse_session_next_chan(se, NULL);
+			r = fuse_session_receive_buf(se, &fbuf, &tmpch);
+
+			if (r == -EINTR)
+				break;
+			else if (r <= 0)
+				errx(EXIT_FAILURE, "Got <0 from fuse");
+
+			fuse_session_process_buf(se, &fbuf, tmpch);
+		} while (n < requestshare && ready[i].fd >= 0 &&
+			!fuse_session_exited(se) && pending(ready[i].fd));
+
+		sched_stats.requests += n;
+		sched_stats.sharesspent += n == requestshare;
+	}
+
+	nready = 0;
+
+	lag = nowus() - start;
+	if (lag > sched_stats.requesttimemax)
+		sched_stats.requesttimemax = lag;
+}
+
+/*
+ * Serve the filesystem and handle events in rounds: first the process events
+ * which have arrived, up to a batch, so that forks are tracked promptly, and
+ * then a share of requests to each session with any, so that a fork storm
+ * can't starve them. Returns 1 if the filesystem was handed over to a
+ * successor.
+ */
 int
 loop()
 {
 	struct fuse_session *se;
 	struct fuse_chan *ch;
-	int fd;
-	struct kevent kev;
+	int fd, r;
 	size_t bufsize;
 	char *buf;
 
@@ -38,85 +502,217 @@ loop()
 
 	bufsize = fuse_chan_bufsize(ch);
 	buf = malloc(bufsize);
-	if (!buf)
+	queue = calloc(eventbatch, sizeof *queue);
+	if (!buf || !queue)
 		errx(EXIT_FAILURE, "Failed to allocate buffer");
 
 	fd = fuse_chan_fd(ch);
 
-	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-	if ((kevent(cgmgr.kq, &kev, 1, NULL, 0, NULL)) < 0)
-		err(EXIT_FAILURE, "Failed to add event to Kernel Queue");
+	if (ev_watchfd(fd, NULL) < 0)
+		err(EXIT_FAILURE, "Failed to watch FUSE channel");
+
+	while (!fuse_session_exited(se)) {
+		if ((r = gather(fd)) == 0)
+			break;
+		else if (r == 2) {
+			free(buf);
+			free(queue);
+			return 1;
+		}
+
+		sched_stats.rounds++;
+		runevents();
+		serveready(fd, &buf, &bufsize);
+	}
+
+	free(buf);
+	free(queue);
+	fuse_session_reset(se);
+
+	return 0;
+}
+
+/*
+ * Get a count from the environment, or def if it's unset; it must be from min
+ * to max.
+ */
+static unsigned
+envcount(const char *name, unsigned def, unsigned min, unsigned max)
+{
+	const char *txt = getenv(name);
+	unsigned long n;
+	char *end;
+
+	if (!txt || *txt == '\0')
+		return def;
+
+	errno = 0;
+	n = strtoul(txt, &end, 10);
+	if (errno != 0 || *end != '\0' || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be from %u to %u", name, min, max);
+
+	return n;
+}
+
+/*
+ * Give a worker a channel of its own: another device for the connection,
+ * whose requests it alone reads and answers. Without one, the workers share
+ * the session's channel.
+ */
+static struct fuse_chan *
+clonechan(struct fuse_session *se, struct fuse_chan *ch)
+{
+#ifdef FUSE_DEV_IOC_CLONE
+	struct fuse_chan_ops ops = { chanreceive, chansend, chandestroy };
+	uint32_t sessfd = fuse_chan_fd(ch);
+	struct fuse_chan *clone;
+	int fd;
+
+	if ((fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) < 0)
+		return ch;
+
+	if (ioctl(fd, FUSE_DEV_IOC_CLONE, &sessfd) < 0 ||
+		(clone = fuse_chan_new(&ops, fd, fuse_chan_bufsize(ch), se)) ==
+			NULL) {
+		close(fd);
+		return ch;
+	}
+
+	return clone;
+#else
+	return ch;
+#endif
+}
+
+static void *
+work(void *arg)
+{
+	struct worker *w = arg;
+	struct fuse_session *se = fuse_get_session(cgmgr.fuse);
+
+	/* it is cancelled only while waiting for a request */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 	while (!fuse_session_exited(se)) {
 		int r;
-		struct fuse_chan *tmpch = ch;
+		struct fuse_chan *tmpch = w->ch;
 		struct fuse_buf fbuf = {
-			.mem = buf,
-			.size = bufsize,
+			.mem = w->buf,
+			.size = w->bufsize,
 		};
 
-		r = kevent(cgmgr.kq, NULL, 0, &kev, 1, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		r = fuse_session_receive_buf(se, &fbuf, &tmpch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-		if (r < 0 && errno != EINTR)
-			err(EXIT_FAILURE, "kevent failed");
-		else if (r < 0)
-			break;
+		if (r == -EINTR || r == -EAGAIN)
+			continue;
 		else if (r == 0)
-			warn("Got 0 from kevent");
-		else if (kev.filter == EVFILT_READ &&
-			kev.ident == cgmgr.notifyfd)
-			cgmgr_accept();
-		else if (kev.filter == EVFILT_READ) {
-			r = fuse_session_receive_buf(se, &fbuf, &tmpch);
+			break;
+		else if (r < 0)
+			errx(EXIT_FAILURE, "Got <0 from fuse");
 
-			if (r == -EINTR)
-				continue;
-			else if (r <= 0)
-				errx(EXIT_FAILURE, "Got <0 from fuse");
+		fuse_session_process_buf(se, &fbuf, tmpch);
+	}
 
-			fuse_session_process_buf(se, &fbuf, tmpch);
-		} else if (kev.filter == EVFILT_PROC) {
-			if (kev.fflags & NOTE_CHILD) {
-				pid_hash_entry_t *entry;
-				uintptr_t ppidp = kev.data; /* parent pid */
-
-				/* find parent pid's node */
-				HASH_FIND_PTR(cgmgr.pidcg, &ppidp, entry);
-
-				if (!entry)
-					warn("Couldn't find containing CGroup of PID %lld",
-						(long long)kev.data);
-				else
-					attachpid(entry->node, kev.ident);
-			} else if (kev.fflags & NOTE_EXIT)
-				detachpid(kev.ident, kev.data, false);
-			else if (kev.fflags & NOTE_TRACKERR)
-				warn("NOTE_TRACKERR received from Kernel Queue");
-			else if (kev.fflags & NOTE_EXEC)
-				warn("NOTE_EXEC was received");
-		} else
-			assert(!"Unreached");
+	fuse_session_exit(se);
+	sem_post(&workerdone);
+
+	return NULL;
+}
+
+/*
+ * Serve the main mount from the worker pool until it is unmounted, while
+ * events are handled on a thread of their own.
+ */
+static void
+runworkers(void)
+{
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	sigset_t set, oldset;
+	int r;
+
+	se = fuse_get_session(cgmgr.fuse);
+	ch = fuse_session_next_chan(se, NULL);
+
+	workers = calloc(nworkers, sizeof *workers);
+	if (!workers || sem_init(&workerdone, 0, 0) < 0)
+		err(EXIT_FAILURE, "Failed to set up workers");
+
+	cgmgr_startevents();
+
+	/* signals are left to this thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		w->ch = clonechan(se, ch);
+		w->bufsize = fuse_chan_bufsize(ch);
+		if ((w->buf = malloc(w->bufsize)) == NULL)
+			errx(EXIT_FAILURE, "Failed to allocate buffer");
+
+		r = pthread_create(&w->thrd, NULL, work, w);
+		if (r != 0)
+			errx(EXIT_FAILURE, "pthread_create failed: %s",
+				strerror(r));
 	}
 
-	free(buf);
-	fuse_session_reset(se);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 
-	return 0;
+	/* until a worker sees the unmount, or a signal handler exits it */
+	while (!fuse_session_exited(se))
+		sem_wait(&workerdone);
+
+	for (unsigned i = 0; i < nworkers; i++)
+		pthread_cancel(workers[i].thrd);
+	for (unsigned i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thrd, NULL);
+		if (workers[i].ch != ch)
+			fuse_chan_destroy(workers[i].ch);
+		free(workers[i].buf);
+	}
+
+	free(workers);
+	sem_destroy(&workerdone);
+	fuse_session_reset(se);
 }
 
 int
 main(int argc, char *argv[])
 {
+	nworkers = envcount("CGRPFS_WORKERS", 0, 0, WORKERS_MAX);
+	eventbatch = envcount("CGRPFS_EVENT_BATCH", EVENT_BATCH, 1, 4096);
+	requestshare = envcount("CGRPFS_REQUEST_SHARE", REQUEST_SHARE, 1,
+		4096);
+	cgops.init = fsinit;
 	cgmgr_init();
 
-	cgmgr.fuse = fuse_setup(argc, argv, &cgops, sizeof(cgops),
-		&cgmgr.mountpoint, &cgmgr.mt, &cgmgr);
-	if (!cgmgr.fuse)
-		errx(EXIT_FAILURE, "Failed to mount filesystem.");
+	if (cgmgr.fsfd >= 0)
+		takeover(argc, argv);
+	else {
+		cgmgr.fuse = fuse_setup(argc, argv, &cgops, sizeof(cgops),
+			&cgmgr.mountpoint, &cgmgr.mt, NULL);
+		if (!cgmgr.fuse)
+			errx(EXIT_FAILURE, "Failed to mount filesystem.");
+	}
 
 	printf("CGrpFS mounted at %s\n", cgmgr.mountpoint);
 
-	loop();
+	if (nworkers > 0)
+		runworkers();
+	else {
+		/* only the single-threaded loop can stop to hand over */
+		handoff_listen();
+
+		/* a successor now serves the mount, so leave it be */
+		if (loop() == 1)
+			return 0;
+	}
 
+	while (!LIST_EMPTY(&cgmgr.insts))
+		inst_unmount(LIST_FIRST(&cgmgr.insts));
 	fuse_teardown(cgmgr.fuse, cgmgr.mountpoint);
 }
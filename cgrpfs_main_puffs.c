@@ -5,6 +5,7 @@
 /* these must come first */
 
 #include <sys/event.h>
+#include <sys/socket.h>
 
 #include <assert.h>
 #include <err.h>
@@ -12,13 +13,132 @@
 #include <getopt.h>
 #include <mntopts.h>
 #include <paths.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cgrpfs.h"
 
 cgmgr_t cgmgr;
 static struct puffs_usermount *pu;
 
+/* most process events handled each time the doorbell rings */
+#define EVENT_BATCH 64
+
+/*
+ * The doorbell, rung by the waiter thread on its end, [1], when the event
+ * backend has events, and answered by the mainloop on its end, [0], once it
+ * has handled them.
+ */
+static int doorbell[2];
+
+/* each instance would need its own threads here */
+int
+fs_mount(cg_inst_t *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+}
+
+/*
+ * Wait for the event backend to have events, and ring the doorbell; then wait
+ * to be answered before looking again, since they'd still be there.
+ */
+static void *
+waiter(void *unused)
+{
+	struct pollfd pfd = { .fd = cgmgr.evfd, .events = POLLIN };
+	char c = 0;
+
+	(void)unused;
+
+	for (;;) {
+		if (poll(&pfd, 1, INFTIM) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "Failed to wait for events");
+		}
+
+		if (write(doorbell[1], &c, 1) < 0 ||
+			read(doorbell[1], &c, 1) < 1)
+			err(EXIT_FAILURE, "Failed to ring doorbell");
+	}
+
+	return NULL;
+}
+
+/* Read a ring of the doorbell as a frame. */
+static int
+doorbellread(struct puffs_usermount *pu, struct puffs_framebuf *pb, int fd,
+	int *done)
+{
+	char c;
+	ssize_t r = read(fd, &c, 1);
+
+	if (r == 0)
+		return ECONNRESET;
+	else if (r < 0)
+		return errno == EAGAIN ? 0 : errno;
+
+	*done = 1;
+	return 0;
+}
+
+/*
+ * Handle the events the doorbell rang for, on the mainloop like any vnode
+ * operation, so that nothing need be locked.
+ */
+static void
+doorbellrang(struct puffs_usermount *pu, struct puffs_framebuf *pb)
+{
+	cg_event_t ev;
+	char c = 0;
+	int r = 0;
+
+	puffs_framebuf_destroy(pb);
+
+	/* any left over ring it again, after waiting requests are served */
+	for (int i = 0; i < EVENT_BATCH && (r = ev_poll(&ev)) > 0; i++)
+		cgmgr_event(&ev);
+	if (r < 0)
+		err(EXIT_FAILURE, "Failed to wait for events");
+
+	if (write(doorbell[0], &c, 1) < 0)
+		err(EXIT_FAILURE, "Failed to answer doorbell");
+}
+
+/* Have process events handled on the mainloop, as rung by the waiter. */
+static void
+initdoorbell(void)
+{
+	sigset_t set, oldset;
+	pthread_t thrd;
+	int r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, doorbell) < 0)
+		err(EXIT_FAILURE, "Failed to create doorbell");
+
+	/* a kqueue can't take the write filter framebuf wants; a socket can */
+	puffs_framev_init(pu, doorbellread, NULL, NULL, doorbellrang, NULL);
+	if (puffs_framev_addfd(pu, doorbell[0], PUFFS_FBIO_READ) < 0)
+		err(EXIT_FAILURE, "Failed to add doorbell to mainloop");
+
+	/* signals are left to the mainloop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	r = pthread_create(&thrd, NULL, waiter, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (r != 0)
+		errx(EXIT_FAILURE, "pthread_create failed: %s", strerror(r));
+}
+
 static void
 usage()
 {
@@ -92,18 +212,7 @@ main(int argc, char *argv[])
 		NULL)
 		err(1, "init");
 
-		/*
-	 * The framebuf interface is useless to us as it tries to add a write
-	 * event filter, which doesn't work on kernel queues.
-	 * We could maybe have a separate thread wait for the KQ FD to become
-	 * ready then sent a byte along a pipe instead, but that can be done
-	 * another time.
-	 */
-#if 0
-	puffs_framev_init(pu, kq_fdread_fn, NULL, NULL, NULL, NULL);
-	if (puffs_framev_addfd(pu, cgmgr.kq, PUFFS_FBIO_READ) < 0)
-		err(1, "framebuf addfd kq");
-#endif
+	initdoorbell();
 
 	puffs_set_errnotify(pu, puffs_kernerr_abort);
 	if (detach)
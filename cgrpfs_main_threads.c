@@ -15,6 +15,18 @@
 
 cgmgr_t cgmgr;
 
+/* each instance would need its own threads here */
+int
+fs_mount(cg_inst_t *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -23,7 +35,7 @@ main(int argc, char *argv[])
 	cgmgr_init();
 
 	cgmgr.fuse = fuse_setup(argc, argv, &cgops, sizeof(cgops),
-		&cgmgr.mountpoint, &cgmgr.mt, &cgmgr);
+		&cgmgr.mountpoint, &cgmgr.mt, NULL);
 	if (!cgmgr.fuse)
 		errx(EXIT_FAILURE, "Failed to mount filesystem.");
 
@@ -0,0 +1,968 @@
+/*
+ * Persistence of the CGroup tree and PID map across restarts of the daemon.
+ *
+ * The state is saved as a snapshot, and a journal of the changes made since,
+ * both made of trace records (cgrpfs_trace.h). Changes are appended to a
+ * buffer in memory as they are made; a writer thread writes the buffer to the
+ * journal and fsyncs it, at most every CGRPFS_PERSIST_SYNC ms, so a crash
+ * loses no more than that. A snapshot is built in memory, with the lock held,
+ * every CGRPFS_PERSIST_INTERVAL ms or once the journal reaches
+ * CGRPFS_PERSIST_JOURNALMAX bytes. The writer thread then writes it out and
+ * starts a new journal.
+ *
+ * On startup, the snapshot is loaded and the journal applied to it. Recovered
+ * PIDs are only placed in their CGroups; proctab_adopt() then checks them
+ * against the process table, tracking those still running.
+ *
+ * A handoff to a successor daemon encodes the state the same way, adding the
+ * IDs of the CGroups and the settings of their control files.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+/* a growable buffer of records */
+typedef struct pbuf {
+	char *data;
+	size_t len, size;
+} pbuf_t;
+
+persist_stats_t persist_stats;
+
+static char *statedir;
+static char *snappath, *snaptmp, *jpath, *jtmp;
+static int jfd = -1; /* the journal; only used by the writer after start */
+static uint64_t gen; /* generation of the last snapshot taken */
+static bool snaprequested; /* is an early snapshot already due? */
+
+static pthread_mutex_t plock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushcond = PTHREAD_COND_INITIALIZER;
+/* guarded by plock */
+static bool writing; /* is the writer writing out what it took? */
+static pbuf_t jbuf; /* journal records not yet written */
+static pbuf_t sbuf; /* a snapshot not yet written, if it has data */
+static size_t snapoff; /* how much of jbuf precedes that snapshot */
+static uint64_t snapgen; /* and its generation */
+static size_t jsize; /* bytes journalled since the last snapshot */
+static bool lost; /* was a change dropped since the last snapshot? */
+
+/* Append a record to a buffer; returns 0, or -1 if out of memory. */
+static int
+putrec(pbuf_t *b, uint16_t type, int32_t pid, int32_t arg, const void *data1,
+	size_t len1, const void *data2, size_t len2)
+{
+	struct cgrpfs_trace_rec rec;
+	size_t len = sizeof rec + len1 + len2;
+	size_t padded = (len + 7) & ~(size_t)7;
+	char *p;
+
+	if (padded > UINT16_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (b->len + padded > b->size) {
+		size_t size = b->size ? b->size : 65536;
+		char *data;
+
+		while (size < b->len + padded)
+			size *= 2;
+		if ((data = realloc(b->data, size)) == NULL)
+			return -1;
+		b->data = data;
+		b->size = size;
+	}
+
+	memset(&rec, 0, sizeof rec);
+	rec.type = type;
+	rec.len = padded;
+	rec.pid = pid;
+	rec.arg = arg;
+
+	p = b->data + b->len;
+	memcpy(p, &rec, sizeof rec);
+	if (len1)
+		memcpy(p + sizeof rec, data1, len1);
+	if (len2)
+		memcpy(p + sizeof rec + len1, data2, len2);
+	memset(p + len, 0, padded - len);
+	b->len += padded;
+
+	return 0;
+}
+
+/* Write all of a buffer to an fd. */
+static int
+writeall(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = write(fd, data, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		else if (r < 0)
+			return -1;
+		data += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* fsync the state directory, so that a rename within it is durable. */
+static void
+syncdir(void)
+{
+	int fd = open(statedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Write a file under a temporary name, then rename it into place. */
+static int
+writefile(const char *tmppath, const char *path, const char *data, size_t len)
+{
+	int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+	if (fd < 0)
+		return -1;
+
+	if (writeall(fd, data, len) < 0 || fsync(fd) < 0) {
+		int olderrno = errno;
+
+		close(fd);
+		unlink(tmppath);
+		errno = olderrno;
+		return -1;
+	}
+
+	close(fd);
+	if (rename(tmppath, path) < 0)
+		return -1;
+	syncdir();
+
+	return 0;
+}
+
+/* Start a new, empty journal for the snapshot of generation sgen. */
+static int
+newjournal(uint64_t sgen)
+{
+	struct cgrpfs_trace_hdr hdr = { CGRPFS_JOURNAL_MAGIC,
+		CGRPFS_TRACE_VERSION, sgen };
+	int fd;
+
+	if (writefile(jtmp, jpath, (char *)&hdr, sizeof hdr) < 0)
+		return -1;
+	if ((fd = open(jpath, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (jfd >= 0)
+		close(jfd);
+	jfd = fd;
+
+	return 0;
+}
+
+static void *
+writer_thread(void *unused)
+{
+	pbuf_t w = { 0 }, tmp, s;
+	struct timespec interval = { CGRPFS_PERSIST_SYNC / 1000,
+		(CGRPFS_PERSIST_SYNC % 1000) * 1000000 };
+	size_t off;
+	uint64_t sgen;
+
+	(void)unused;
+
+	for (;;) {
+		pthread_mutex_lock(&plock);
+		while (jbuf.len == 0 && sbuf.len == 0)
+			pthread_cond_wait(&pcond, &plock);
+
+		/* take the records, and give back the last buffer to reuse */
+		tmp = jbuf;
+		jbuf = w;
+		jbuf.len = 0;
+		w = tmp;
+		s = sbuf;
+		sbuf = (pbuf_t) { 0 };
+		off = s.len ? snapoff : w.len;
+		sgen = snapgen;
+		writing = true;
+		pthread_mutex_unlock(&plock);
+
+		/*
+		 * What precedes a snapshot goes to the old journal, which still
+		 * matters if the snapshot doesn't make it to disk.
+		 */
+		if (writeall(jfd, w.data, off) < 0) {
+			warn("Failed to write journal");
+			persist_stats.errors++;
+		}
+
+		if (s.len) {
+			if (writefile(snaptmp, snappath, s.data, s.len) < 0 ||
+				newjournal(sgen) < 0) {
+				warn("Failed to write snapshot");
+				persist_stats.errors++;
+			} else
+				persist_stats.snapshots++;
+			free(s.data);
+
+			if (writeall(jfd, w.data + off, w.len - off) < 0) {
+				warn("Failed to write journal");
+				persist_stats.errors++;
+			}
+		}
+
+		fsync(jfd);
+		persist_stats.syncs++;
+
+		pthread_mutex_lock(&plock);
+		writing = false;
+		pthread_cond_broadcast(&flushcond);
+		pthread_mutex_unlock(&plock);
+
+		/* let records gather, rather than fsync for every few */
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/* Take an early snapshot, once the journal has grown long. */
+static void
+requestsnapshot(void)
+{
+	if (snaprequested)
+		return;
+
+	snaprequested = true;
+	if (ev_settimer(CGT_SNAPSHOT, 0) < 0)
+		warn("Failed to set snapshot timer");
+}
+
+/*
+ * Give up on the journal until the next snapshot, which is taken early, after
+ * failing to record a change.
+ */
+static void
+marklost(void)
+{
+	pthread_mutex_lock(&plock);
+	lost = true;
+	pthread_mutex_unlock(&plock);
+	requestsnapshot();
+}
+
+/* Append a change to the journal buffer. */
+static void
+journal(uint16_t type, int32_t pid, int32_t arg, const char *path,
+	const char *path2)
+{
+	size_t len1 = path ? strlen(path) + 1 : 0;
+	size_t len2 = path2 ? strlen(path2) + 1 : 0;
+	size_t before;
+	bool full;
+
+	pthread_mutex_lock(&plock);
+
+	/* once a change is lost, the journal is superseded anyway */
+	if (!lost) {
+		before = jbuf.len;
+		if (before >= CGRPFS_PERSIST_BUFMAX ||
+			putrec(&jbuf, type, pid, arg, path, len1, path2,
+				len2) < 0) {
+			lost = true;
+			persist_stats.overflows++;
+		} else {
+			jsize += jbuf.len - before;
+			if (before == 0)
+				pthread_cond_signal(&pcond);
+		}
+	}
+
+	full = lost || jsize >= CGRPFS_PERSIST_JOURNALMAX;
+	pthread_mutex_unlock(&plock);
+
+	if (full)
+		requestsnapshot();
+}
+
+/* Append a path to buf at len, returning the new length or 0 if too long. */
+static size_t
+pathappend(char *buf, size_t len, const char *name)
+{
+	size_t namelen = strlen(name);
+
+	if (len + 1 + namelen >= PATH_MAX)
+		return 0;
+
+	buf[len] = '/';
+	memcpy(buf + len + 1, name, namelen + 1);
+	return len + 1 + namelen;
+}
+
+/* Add a node's mode and owner to a snapshot. */
+static int
+snapattr(pbuf_t *b, cg_node_t *node, const char *path, size_t pathlen)
+{
+	if (putrec(b, CGRPFS_TR_CHMOD, 0, node->attr.st_mode & 07777, path,
+		    pathlen + 1, NULL, 0) < 0)
+		return -1;
+	return putrec(b, CGRPFS_TR_CHOWN, node->attr.st_uid,
+		node->attr.st_gid, path, pathlen + 1, NULL, 0);
+}
+
+/*
+ * Add a CGroup and its descendants to a snapshot, numbering them, and with
+ * their IDs if full is set.
+ */
+static int
+snapcg(pbuf_t *b, cg_node_t *node, char *path, size_t pathlen,
+	unsigned *nextidx, bool full)
+{
+	cg_node_t *subnode;
+
+	node->snapidx = (*nextidx)++;
+
+	if (node->parent) {
+		if (putrec(b, CGRPFS_TR_MKDIR, 0, node->attr.st_mode & 07777,
+			    path, pathlen + 1, NULL, 0) < 0)
+			return -1;
+		if ((node->attr.st_uid || node->attr.st_gid) &&
+			putrec(b, CGRPFS_TR_CHOWN, node->attr.st_uid,
+				node->attr.st_gid, path, pathlen + 1, NULL,
+				0) < 0)
+			return -1;
+	} else if (node->attrset && snapattr(b, node, "/", 1) < 0)
+		return -1;
+
+	if (full && putrec(b, CGRPFS_TR_CGID, node->id >> 32,
+			    (uint32_t)node->id, NULL, 0, NULL, 0) < 0)
+		return -1;
+
+	LIST_FOREACH (subnode, &node->subnodes, entries) {
+		size_t sublen;
+
+		if (subnode->type != CGN_CG_DIR && !subnode->attrset)
+			continue;
+		else if (subnode->type > CGN_CG_DIR)
+			continue; /* cgroup.meta */
+
+		if ((sublen = pathappend(path, pathlen, subnode->name)) == 0) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if (subnode->type == CGN_CG_DIR) {
+			if (snapcg(b, subnode, path, sublen, nextidx, full) < 0)
+				return -1;
+		} else if (snapattr(b, subnode, path, sublen) < 0)
+			return -1;
+
+		path[pathlen] = '\0';
+	}
+
+	return 0;
+}
+
+/* Add a setting of a control file of the CGroup at path. */
+static int
+snapsetting(pbuf_t *b, char *path, size_t pathlen, const char *file,
+	const char *val)
+{
+	size_t len = pathappend(path, pathlen, file);
+	int r;
+
+	if (len == 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	r = putrec(b, CGRPFS_TR_WRITE, 0, strlen(val), path, len + 1, val,
+		strlen(val));
+	path[pathlen] = '\0';
+	return r;
+}
+
+/*
+ * Add the settings of the control files of a CGroup and its descendants which
+ * differ from those a new CGroup would have.
+ */
+static int
+snapsettings(pbuf_t *b, cg_node_t *node, char *path, size_t pathlen)
+{
+	cg_node_t *subnode;
+	char pidsmax[32];
+
+	/* as on creation, notify_on_release is inherited */
+	if (node->notify != (node->parent && node->parent->notify) &&
+		snapsetting(b, path, pathlen, "notify_on_release",
+			node->notify ? "1" : "0") < 0)
+		return -1;
+	if (node->agent &&
+		snapsetting(b, path, pathlen, "release_agent", node->agent) < 0)
+		return -1;
+	if (node->pidsmax >= 0) {
+		snprintf(pidsmax, sizeof pidsmax, "%ld", node->pidsmax);
+		if (snapsetting(b, path, pathlen, "pids.max", pidsmax) < 0)
+			return -1;
+	}
+	if (node->autoremove &&
+		snapsetting(b, path, pathlen, "cgroup.autoremove", "1") < 0)
+		return -1;
+	if (node->frozen &&
+		snapsetting(b, path, pathlen, "cgroup.freeze", "1") < 0)
+		return -1;
+	if (node->killing &&
+		snapsetting(b, path, pathlen, "cgroup.kill", "1") < 0)
+		return -1;
+
+	LIST_FOREACH (subnode, &node->subnodes, entries) {
+		size_t sublen;
+
+		if (subnode->type != CGN_CG_DIR)
+			continue;
+		if ((sublen = pathappend(path, pathlen, subnode->name)) == 0) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		if (snapsettings(b, subnode, path, sublen) < 0)
+			return -1;
+		path[pathlen] = '\0';
+	}
+
+	return 0;
+}
+
+/*
+ * Build a snapshot of generation sgen; if full is set, with everything a
+ * handoff needs.
+ */
+static int
+buildsnapshot(pbuf_t *b, uint64_t sgen, bool full)
+{
+	struct cgrpfs_trace_hdr hdr = { CGRPFS_SNAPSHOT_MAGIC,
+		CGRPFS_TRACE_VERSION, sgen };
+	char path[PATH_MAX] = "";
+	pid_hash_entry_t *entry, *tmp;
+	unsigned nextidx = 0;
+
+	/* the header is no record, so make room and then drop the record */
+	if (putrec(b, 0, 0, 0, NULL, 0, NULL, 0) < 0)
+		return -1;
+	memcpy(b->data, &hdr, sizeof hdr);
+	b->len = sizeof hdr;
+
+	if (snapcg(b, cgmgr.rootnode, path, 0, &nextidx, full) < 0)
+		return -1;
+
+	HASH_ITER (hh, cgmgr.pidcg, entry, tmp)
+		if (putrec(b, CGRPFS_TR_ATTACH, entry->pid,
+			    entry->node->snapidx, NULL, 0, NULL, 0) < 0)
+			return -1;
+
+	/* after the PIDs, so that freezing and killing apply to them */
+	if (full && snapsettings(b, cgmgr.rootnode, path, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+void
+persist_snapshot(void)
+{
+	pbuf_t b = { 0 };
+	bool changed;
+
+	if (!cgmgr.persisting)
+		return;
+
+	snaprequested = false;
+	if (ev_settimer(CGT_SNAPSHOT, CGRPFS_PERSIST_INTERVAL) < 0)
+		warn("Failed to set snapshot timer");
+
+	pthread_mutex_lock(&plock);
+	changed = jsize > 0 || lost;
+	pthread_mutex_unlock(&plock);
+
+	if (!changed)
+		return;
+
+	if (buildsnapshot(&b, gen + 1, false) < 0) {
+		warn("Failed to build snapshot");
+		persist_stats.errors++;
+		free(b.data);
+		return;
+	}
+
+	pthread_mutex_lock(&plock);
+	free(sbuf.data); /* superseded before it was written */
+	sbuf = b;
+	snapoff = jbuf.len;
+	snapgen = ++gen;
+	jsize = 0;
+	lost = false;
+	pthread_cond_signal(&pcond);
+	pthread_mutex_unlock(&plock);
+}
+
+/* Read a whole file; returns NULL, with errno ENOENT if it doesn't exist. */
+static char *
+readfile(const char *path, size_t *lenout)
+{
+	struct stat sb;
+	char *data;
+	ssize_t r;
+	size_t len = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if (fstat(fd, &sb) < 0 || (data = malloc(sb.st_size + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	while (len < (size_t)sb.st_size &&
+		(r = read(fd, data + len, sb.st_size - len)) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		else if (r < 0) {
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		len += r;
+	}
+
+	close(fd);
+	*lenout = len;
+	return data;
+}
+
+/* Look up the CGroup at a path, creating it as needed. */
+static cg_node_t *
+mkcgpath(const char *path, mode_t mode)
+{
+	cg_node_t *node;
+	const char *rest;
+
+	node = lookupprefix(path, &rest);
+	if (*rest != '\0' && mkcgdirs(node, rest, mode, 0, 0, &node) < 0)
+		return NULL;
+
+	return node->type == CGN_CG_DIR ? node : NULL;
+}
+
+/* Apply a record of a snapshot or journal. */
+static void
+applyrec(const struct cgrpfs_trace_rec *rec, const char *data, size_t datalen,
+	cg_node_t ***index, size_t *nindex)
+{
+	const char *path = data, *path2 = NULL;
+	cg_node_t *node, *parent;
+	pid_hash_entry_t *entry;
+	uintptr_t pidp;
+	size_t pathlen;
+
+	pathlen = strnlen(data, datalen);
+	if (pathlen == datalen)
+		path = NULL;
+	else if (rec->type == CGRPFS_TR_RENAME &&
+		strnlen(data + pathlen + 1, datalen - pathlen - 1) <
+			datalen - pathlen - 1)
+		path2 = data + pathlen + 1;
+
+	switch (rec->type) {
+	case CGRPFS_TR_MKDIR:
+		if (!path)
+			return;
+		node = mkcgpath(path, rec->arg & 07777);
+		if (node)
+			node->attr.st_mode = S_IFDIR | (rec->arg & 07777);
+		if (index) {
+			cg_node_t **newindex = realloc(*index,
+				(*nindex + 1) * sizeof **index);
+
+			if (!newindex)
+				err(EXIT_FAILURE, "Failed to load snapshot");
+			*index = newindex;
+			(*index)[(*nindex)++] = node;
+		}
+		break;
+
+	case CGRPFS_TR_RMDIR:
+		if (path && (node = lookupnode(path, false)) != NULL &&
+			node->type == CGN_CG_DIR && node != cgmgr.rootnode)
+			removenode(node);
+		break;
+
+	case CGRPFS_TR_RENAME:
+		if (!path || !path2)
+			return;
+		node = lookupnode(path, false);
+		parent = lookupnode(path2, true);
+		if (node && parent && node->parent == parent &&
+			node->type == CGN_CG_DIR) {
+			free(node->name);
+			node->name = strdup(strrchr(path2, '/') + 1);
+			shm_setcgtree(node);
+		}
+		break;
+
+	case CGRPFS_TR_CHMOD:
+	case CGRPFS_TR_CHOWN:
+		if (!path || (node = lookupnode(path, false)) == NULL)
+			return;
+		if (rec->type == CGRPFS_TR_CHMOD) {
+			node->attr.st_mode &= ~07777;
+			node->attr.st_mode |= rec->arg & 07777;
+		} else {
+			node->attr.st_uid = rec->pid;
+			node->attr.st_gid = rec->arg;
+		}
+		if (node->type != CGN_CG_DIR || node == cgmgr.rootnode)
+			node->attrset = true;
+		break;
+
+	case CGRPFS_TR_ATTACH:
+		if (index)
+			node = rec->arg >= 0 && (size_t)rec->arg < *nindex ?
+				(*index)[rec->arg] :
+				NULL;
+		else
+			node = path ? lookupnode(path, false) : NULL;
+		if (!node || node->type != CGN_CG_DIR)
+			node = cgmgr.rootnode;
+		placepid(node, rec->pid);
+		break;
+
+	case CGRPFS_TR_FORK:
+		pidp = rec->arg;
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		placepid(entry ? entry->node : cgmgr.rootnode, rec->pid);
+		break;
+
+	case CGRPFS_TR_EXIT:
+		forgetpid(rec->pid);
+		break;
+
+	case CGRPFS_TR_CGID:
+		if (!index)
+			return;
+		node = (*index)[*nindex - 1];
+		if (!node)
+			return;
+		/* republished with the right ID once all are set */
+		shm_delcg(node);
+		node->id = (uint64_t)(uint32_t)rec->pid << 32 |
+			(uint32_t)rec->arg;
+		break;
+
+	case CGRPFS_TR_WRITE:
+		if (!path || rec->arg < 0 ||
+			(size_t)rec->arg > datalen - pathlen - 1)
+			return;
+		if ((node = lookupnode(path, false)) != NULL &&
+			nodewrite(node, path + pathlen + 1, rec->arg, NULL) < 0)
+			warnx("Failed to restore %s", path);
+		break;
+	}
+}
+
+/*
+ * Apply the records of a snapshot or journal, whose header has been checked.
+ * A journal may end with a record cut short by a crash, which is ignored.
+ */
+static void
+apply(const char *data, size_t len, bool snapshot)
+{
+	cg_node_t **index = NULL;
+	size_t nindex = 0, off;
+
+	if (snapshot) {
+		/* the root CGroup is index 0 */
+		if ((index = malloc(sizeof *index)) == NULL)
+			err(EXIT_FAILURE, "Failed to load snapshot");
+		index[nindex++] = cgmgr.rootnode;
+	}
+
+	for (off = sizeof(struct cgrpfs_trace_hdr);
+		off + sizeof(struct cgrpfs_trace_rec) <= len;) {
+		struct cgrpfs_trace_rec rec;
+
+		memcpy(&rec, data + off, sizeof rec);
+		if (rec.len < sizeof rec || off + rec.len > len)
+			break;
+
+		applyrec(&rec, data + off + sizeof rec, rec.len - sizeof rec,
+			index ? &index : NULL, &nindex);
+		off += rec.len;
+	}
+
+	free(index);
+}
+
+/*
+ * Load a snapshot or journal. For a journal, sgen is the generation it must
+ * match; for a snapshot, it is set to that of the snapshot.
+ */
+static int
+load(const char *path, uint32_t magic, uint64_t *sgen)
+{
+	struct cgrpfs_trace_hdr hdr;
+	size_t len;
+	char *data;
+
+	if ((data = readfile(path, &len)) == NULL)
+		return errno == ENOENT ? 0 : -1;
+
+	if (len < sizeof hdr) {
+		free(data);
+		return 0; /* cut short while being written */
+	}
+
+	memcpy(&hdr, data, sizeof hdr);
+	if (hdr.magic != magic || hdr.version != CGRPFS_TRACE_VERSION) {
+		warnx("%s is not CGrpFS saved state", path);
+		free(data);
+		return -1;
+	} else if (magic == CGRPFS_JOURNAL_MAGIC && hdr.epoch != *sgen) {
+		free(data);
+		return 0; /* older than the snapshot, so contained in it */
+	}
+
+	*sgen = hdr.epoch;
+	apply(data, len, magic == CGRPFS_SNAPSHOT_MAGIC);
+	free(data);
+
+	return 0;
+}
+
+void
+persist_init(const char *dir, bool recover)
+{
+	struct timespec start, end;
+
+	if (!dir || *dir == '\0')
+		return;
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		warn("Failed to create state directory %s", dir);
+		return;
+	}
+
+	if ((statedir = strdup(dir)) == NULL ||
+		asprintf(&snappath, "%s/snapshot", dir) < 0 ||
+		asprintf(&snaptmp, "%s/snapshot.new", dir) < 0 ||
+		asprintf(&jpath, "%s/journal", dir) < 0 ||
+		asprintf(&jtmp, "%s/journal.new", dir) < 0)
+		err(EXIT_FAILURE, "Failed to allocate state paths");
+
+	if (!recover)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (load(snappath, CGRPFS_SNAPSHOT_MAGIC, &gen) < 0)
+		warn("Failed to load snapshot %s", snappath);
+	else if (load(jpath, CGRPFS_JOURNAL_MAGIC, &gen) < 0)
+		warn("Failed to load journal %s", jpath);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (HASH_COUNT(cgmgr.pidcg) > 0 || cgmgr.rootnode->ndescendants > 0)
+		printf("Recovered %u CGroups and %u PIDs in %.1f ms\n",
+			cgmgr.rootnode->ndescendants, HASH_COUNT(cgmgr.pidcg),
+			(end.tv_sec - start.tv_sec) * 1e3 +
+				(end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+void
+persist_start(void)
+{
+	pbuf_t b = { 0 };
+	pthread_t thrd;
+	int r;
+
+	if (!statedir)
+		return;
+
+	/* what was recovered, and then checked, is the new baseline */
+	if (buildsnapshot(&b, gen + 1, false) < 0 ||
+		writefile(snaptmp, snappath, b.data, b.len) < 0 ||
+		newjournal(gen + 1) < 0) {
+		warn("Failed to write initial snapshot; not saving state");
+		free(b.data);
+		return;
+	}
+
+	gen++;
+	free(b.data);
+	persist_stats.snapshots++;
+
+	r = pthread_create(&thrd, NULL, writer_thread, NULL);
+	if (r != 0)
+		errx(EXIT_FAILURE, "pthread_create failed: %s", strerror(r));
+
+	if (ev_settimer(CGT_SNAPSHOT, CGRPFS_PERSIST_INTERVAL) < 0)
+		warn("Failed to set snapshot timer");
+
+	cgmgr.persisting = true;
+}
+
+void
+persist_mkdir(cg_node_t *node)
+{
+	char *path = nodefullpath(node);
+
+	if (!path)
+		return marklost();
+
+	journal(CGRPFS_TR_MKDIR, 0, node->attr.st_mode & 07777, path, NULL);
+	if (node->attr.st_uid || node->attr.st_gid)
+		journal(CGRPFS_TR_CHOWN, node->attr.st_uid, node->attr.st_gid,
+			path, NULL);
+	free(path);
+}
+
+void
+persist_rmdir(cg_node_t *node)
+{
+	char *path = nodefullpath(node);
+
+	if (!path)
+		return marklost();
+
+	journal(CGRPFS_TR_RMDIR, 0, 0, path, NULL);
+	free(path);
+}
+
+void
+persist_rename(cg_node_t *node, const char *oldname)
+{
+	char *parentpath = nodefullpath(node->parent), *oldpath = NULL;
+	char *newpath = nodefullpath(node);
+
+	if (parentpath && asprintf(&oldpath, "%s/%s",
+				  node->parent == cgmgr.rootnode ? "" :
+								   parentpath,
+				  oldname) < 0)
+		oldpath = NULL;
+
+	if (oldpath && newpath)
+		journal(CGRPFS_TR_RENAME, 0, 0, oldpath, newpath);
+	else
+		marklost();
+
+	free(parentpath);
+	free(oldpath);
+	free(newpath);
+}
+
+void
+persist_setattr(cg_node_t *node)
+{
+	char *path;
+
+	/* cgroup.meta and what is within it are generated */
+	if (node->type > CGN_CG_DIR)
+		return;
+
+	if ((path = nodefullpath(node)) == NULL)
+		return marklost();
+
+	journal(CGRPFS_TR_CHMOD, 0, node->attr.st_mode & 07777, path, NULL);
+	journal(CGRPFS_TR_CHOWN, node->attr.st_uid, node->attr.st_gid, path,
+		NULL);
+	free(path);
+}
+
+void
+persist_attach(cg_node_t *node, pid_t pid)
+{
+	char *path = nodefullpath(node);
+
+	if (!path)
+		return marklost();
+
+	journal(CGRPFS_TR_ATTACH, pid, 0, path, NULL);
+	free(path);
+}
+
+void
+persist_fork(pid_t pid, pid_t ppid)
+{
+	journal(CGRPFS_TR_FORK, pid, ppid, NULL, NULL);
+}
+
+void
+persist_exit(pid_t pid)
+{
+	journal(CGRPFS_TR_EXIT, pid, 0, NULL, NULL);
+}
+
+void
+persist_flush(void)
+{
+	if (!cgmgr.persisting)
+		return;
+
+	pthread_mutex_lock(&plock);
+	while (jbuf.len || sbuf.len || writing)
+		pthread_cond_wait(&flushcond, &plock);
+	pthread_mutex_unlock(&plock);
+}
+
+char *
+persist_encode(size_t *lenout)
+{
+	pbuf_t b = { 0 };
+
+	if (buildsnapshot(&b, 0, true) < 0) {
+		free(b.data);
+		return NULL;
+	}
+
+	*lenout = b.len;
+	return b.data;
+}
+
+int
+persist_decode(const char *data, size_t len)
+{
+	struct cgrpfs_trace_hdr hdr;
+
+	if (len < sizeof hdr)
+		return -1;
+	memcpy(&hdr, data, sizeof hdr);
+	if (hdr.magic != CGRPFS_SNAPSHOT_MAGIC ||
+		hdr.version != CGRPFS_TRACE_VERSION)
+		return -1;
+
+	apply(data, len, true);
+	shm_setcgtree(cgmgr.rootnode);
+
+	return 0;
+}
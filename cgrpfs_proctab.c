@@ -0,0 +1,975 @@
+/*
+ * Per-CGroup CPU and memory accounting, sampled from the process table, and
+ * reconciliation of the PID map with it.
+ *
+ * The whole process table is read at once - on the BSDs with a single sysctl,
+ * and on Linux, where it is only used for testing, from /proc - and each
+ * process's figures are added to its CGroup's, found through cgmgr.pidcg.
+ * The figures are then summed up the tree, so the cost is proportional to the
+ * number of processes plus the number of CGroups.
+ *
+ * A sweep of the whole table costs one lookup in cgmgr.pidcg per process;
+ * beyond that, its work is in proportion to the drift it finds. Sweeps are
+ * routine, or made when anything may have been missed. A reconciliation
+ * prompted by a missed fork whose parent is known instead walks the subtree of
+ * the parent's nearest tracked ancestor, reading only the children of those it
+ * walks: from /proc on Linux, or on the BSDs, which can't read the table by
+ * parent, from the whole table, read once per walk.
+ *
+ * At startup, every process already running is adopted from a single read of
+ * the table, so that the PID map is complete before the filesystem is mounted.
+ *
+ * The owner of a single process is also looked up here, for permission checks.
+ */
+
+#include <sys/types.h>
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#endif
+#ifdef __FreeBSD__
+#include <sys/user.h>
+#endif
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+/* a process, as read from the process table */
+typedef struct procinfo {
+	pid_t pid, ppid;
+	uint64_t utime, stime; /* usec */
+	uint64_t rss; /* bytes */
+	uint64_t start; /* ms since the Epoch */
+} procinfo_t;
+
+/* the table, reused from one read to the next */
+static procinfo_t *procs;
+static size_t nprocsalloc;
+
+/* the untracked children of a process, reused likewise */
+static procinfo_t *kids;
+static size_t nkidsalloc;
+
+/* the table as last read during a walk, or -1 if not yet read during it */
+static ssize_t ntab = -1;
+
+/* processes whose forks may have been missed, to be walked */
+static pid_t suspects[CGRPFS_RECONCILE_SUSPECTS];
+static size_t nsuspects;
+/* must the next reconciliation sweep the whole table? */
+static bool sweepwanted;
+
+/* when the last sample was taken */
+static struct timespec lastsample;
+
+reconcile_stats_t reconcile_stats;
+
+/* a line of the adoption map: a PID, and the CGroup to adopt it into */
+typedef struct mapentry {
+	pid_t pid;
+	cg_node_t *node;
+	UT_hash_handle hh;
+} mapentry_t;
+
+/* Make room for at least n entries in a table. */
+static int
+reserve(procinfo_t **tab, size_t *nalloc, size_t n)
+{
+	procinfo_t *newtab;
+
+	if (n <= *nalloc)
+		return 0;
+
+	if (n < *nalloc * 2)
+		n = *nalloc * 2;
+
+	newtab = realloc(*tab, n * sizeof **tab);
+	if (!newtab)
+		return -1;
+
+	*tab = newtab;
+	*nalloc = n;
+	return 0;
+}
+
+static pid_hash_entry_t *
+findpid(pid_t pid)
+{
+	pid_hash_entry_t *entry;
+	uintptr_t pidp = pid;
+
+	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	return entry;
+}
+
+#if defined(__FreeBSD__)
+static ssize_t
+proctab_read(procinfo_t **out)
+{
+	static struct kinfo_proc *kp;
+	static size_t kpsize;
+	int mib[3] = { CTL_KERN, KERN_PROC, KERN_PROC_PROC };
+	size_t len, n;
+	long pagesize = getpagesize();
+
+	for (;;) {
+		len = kpsize;
+		if (sysctl(mib, 3, kp, &len, NULL, 0) == 0)
+			break;
+		else if (errno != ENOMEM)
+			return -1;
+
+		/* table grew; size it with some slack, then retry */
+		if (sysctl(mib, 3, NULL, &len, NULL, 0) < 0)
+			return -1;
+		len += len / 8;
+		free(kp);
+		if ((kp = malloc(len)) == NULL) {
+			kpsize = 0;
+			return -1;
+		}
+		kpsize = len;
+	}
+
+	n = len / sizeof *kp;
+	if (reserve(&procs, &nprocsalloc, n) < 0)
+		return -1;
+
+	for (size_t i = 0; i < n; i++) {
+		procs[i].pid = kp[i].ki_pid;
+		procs[i].ppid = kp[i].ki_ppid;
+		procs[i].utime = kp[i].ki_rusage.ru_utime.tv_sec * 1000000 +
+			kp[i].ki_rusage.ru_utime.tv_usec;
+		procs[i].stime = kp[i].ki_rusage.ru_stime.tv_sec * 1000000 +
+			kp[i].ki_rusage.ru_stime.tv_usec;
+		procs[i].rss = (uint64_t)kp[i].ki_rssize * pagesize;
+		procs[i].start = kp[i].ki_start.tv_sec * 1000 +
+			kp[i].ki_start.tv_usec / 1000;
+	}
+
+	*out = procs;
+	return n;
+}
+
+int
+proctab_owner(pid_t pid, uid_t *ruid, uid_t *euid)
+{
+	struct kinfo_proc kp;
+	int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+	size_t len = sizeof kp;
+
+	if (sysctl(mib, 4, &kp, &len, NULL, 0) < 0)
+		return -errno;
+	else if (len == 0)
+		return -ESRCH;
+
+	*ruid = kp.ki_ruid;
+	*euid = kp.ki_uid;
+	return 0;
+}
+#elif defined(__NetBSD__) || defined(__OpenBSD__)
+#ifdef __NetBSD__
+#define KINFO_PROC kinfo_proc2
+#define KERN_PROCS KERN_PROC2
+#else
+#define KINFO_PROC kinfo_proc
+#define KERN_PROCS KERN_PROC
+#endif
+
+static ssize_t
+proctab_read(procinfo_t **out)
+{
+	static struct KINFO_PROC *kp;
+	static size_t kpsize;
+	int mib[6] = { CTL_KERN, KERN_PROCS, KERN_PROC_ALL, 0,
+		sizeof(struct KINFO_PROC), 0 };
+	size_t len, n;
+	long pagesize = getpagesize();
+
+	for (;;) {
+		len = kpsize;
+		mib[5] = len / sizeof *kp;
+		if (sysctl(mib, 6, kp, &len, NULL, 0) == 0)
+			break;
+		else if (errno != ENOMEM)
+			return -1;
+
+		/* table grew; size it with some slack, then retry */
+		mib[5] = 0;
+		if (sysctl(mib, 6, NULL, &len, NULL, 0) < 0)
+			return -1;
+		len += len / 8;
+		free(kp);
+		if ((kp = malloc(len)) == NULL) {
+			kpsize = 0;
+			return -1;
+		}
+		kpsize = len;
+	}
+
+	n = len / sizeof *kp;
+	if (reserve(&procs, &nprocsalloc, n) < 0)
+		return -1;
+
+	for (size_t i = 0; i < n; i++) {
+		procs[i].pid = kp[i].p_pid;
+		procs[i].ppid = kp[i].p_ppid;
+		procs[i].utime = kp[i].p_uutime_sec * 1000000 +
+			kp[i].p_uutime_usec;
+		procs[i].stime = kp[i].p_ustime_sec * 1000000 +
+			kp[i].p_ustime_usec;
+		procs[i].rss = (uint64_t)kp[i].p_vm_rssize * pagesize;
+		procs[i].start = kp[i].p_ustart_sec * 1000 +
+			kp[i].p_ustart_usec / 1000;
+	}
+
+	*out = procs;
+	return n;
+}
+
+int
+proctab_owner(pid_t pid, uid_t *ruid, uid_t *euid)
+{
+	struct KINFO_PROC kp;
+	int mib[6] = { CTL_KERN, KERN_PROCS, KERN_PROC_PID, pid,
+		sizeof kp, 1 };
+	size_t len = sizeof kp;
+
+	if (sysctl(mib, 6, &kp, &len, NULL, 0) < 0)
+		return -errno;
+	else if (len == 0)
+		return -ESRCH;
+
+	*ruid = kp.p_ruid;
+	*euid = kp.p_uid;
+	return 0;
+}
+#else
+/*
+ * Read one process's entry from /proc. boot is the time of boot, in ms since
+ * the Epoch, which start times are relative to.
+ */
+static bool
+readstat(pid_t pid, procinfo_t *proc, long ticks, long pagesize, uint64_t boot)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime, stime, start;
+	long long rss;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof path, "/proc/%lld/stat", (long long)pid);
+	if ((f = fopen(path, "re")) == NULL)
+		return false;
+	len = fread(buf, 1, sizeof buf - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	/* skip past the command name, which may contain anything */
+	if ((p = strrchr(buf, ')')) == NULL)
+		return false;
+
+	if (sscanf(p + 2,
+		    "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+		    "%*d %*d %*d %*d %*d %*d %llu %*u %lld",
+		    &proc->ppid, &utime, &stime, &start, &rss) != 5)
+		return false;
+
+	proc->pid = pid;
+	proc->utime = utime * 1000000 / ticks;
+	proc->stime = stime * 1000000 / ticks;
+	proc->rss = rss * pagesize;
+	proc->start = boot + start * 1000 / ticks;
+
+	return true;
+}
+
+/* Get the time of boot, in ms since the Epoch. */
+static uint64_t
+boottime(void)
+{
+	struct timespec real, sinceboot;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_BOOTTIME, &sinceboot);
+	return (real.tv_sec - sinceboot.tv_sec) * 1000 +
+		(real.tv_nsec - sinceboot.tv_nsec) / 1000000;
+}
+
+static ssize_t
+proctab_read(procinfo_t **out)
+{
+	DIR *dir;
+	struct dirent *dent;
+	long ticks = sysconf(_SC_CLK_TCK);
+	long pagesize = getpagesize();
+	uint64_t boot = boottime();
+	size_t n = 0;
+
+	if ((dir = opendir("/proc")) == NULL)
+		return -1;
+
+	while ((dent = readdir(dir)) != NULL) {
+		char *end;
+		pid_t pid = strtol(dent->d_name, &end, 10);
+
+		if (*end != '\0' || pid <= 0)
+			continue;
+
+		if (reserve(&procs, &nprocsalloc, n + 1) < 0) {
+			closedir(dir);
+			return -1;
+		}
+
+		if (readstat(pid, &procs[n], ticks, pagesize, boot))
+			n++;
+	}
+
+	closedir(dir);
+
+	*out = procs;
+	return n;
+}
+
+int
+proctab_owner(pid_t pid, uid_t *ruid, uid_t *euid)
+{
+	char path[64], line[128];
+	unsigned long r, e;
+	FILE *f;
+	int ret = -EINVAL;
+
+	snprintf(path, sizeof path, "/proc/%lld/status", (long long)pid);
+	if ((f = fopen(path, "re")) == NULL)
+		return errno == ENOENT ? -ESRCH : -errno;
+
+	while (fgets(line, sizeof line, f) != NULL)
+		if (sscanf(line, "Uid: %lu %lu", &r, &e) == 2) {
+			*ruid = r;
+			*euid = e;
+			ret = 0;
+			break;
+		}
+
+	fclose(f);
+	return ret;
+}
+#endif
+
+/* Read the whole table during a walk, unless it has been read already. */
+static bool
+readtab(void)
+{
+	procinfo_t *tab;
+
+	if (ntab < 0 && (ntab = proctab_read(&tab)) < 0)
+		return false;
+	return true;
+}
+
+/*
+ * Find the untracked children of a process in the table, where they can't be
+ * read on their own.
+ */
+static ssize_t
+scanchildren(pid_t ppid, procinfo_t **out)
+{
+	size_t n = 0;
+
+	if (!readtab())
+		return -1;
+
+	for (ssize_t i = 0; i < ntab; i++) {
+		if (procs[i].ppid != ppid || findpid(procs[i].pid))
+			continue;
+		else if (reserve(&kids, &nkidsalloc, n + 1) < 0)
+			return -1;
+		kids[n++] = procs[i];
+	}
+
+	*out = kids;
+	return n;
+}
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+/* Find a process in the table, as it can't be read on its own. */
+static bool
+readproc(pid_t pid, procinfo_t *proc)
+{
+	if (!readtab())
+		return false;
+
+	for (ssize_t i = 0; i < ntab; i++)
+		if (procs[i].pid == pid) {
+			*proc = procs[i];
+			return true;
+		}
+
+	return false;
+}
+
+static ssize_t
+untrackedchildren(pid_t ppid, procinfo_t **out)
+{
+	return scanchildren(ppid, out);
+}
+#else
+static bool
+readproc(pid_t pid, procinfo_t *proc)
+{
+	return readstat(pid, proc, sysconf(_SC_CLK_TCK), getpagesize(),
+		boottime());
+}
+
+/*
+ * Read the untracked children of a process from the children files of its
+ * threads, or if the kernel doesn't provide them, find them in the table.
+ */
+static ssize_t
+untrackedchildren(pid_t ppid, procinfo_t **out)
+{
+	static int havechildren = -1;
+	long ticks = sysconf(_SC_CLK_TCK);
+	long pagesize = getpagesize();
+	uint64_t boot = boottime();
+	char path[64];
+	DIR *dir;
+	struct dirent *dent;
+	long long pid;
+	size_t n = 0;
+	FILE *f;
+
+	if (havechildren < 0) {
+		snprintf(path, sizeof path, "/proc/self/task/%lld/children",
+			(long long)getpid());
+		havechildren = access(path, R_OK) == 0;
+	}
+	if (!havechildren)
+		return scanchildren(ppid, out);
+
+	snprintf(path, sizeof path, "/proc/%lld/task", (long long)ppid);
+	if ((dir = opendir(path)) == NULL)
+		return errno == ENOENT ? 0 : -1;
+
+	while ((dent = readdir(dir)) != NULL) {
+		long tid = strtol(dent->d_name, NULL, 10);
+
+		if (tid <= 0)
+			continue;
+
+		snprintf(path, sizeof path, "/proc/%lld/task/%ld/children",
+			(long long)ppid, tid);
+		if ((f = fopen(path, "re")) == NULL)
+			continue; /* the thread exited */
+
+		while (fscanf(f, "%lld", &pid) == 1) {
+			if (findpid(pid))
+				continue;
+			else if (reserve(&kids, &nkidsalloc, n + 1) < 0) {
+				fclose(f);
+				closedir(dir);
+				return -1;
+			}
+			if (readstat(pid, &kids[n], ticks, pagesize, boot))
+				n++;
+		}
+		fclose(f);
+	}
+
+	closedir(dir);
+
+	*out = kids;
+	return n;
+}
+#endif
+
+/*
+ * Reset the figures of a CGroup and its descendants to what PIDs that exited
+ * within them used.
+ */
+static void
+clearsample(cg_node_t *node)
+{
+	cg_node_t *subnode;
+
+	node->utime = node->exitutime;
+	node->stime = node->exitstime;
+	node->rss = 0;
+
+	LIST_FOREACH (subnode, &node->subnodes, entries)
+		if (subnode->type == CGN_CG_DIR)
+			clearsample(subnode);
+}
+
+/* Add each descendant's figures into those of its ancestors. */
+static void
+rollup(cg_node_t *node)
+{
+	cg_node_t *subnode;
+
+	LIST_FOREACH (subnode, &node->subnodes, entries) {
+		if (subnode->type != CGN_CG_DIR)
+			continue;
+
+		rollup(subnode);
+		node->utime += subnode->utime;
+		node->stime += subnode->stime;
+		node->rss += subnode->rss;
+	}
+}
+
+void
+proctab_sample(void)
+{
+	struct timespec now;
+	procinfo_t *tab;
+	ssize_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (lastsample.tv_sec != 0 &&
+		(now.tv_sec - lastsample.tv_sec) * 1000 +
+				(now.tv_nsec - lastsample.tv_nsec) / 1000000 <
+			CGRPFS_SAMPLE_INTERVAL)
+		return;
+
+	if ((n = proctab_read(&tab)) < 0) {
+		warn("Failed to read process table");
+		return;
+	}
+
+	lastsample = now;
+	clearsample(cgmgr.rootnode);
+
+	for (ssize_t i = 0; i < n; i++) {
+		pid_hash_entry_t *entry;
+		uintptr_t pidp = tab[i].pid;
+		cg_node_t *node;
+
+		HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+		/* untracked are in root CGroup by default */
+		node = entry ? entry->node : cgmgr.rootnode;
+		if (entry) {
+			entry->utime = tab[i].utime;
+			entry->stime = tab[i].stime;
+		}
+
+		node->utime += tab[i].utime;
+		node->stime += tab[i].stime;
+		node->rss += tab[i].rss;
+	}
+
+	rollup(cgmgr.rootnode);
+}
+
+/*
+ * Track an untracked process within its tracked parent's CGroup, if its fork
+ * must have been missed; it wasn't if it was already running when the parent
+ * was moved into its CGroup. Returns whether it was adopted.
+ */
+static bool
+adopt(const procinfo_t *proc, const pid_hash_entry_t *parent)
+{
+	if (parent->since != 0 && proc->start < parent->since)
+		return false;
+	else if (adoptpid(parent->node, proc->pid, proc->ppid) <= 0)
+		return false;
+
+	reconcile_stats.adopted++;
+	return true;
+}
+
+/* Sweep the whole table, adopting missed forks and dropping missed exits. */
+static void
+sweep(void)
+{
+	procinfo_t *tab;
+	pid_hash_entry_t *entry, *tmp;
+	ssize_t n;
+	size_t npending = 0, nlive = 0, ntracked;
+	unsigned gen;
+	bool adopted;
+
+	if ((n = proctab_read(&tab)) < 0) {
+		warn("Failed to read process table");
+		return;
+	}
+
+	gen = ++cgmgr.reconcilegen;
+	ntracked = HASH_COUNT(cgmgr.pidcg);
+	reconcile_stats.runs++;
+
+	/*
+	 * Mark tracked processes seen, and adopt untracked ones with a tracked
+	 * parent. Those whose parent is untracked too are kept at the front of
+	 * the table, in case their parent is adopted.
+	 */
+	for (ssize_t i = 0; i < n; i++) {
+		entry = findpid(tab[i].pid);
+
+		if (entry && entry->seen != gen) {
+			entry->seen = gen;
+			nlive++;
+		} else if (entry)
+			continue; /* adopted earlier in this pass */
+		else if ((entry = findpid(tab[i].ppid)) != NULL)
+			adopt(&tab[i], entry);
+		else if (tab[i].ppid > 1)
+			tab[npending++] = tab[i];
+	}
+
+	/* adopt the descendants of those adopted, a generation at a time */
+	do {
+		size_t kept = 0;
+
+		adopted = false;
+		for (size_t i = 0; i < npending; i++) {
+			pid_hash_entry_t *parent = findpid(tab[i].ppid);
+
+			if (parent)
+				adopted |= adopt(&tab[i], parent);
+			else
+				tab[kept++] = tab[i];
+		}
+		npending = kept;
+	} while (adopted && npending > 0);
+
+	if (nlive == ntracked)
+		return;
+
+	/*
+	 * Some tracked PIDs are gone. Those missing from the last pass too
+	 * are dropped; any others may have an exit still waiting to be read.
+	 * The exit status of the dropped is lost, and reported as such.
+	 */
+	HASH_ITER (hh, cgmgr.pidcg, entry, tmp) {
+		pid_t pid = entry->pid;
+
+		if (entry->seen + 1 >= gen)
+			continue;
+
+		ev_untrack(pid);
+		detachpid(pid, CGRPFS_WSTAT_LOST, false);
+		reconcile_stats.stale++;
+	}
+}
+
+void
+proctab_suspect(pid_t pid)
+{
+	for (size_t i = 0; i < nsuspects; i++)
+		if (suspects[i] == pid)
+			return;
+
+	if (pid <= 0 || nsuspects == CGRPFS_RECONCILE_SUSPECTS)
+		sweepwanted = true;
+	else
+		suspects[nsuspects++] = pid;
+}
+
+/* Find the nearest tracked ancestor of a process, or NULL if it has none. */
+static pid_hash_entry_t *
+trackedancestor(pid_t pid)
+{
+	pid_hash_entry_t *entry;
+	procinfo_t proc;
+
+	while (pid > 0) {
+		if ((entry = findpid(pid)) != NULL)
+			return entry;
+		else if (!readproc(pid, &proc))
+			return NULL;
+		pid = proc.ppid;
+	}
+
+	return NULL;
+}
+
+/*
+ * Adopt the untracked descendants of a tracked process, a generation at a
+ * time, reading the children only of it and of those adopted. Returns false
+ * if it couldn't finish.
+ */
+static bool
+walk(pid_t root)
+{
+	pid_t *queue, *newqueue;
+	size_t head = 0, tail = 1, nalloc = 16;
+	pid_hash_entry_t *parent;
+	procinfo_t *kid;
+	ssize_t n;
+	bool ok = true;
+
+	if ((queue = malloc(nalloc * sizeof *queue)) == NULL)
+		return false;
+	queue[0] = root;
+
+	while (ok && head < tail) {
+		if ((parent = findpid(queue[head++])) == NULL)
+			continue; /* exited meanwhile */
+		else if ((n = untrackedchildren(parent->pid, &kid)) < 0)
+			ok = false;
+
+		for (ssize_t i = 0; ok && i < n; i++) {
+			if (!adopt(&kid[i], parent))
+				continue;
+
+			if (tail == nalloc) {
+				newqueue = realloc(queue,
+					nalloc * 2 * sizeof *queue);
+				if (!newqueue) {
+					ok = false;
+					break;
+				}
+				queue = newqueue;
+				nalloc *= 2;
+			}
+			queue[tail++] = kid[i].pid;
+		}
+	}
+
+	free(queue);
+	return ok;
+}
+
+bool
+proctab_reconcile(bool full)
+{
+	pid_hash_entry_t *entry;
+	pid_t roots[CGRPFS_RECONCILE_SUSPECTS];
+	size_t nroots = 0, j;
+
+	if (full || sweepwanted) {
+		nsuspects = 0;
+		sweepwanted = false;
+		sweep();
+		return true;
+	} else if (nsuspects == 0)
+		return false;
+
+	ntab = -1;
+	reconcile_stats.walks++;
+
+	/* walk each suspect's nearest tracked ancestor, but once only */
+	for (size_t i = 0; i < nsuspects; i++) {
+		if ((entry = trackedancestor(suspects[i])) == NULL)
+			continue;
+		for (j = 0; j < nroots && roots[j] != (pid_t)entry->pid; j++)
+			;
+		if (j == nroots)
+			roots[nroots++] = entry->pid;
+	}
+	nsuspects = 0;
+
+	for (size_t i = 0; i < nroots; i++)
+		if (!walk(roots[i])) {
+			warn("Failed to walk PID %lld; sweeping next time",
+				(long long)roots[i]);
+			sweepwanted = true;
+			break;
+		}
+
+	return false;
+}
+
+/* Read an adoption map, creating the CGroups it names. */
+static mapentry_t *
+readmap(const char *path)
+{
+	mapentry_t *map = NULL, *m;
+	char *line = NULL;
+	size_t linesize = 0;
+	unsigned lineno = 0;
+	ssize_t len;
+	FILE *f;
+
+	if ((f = fopen(path, "re")) == NULL) {
+		warn("Failed to open adoption map %s", path);
+		return NULL;
+	}
+
+	while ((len = getline(&line, &linesize, f)) >= 0) {
+		cg_node_t *node;
+		const char *rest;
+		char *cgpath, *end;
+		pid_t pid;
+		int r;
+
+		lineno++;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		pid = strtol(line, &end, 10);
+		cgpath = end + strspn(end, " \t");
+		if (end == line || cgpath == end || pid <= 0 || *cgpath != '/') {
+			warnx("%s:%u: Expected a PID and a CGroup path", path,
+				lineno);
+			continue;
+		}
+
+		node = lookupprefix(cgpath, &rest);
+		if (*rest != '\0') {
+			if ((r = mkcgdirs(node, rest, 0755, 0, 0, &node)) < 0) {
+				errno = -r;
+				warn("%s:%u: Failed to create CGroup %s", path,
+					lineno, cgpath);
+				continue;
+			} else if (cgmgr.tracing)
+				trace_op(CGRPFS_TR_MKDIR, cgpath, 0755, NULL, 0);
+		} else if (node->type != CGN_CG_DIR) {
+			warnx("%s:%u: %s is not a CGroup", path, lineno, cgpath);
+			continue;
+		}
+
+		HASH_FIND_INT(map, &pid, m);
+		if (!m) {
+			if ((m = malloc(sizeof *m)) == NULL) {
+				warn("Failed to allocate adoption map entry");
+				break;
+			}
+			m->pid = pid;
+			HASH_ADD_INT(map, pid, m);
+		}
+		m->node = node;
+	}
+
+	free(line);
+	fclose(f);
+	return map;
+}
+
+/* Record adoptions in the trace, as the writes to cgroup.procs they resemble. */
+static void
+traceadopted(const pid_t *pids, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		pid_hash_entry_t *entry;
+		char *cgpath, *procspath, pidtxt[32];
+		int len;
+
+		if ((entry = findpid(pids[i])) == NULL)
+			continue;
+		else if ((cgpath = nodefullpath(entry->node)) == NULL)
+			continue;
+
+		len = snprintf(pidtxt, sizeof pidtxt, "%lld",
+			(long long)pids[i]);
+		if (asprintf(&procspath, "%s/cgroup.procs",
+			    entry->node == cgmgr.rootnode ? "" : cgpath) >= 0) {
+			trace_op(CGRPFS_TR_WRITE, procspath, 0, pidtxt, len);
+			free(procspath);
+		}
+		free(cgpath);
+	}
+}
+
+/* Place a running process in a CGroup, marking it seen by adoption gen. */
+static void
+place(cg_node_t *node, pid_t pid, unsigned gen)
+{
+	pid_hash_entry_t *entry = placepid(node, pid);
+
+	if (entry)
+		entry->seen = gen;
+}
+
+void
+proctab_adopt(const char *mappath)
+{
+	mapentry_t *map = NULL, *m, *tmp;
+	pid_hash_entry_t *entry, *etmp;
+	procinfo_t *tab;
+	pid_t *pids = NULL;
+	struct timespec now;
+	uint64_t since;
+	size_t nadopt = 0, npending = 0;
+	unsigned gen;
+	bool placed;
+	ssize_t n;
+
+	if (mappath && *mappath != '\0')
+		map = readmap(mappath);
+
+	/* a fork missed from now on is the reconciler's to adopt */
+	clock_gettime(CLOCK_REALTIME, &now);
+	since = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	if ((n = proctab_read(&tab)) < 0) {
+		warn("Failed to read process table");
+		goto out;
+	}
+
+	if ((pids = malloc(n * sizeof *pids)) == NULL) {
+		warn("Failed to allocate processes to adopt");
+		goto out;
+	}
+
+	gen = ++cgmgr.reconcilegen;
+
+	/*
+	 * A process goes where the map says, or stays where it was recovered
+	 * to be; failing that, it follows its parent, having presumably been
+	 * forked while the daemon was down. Those whose parent is yet to be
+	 * placed are kept at the front of the table.
+	 */
+	for (ssize_t i = 0; i < n; i++) {
+		if (tab[i].pid <= 0)
+			continue;
+
+		pids[nadopt++] = tab[i].pid;
+
+		HASH_FIND_INT(map, &tab[i].pid, m);
+		if (m)
+			place(m->node, tab[i].pid, gen);
+		else if ((entry = findpid(tab[i].pid)) != NULL)
+			entry->seen = gen;
+		else if ((entry = findpid(tab[i].ppid)) != NULL)
+			place(entry->node, tab[i].pid, gen);
+		else
+			tab[npending++] = tab[i];
+	}
+
+	do {
+		size_t kept = 0;
+
+		placed = false;
+		for (size_t i = 0; i < npending; i++) {
+			if ((entry = findpid(tab[i].ppid)) != NULL) {
+				place(entry->node, tab[i].pid, gen);
+				placed = true;
+			} else
+				tab[kept++] = tab[i];
+		}
+		npending = kept;
+	} while (placed && npending > 0);
+
+	for (size_t i = 0; i < npending; i++)
+		place(cgmgr.rootnode, tab[i].pid, gen);
+
+	/* recovered PIDs which have exited since */
+	HASH_ITER (hh, cgmgr.pidcg, entry, etmp)
+		if (entry->seen != gen)
+			forgetpid(entry->pid);
+
+	trackpids(pids, nadopt, since);
+
+	if (cgmgr.tracing)
+		traceadopted(pids, nadopt);
+
+out:
+	free(pids);
+	HASH_ITER (hh, map, m, tmp) {
+		HASH_DEL(map, m);
+		free(m);
+	}
+}
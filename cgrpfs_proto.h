@@ -0,0 +1,252 @@
+/*
+ * Wire protocol of the CGrpFS notification socket.
+ *
+ * A peer which connects to the notification socket and sends nothing receives
+ * a bare siginfo_t for each exit of a tracked process. A peer may instead send
+ * a cgrpfs_subscribe message; it then receives a cgrpfs_hello record, followed
+ * by any replayed events it asked for, followed by live cgrpfs_event records.
+ *
+ * Every exit is stamped with a sequence number which increases by one for each
+ * exit. The daemon retains the last CGRPFS_HISTORY_MAX exits, so a client that
+ * reconnects can ask for everything after the last sequence number it saw. If
+ * any of those events are no longer retained, or the daemon has restarted
+ * since (as indicated by a changed epoch), a CGRPFS_EV_GAP record is sent
+ * instead and the client must resynchronise by reading cgroup.procs files.
+ *
+ * The daemon never waits for a client to make room for a record. A client
+ * whose socket buffer fills, whether with live events or with a replay, is
+ * sent a CGRPFS_EV_GAP record and disconnected; it may reconnect and resume
+ * after the last sequence number it received.
+ *
+ * Exit events carry the ID of the cgroup the process belonged to at the time
+ * it exited, and optionally that cgroup's path, so the receiver need not map
+ * the PID back to its cgroup (which would race against PID reuse).
+ *
+ * A client subscribing with CGRPFS_SUB_ATTACH additionally receives an event
+ * whenever a process joins a cgroup, whether by being forked from a tracked
+ * process or by being written into a cgroup.procs file. These are not
+ * sequenced nor retained for replay; after a gap, membership should be
+ * re-read from cgroup.procs as usual.
+ *
+ * Likewise, a client subscribing with CGRPFS_SUB_CGEVENTS receives an event,
+ * unsequenced, whenever the state shown in a cgroup's cgroup.events file
+ * changes, so that it needn't poll the file.
+ */
+
+#ifndef CGRPFS_PROTO_H_
+#define CGRPFS_PROTO_H_
+
+#include <stdint.h>
+
+#define CGRPFS_NOTIFY_PATH "/var/run/cgrpfs.notify"
+#define CGRPFS_CONTROL_PATH "/var/run/cgrpfs.control"
+
+#define CGRPFS_PROTO_VERSION 1
+
+/* how many past events are retained for replay */
+#define CGRPFS_HISTORY_MAX 4096
+
+/*
+ * subscription flags. With CGRPFS_SUB_PATH, an event replayed on resuming
+ * carries the path its cgroup had when it happened if any listener wanted paths
+ * then, or else the path the cgroup has now, or none if it has been removed.
+ */
+#define CGRPFS_SUB_RESUME 0x1 /* replay events after `after' */
+#define CGRPFS_SUB_PATH 0x2 /* append the cgroup path to events */
+#define CGRPFS_SUB_ATTACH 0x4 /* also send fork and migration events */
+#define CGRPFS_SUB_CGEVENTS 0x8 /* also send cgroup.events changes */
+
+/*
+ * event flags. CGRPFS_EVF_LOST marks the exit of a process which the daemon
+ * found gone without seeing it exit, e.g. on reconciling with the process
+ * table; its code and status are 0, as they are unknown. Peers receiving bare
+ * siginfo_t records are not told of such exits.
+ */
+#define CGRPFS_EVF_PATH 0x1 /* a NUL-terminated cgroup path follows */
+#define CGRPFS_EVF_LOST 0x2 /* an exit whose status is unknown */
+
+/* sent by the client to switch to the sequenced protocol */
+struct cgrpfs_subscribe {
+	uint32_t version; /* CGRPFS_PROTO_VERSION */
+	uint32_t flags; /* CGRPFS_SUB_* */
+	uint64_t epoch; /* epoch from an earlier hello, if resuming */
+	uint64_t after; /* last sequence number seen, if resuming */
+};
+
+/* kind of record */
+enum cgrpfs_evtype {
+	CGRPFS_EV_HELLO = 1, /* cgrpfs_hello */
+	CGRPFS_EV_GAP, /* requested events were lost; resync required */
+	CGRPFS_EV_EXIT, /* a tracked process exited */
+	CGRPFS_EV_FORK, /* a tracked process forked a child into its cgroup */
+	CGRPFS_EV_MIGRATE, /* a process was written into a cgroup.procs file */
+	CGRPFS_EV_CGEVENTS, /* a cgroup's cgroup.events changed */
+};
+
+/* state bits carried in `status' of a CGRPFS_EV_CGEVENTS event */
+#define CGRPFS_CGEV_POPULATED 0x1 /* it or a descendant contains a process */
+#define CGRPFS_CGEV_FROZEN 0x2 /* it or an ancestor is frozen */
+
+/* sent in reply to a subscription */
+struct cgrpfs_hello {
+	uint16_t type; /* CGRPFS_EV_HELLO */
+	uint16_t len; /* length of the whole record */
+	uint32_t version; /* CGRPFS_PROTO_VERSION */
+	uint64_t epoch; /* identifies this run of the daemon */
+	uint64_t seq; /* last sequence number assigned */
+};
+
+/* an event */
+struct cgrpfs_event {
+	uint16_t type; /* CGRPFS_EV_* */
+	uint16_t len; /* length of the whole record */
+	uint32_t flags;
+	/*
+	 * For an exit, its sequence number. For a gap, the first sequence
+	 * number still retained. For a fork or migration, the sequence number
+	 * of the latest exit preceding it.
+	 */
+	uint64_t seq;
+	int32_t pid;
+	int32_t code; /* CLD_EXITED or CLD_KILLED, or 0 if CGRPFS_EVF_LOST */
+	/* exit status or terminating signal, or CGRPFS_CGEV_* state bits */
+	int32_t status;
+	int32_t ppid; /* for a fork, the parent PID; otherwise 0 */
+	/*
+	 * ID of the cgroup the process belonged to when it exited, or which it
+	 * joined. IDs are never reused within a run of the daemon. The root
+	 * cgroup's ID is 1.
+	 */
+	uint64_t cgid;
+	/* if CGRPFS_EVF_PATH set, the cgroup's path follows, e.g. "/a/b" */
+};
+
+/*
+ * The control socket answers requests, each a single message beginning with a
+ * cgrpfs_ctl_req, with a single message beginning with a cgrpfs_ctl_reply.
+ *
+ * CGRPFS_OP_QUERY: the request carries `count' int32_t PIDs. The reply carries
+ * `count' cgrpfs_pidinfo entries, in the same order, followed by the
+ * NUL-terminated paths they refer to. PIDs which are alive but untracked are
+ * reported as belonging to the root cgroup, as on Linux.
+ *
+ * CGRPFS_OP_BATCH: the request carries `count' cgrpfs_batch_op records, which
+ * are applied in order, all under one acquisition of the daemon's lock so that
+ * no other operation is interleaved with them. The reply carries `count'
+ * int32_t results, each 0 or an errno value. With CGRPFS_BATCH_STOP set, the
+ * batch stops at the first failure, and the operations not attempted report
+ * ECANCELED. The operations already applied are then undone: cgroups created
+ * are removed and modes and owners changed are restored. Attaching a PID is
+ * the one operation that can't be undone, so it stays attached, and a cgroup
+ * the batch created stays if a PID was attached within it.
+ *
+ * Batch operations are permitted as they would be through the filesystem:
+ * creating a cgroup requires write permission on the nearest existing
+ * ancestor, changing mode requires ownership, changing owner requires root,
+ * and attaching a PID requires write permission on the cgroup's cgroup.procs.
+ * Only the caller's primary group is considered.
+ *
+ * CGRPFS_OP_MOUNT: the request carries one cgrpfs_mount record. An instance is
+ * mounted at the mountpoint it names, serving the cgroup at its path, which is
+ * created if need be, as a hierarchy of its own. Through the instance, nothing
+ * outside that cgroup can be seen, nor can a PID be moved into it from
+ * outside. If a notify socket path is given, a notify socket is created there
+ * whose peers receive only events within the cgroup, with paths relative to
+ * it. The reply carries the uint64_t ID of the cgroup.
+ *
+ * CGRPFS_OP_UNMOUNT: the request carries the NUL-terminated mountpoint of an
+ * instance, which is unmounted; its notify socket peers are disconnected.
+ *
+ * Only root may mount or unmount instances.
+ *
+ * Replies may be large, so clients should raise SO_RCVBUF to around
+ * CGRPFS_CTL_BUFSIZE. A reply that is too large to send is replaced with one
+ * carrying E2BIG. The daemon never waits for a client to make room for a
+ * reply: a client whose socket buffer is full of unread replies is
+ * disconnected.
+ */
+
+/* largest request accepted */
+#define CGRPFS_CTL_MSGMAX 65536
+/* socket buffer size the daemon uses for replies */
+#define CGRPFS_CTL_BUFSIZE (1024 * 1024)
+
+/* most PIDs that may be queried in one request */
+#define CGRPFS_QUERY_MAX 1024
+
+/* most operations in one batch */
+#define CGRPFS_BATCH_MAX 1024
+
+enum cgrpfs_ctlop {
+	CGRPFS_OP_QUERY = 1, /* which cgroup are these PIDs in? */
+	CGRPFS_OP_BATCH, /* apply a batch of operations */
+	CGRPFS_OP_MOUNT, /* mount an instance */
+	CGRPFS_OP_UNMOUNT, /* unmount an instance */
+};
+
+/* request flags */
+#define CGRPFS_BATCH_STOP 0x1 /* stop a batch at the first failure */
+
+struct cgrpfs_ctl_req {
+	uint32_t op; /* CGRPFS_OP_* */
+	uint32_t count; /* how many items follow */
+	uint64_t cookie; /* echoed in the reply */
+	uint32_t flags; /* CGRPFS_BATCH_* */
+	uint32_t reserved;
+};
+
+struct cgrpfs_ctl_reply {
+	uint32_t op; /* as in the request */
+	uint32_t count; /* how many items follow */
+	uint64_t cookie; /* as in the request */
+	int32_t error; /* 0, or an errno value if the whole request failed */
+	uint32_t reserved;
+};
+
+struct cgrpfs_pidinfo {
+	int32_t pid;
+	int32_t error; /* 0, or e.g. ESRCH if no such process */
+	uint64_t cgid; /* ID of the cgroup it belongs to */
+	uint32_t pathoff; /* offset of the cgroup path from start of message */
+	uint32_t pathlen; /* length of the path, excluding the NUL */
+};
+
+enum cgrpfs_batch_optype {
+	CGRPFS_BOP_MKDIR = 1, /* create cgroup and any missing ancestors */
+	CGRPFS_BOP_CHOWN, /* set owner of cgroup */
+	CGRPFS_BOP_CHMOD, /* set mode of cgroup */
+	CGRPFS_BOP_ATTACH, /* move PID into cgroup */
+};
+
+/* an operation of a batch */
+struct cgrpfs_batch_op {
+	uint16_t type; /* CGRPFS_BOP_* */
+	/* length of whole record, including path, padded to a multiple of 8 */
+	uint16_t len;
+	int32_t pid; /* for ATTACH */
+	uint32_t mode; /* for MKDIR and CHMOD; permission bits only */
+	/*
+	 * For MKDIR and CHOWN; (uint32_t)-1 means the caller's own for MKDIR,
+	 * or unchanged for CHOWN.
+	 */
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t reserved;
+	/* NUL-terminated path of the cgroup, e.g. "/a/b", follows */
+};
+
+/* an instance to mount */
+struct cgrpfs_mount {
+	/*
+	 * Owner to give the cgroup and its cgroup.procs, as on delegation;
+	 * (uint32_t)-1 leaves them be.
+	 */
+	uint32_t uid;
+	uint32_t gid;
+	/*
+	 * NUL-terminated cgroup path, mountpoint and notify socket path (which
+	 * may be empty for none) follow.
+	 */
+};
+
+#endif /* CGRPFS_PROTO_H_ */
@@ -0,0 +1,231 @@
+/*
+ * Release agent execution.
+ *
+ * When a CGroup with notify_on_release set empties, its path is queued here
+ * and the release agent is run with it as its argument by a dedicated spawner
+ * thread, so the event loop never waits on fork or exec. A path already in the
+ * queue is not queued again, at most RELEASE_MAXRUNNING agents run at once,
+ * and failures are counted and logged rather than retried.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+/* most agents to run at once */
+#define RELEASE_MAXRUNNING 16
+/* most paths to hold in the queue; beyond this they are dropped */
+#define RELEASE_MAXQUEUED 65536
+
+/* a queued release */
+typedef struct release_req {
+	TAILQ_ENTRY(release_req) entries;
+	UT_hash_handle hh; /* in the set of queued paths */
+
+	char *path;
+} release_req_t;
+
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, release_req) rqueue = TAILQ_HEAD_INITIALIZER(rqueue);
+static release_req_t *rqueued; /* set of queued paths, for coalescing */
+static unsigned nqueued;
+static char *ragent; /* the release agent, or NULL if none */
+static pid_t running[RELEASE_MAXRUNNING];
+static unsigned nrunning;
+
+release_stats_t release_stats;
+
+/* Start the agent for one path. Called without rlock held. */
+static void
+spawnagent(const char *agent, const char *path)
+{
+	static char *const envp[] = { "PATH=/sbin:/bin:/usr/sbin:/usr/bin",
+		NULL };
+	char *const argv[] = { (char *)agent, (char *)path, NULL };
+	posix_spawn_file_actions_t fa;
+	pid_t pid;
+	int r;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+		O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+		O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+		O_WRONLY, 0);
+
+	r = posix_spawn(&pid, agent, &fa, NULL, argv, envp);
+	posix_spawn_file_actions_destroy(&fa);
+
+	pthread_mutex_lock(&rlock);
+	if (r != 0) {
+		release_stats.failed++;
+		pthread_mutex_unlock(&rlock);
+		warnx("Failed to spawn release agent %s for %s: %s", agent,
+			path, strerror(r));
+		return;
+	}
+	release_stats.spawned++;
+	running[nrunning++] = pid;
+	pthread_mutex_unlock(&rlock);
+}
+
+/* Reap any agents that have finished. Called with rlock held. */
+static void
+reapagents(void)
+{
+	for (unsigned i = 0; i < nrunning;) {
+		int wstat;
+		pid_t r = waitpid(running[i], &wstat, WNOHANG);
+
+		if (r == 0) {
+			i++;
+			continue;
+		}
+
+		if (r < 0 || !WIFEXITED(wstat) || WEXITSTATUS(wstat) != 0)
+			release_stats.failed++;
+
+		running[i] = running[--nrunning];
+	}
+}
+
+static void *
+spawner_thread(void *unused)
+{
+	(void)unused;
+
+	pthread_mutex_lock(&rlock);
+	for (;;) {
+		release_req_t *req;
+		char *agent;
+
+		reapagents();
+
+		req = TAILQ_FIRST(&rqueue);
+		if (!req || nrunning == RELEASE_MAXRUNNING) {
+			struct timespec ts;
+
+			if (nrunning == 0) {
+				pthread_cond_wait(&rcond, &rlock);
+				continue;
+			}
+
+			/* agents are running; wake up to reap them */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 50000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&rcond, &rlock, &ts);
+			continue;
+		}
+
+		TAILQ_REMOVE(&rqueue, req, entries);
+		HASH_DEL(rqueued, req);
+		nqueued--;
+
+		agent = ragent ? strdup(ragent) : NULL;
+		pthread_mutex_unlock(&rlock);
+
+		if (agent)
+			spawnagent(agent, req->path);
+		free(agent);
+		free(req->path);
+		free(req);
+
+		pthread_mutex_lock(&rlock);
+	}
+
+	return NULL;
+}
+
+void
+release_init(void)
+{
+	pthread_t thrd;
+	int r;
+
+	r = pthread_create(&thrd, NULL, spawner_thread, NULL);
+	if (r != 0)
+		errx(EXIT_FAILURE, "pthread_create failed: %s", strerror(r));
+}
+
+int
+release_setagent(const char *agent)
+{
+	char *copy = NULL;
+
+	if (*agent != '\0' && (copy = strdup(agent)) == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&rlock);
+	free(ragent);
+	ragent = copy;
+	pthread_mutex_unlock(&rlock);
+
+	return 0;
+}
+
+void
+release_enqueue(cg_node_t *node)
+{
+	release_req_t *req;
+	char *path;
+	bool haveagent;
+
+	if (!node->notify)
+		return;
+
+	/*
+	 * The agent is only set with the tree locked, as it is here, so it
+	 * can't be unset before the path is queued.
+	 */
+	pthread_mutex_lock(&rlock);
+	haveagent = ragent != NULL;
+	pthread_mutex_unlock(&rlock);
+	if (!haveagent)
+		return;
+
+	if ((path = nodefullpath(node)) == NULL) {
+		warnx("Out of memory queueing release of CGroup");
+		return;
+	}
+
+	pthread_mutex_lock(&rlock);
+
+	HASH_FIND_STR(rqueued, path, req);
+	if (req) {
+		release_stats.coalesced++;
+		goto out;
+	} else if (nqueued == RELEASE_MAXQUEUED ||
+		(req = malloc(sizeof *req)) == NULL) {
+		release_stats.dropped++;
+		goto out;
+	}
+
+	req->path = path;
+	path = NULL;
+	TAILQ_INSERT_TAIL(&rqueue, req, entries);
+	HASH_ADD_KEYPTR(hh, rqueued, req->path, strlen(req->path), req);
+	nqueued++;
+	pthread_cond_signal(&rcond);
+
+out:
+	pthread_mutex_unlock(&rlock);
+	free(path);
+}
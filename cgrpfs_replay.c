@@ -0,0 +1,202 @@
+/*
+ * cgrpfs-replay: drive the CGroup tree and PID map from a recorded trace.
+ *
+ * The events and filesystem operations of a trace recorded with CGRPFS_TRACE
+ * are applied to the same core code the daemon runs, but with no event
+ * backend, FUSE or PUFFS, and without signalling any of the PIDs named in the
+ * trace. Replaying at full speed measures the cost of the core alone, so
+ * builds can be compared on identical workloads; with -r, the trace's timing
+ * is kept.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+cgmgr_t cgmgr;
+
+/* replays mount no instances */
+int
+fs_mount(cg_inst_t *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: cgrpfs-replay [-r] trace\n");
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Apply a filesystem operation as the FUSE operations would. */
+static void
+replayop(const struct cgrpfs_trace_rec *rec, const char *path,
+	const char *data, size_t datalen)
+{
+	cg_node_t *node, *newdir;
+	const char *rest;
+	char *txt;
+
+	switch (rec->type) {
+	case CGRPFS_TR_MKDIR:
+		node = lookupprefix(path, &rest);
+		if (*rest != '\0')
+			mkcgdirs(node, rest, rec->arg, 0, 0, &newdir);
+		break;
+
+	case CGRPFS_TR_RMDIR:
+		node = lookupnode(path, false);
+		if (node && node->type == CGN_CG_DIR && node != cgmgr.rootnode)
+			removenode(node);
+		break;
+
+	case CGRPFS_TR_RENAME:
+		node = lookupnode(path, false);
+		newdir = lookupnode(data, true);
+		if (node && newdir && node->parent == newdir &&
+			node->type == CGN_CG_DIR) {
+			free(node->name);
+			node->name = strdup(strrchr(data, '/') + 1);
+		}
+		break;
+
+	case CGRPFS_TR_WRITE:
+		if ((node = lookupnode(path, false)) != NULL)
+			nodewrite(node, data, datalen, NULL);
+		break;
+
+	case CGRPFS_TR_READ:
+		node = lookupnode(path, false);
+		if (node && !S_ISDIR(node->attr.st_mode)) {
+			txt = nodetxt(node);
+			free(txt);
+		}
+		break;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char buf[UINT16_MAX + 1];
+	struct cgrpfs_trace_hdr hdr;
+	struct cgrpfs_trace_rec *rec = (struct cgrpfs_trace_rec *)buf;
+	bool realtime = false;
+	unsigned long nevents = 0, nops = 0;
+	uint64_t start, elapsed;
+	FILE *f;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r")) != -1) {
+		switch (ch) {
+		case 'r':
+			realtime = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	if ((f = fopen(argv[0], "r")) == NULL)
+		err(EXIT_FAILURE, "%s", argv[0]);
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+		hdr.magic != CGRPFS_TRACE_MAGIC ||
+		hdr.version != CGRPFS_TRACE_VERSION)
+		errx(EXIT_FAILURE, "%s is not a CGrpFS trace", argv[0]);
+
+	cgmgr.replaying = true;
+	cgmgr_initstate();
+
+	start = nowns();
+
+	while (fread(rec, sizeof *rec, 1, f) == 1) {
+		size_t datalen;
+		cg_event_t ev = { 0 };
+
+		if (rec->len < sizeof *rec)
+			errx(EXIT_FAILURE, "Malformed trace record");
+		datalen = rec->len - sizeof *rec;
+		if (datalen && fread(rec + 1, datalen, 1, f) != 1)
+			errx(EXIT_FAILURE, "Truncated trace");
+
+		if (realtime) {
+			uint64_t now = nowns() - start;
+
+			if (rec->ts > now) {
+				struct timespec ts = { (rec->ts - now) / 1000000000,
+					(rec->ts - now) % 1000000000 };
+
+				while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+					;
+			}
+		}
+
+		switch (rec->type) {
+		case CGRPFS_TR_FORK:
+		case CGRPFS_TR_EXIT:
+		case CGRPFS_TR_TIMER:
+		case CGRPFS_TR_TRACKERR:
+			ev.kind = rec->type == CGRPFS_TR_FORK ? CGE_FORK :
+				rec->type == CGRPFS_TR_EXIT	 ? CGE_EXIT :
+				rec->type == CGRPFS_TR_TIMER	 ? CGE_TIMER :
+								   CGE_TRACKERR;
+			ev.ident = rec->pid;
+			ev.data = rec->arg;
+			cgmgr_event(&ev);
+			nevents++;
+			break;
+
+		default: {
+			const char *path = buf + sizeof *rec;
+			size_t pathlen = strnlen(path, datalen);
+
+			if (pathlen == datalen)
+				errx(EXIT_FAILURE, "Malformed trace record");
+
+			replayop(rec, path, path + pathlen + 1,
+				rec->type == CGRPFS_TR_WRITE ? rec->arg : 0);
+			nops++;
+		}
+		}
+	}
+
+	elapsed = nowns() - start;
+	fclose(f);
+
+	printf("%lu events, %lu operations in %.3f s (%.0f/s)\n", nevents, nops,
+		elapsed / 1e9,
+		elapsed ? (nevents + nops) / (elapsed / 1e9) : 0.0);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Emergency memory reserve.
+ *
+ * PID entries and exit event paths are preallocated at startup and handed
+ * out only when malloc fails, so that forks and exits can still be recorded
+ * for a while under OOM conditions. The PID entry reserve is topped up again
+ * from malloc and from freed entries as memory returns. While it is low,
+ * creation of new CGroups is refused, so that the remainder goes to tracking
+ * processes.
+ */
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgrpfs.h"
+
+/* PID entries held in reserve */
+#define RESERVE_PIDS 4096
+/* below this many, new CGroups are refused */
+#define RESERVE_PIDS_LOW 1024
+/* path buffers held in reserve for exit events */
+#define RESERVE_PATHS 256
+/* size of each; longer paths are sent without the path */
+#define RESERVE_PATHLEN 256
+
+static pid_hash_entry_t *pidpool[RESERVE_PIDS];
+static char pathpool[RESERVE_PATHS][RESERVE_PATHLEN];
+static char *freepaths[RESERVE_PATHS];
+static unsigned nfreepaths;
+
+reserve_stats_t reserve_stats;
+
+void
+reserve_init(void)
+{
+	for (int i = 0; i < RESERVE_PIDS; i++) {
+		if ((pidpool[i] = malloc(sizeof *pidpool[i])) == NULL)
+			break;
+		reserve_stats.pids++;
+	}
+
+	for (int i = 0; i < RESERVE_PATHS; i++)
+		freepaths[nfreepaths++] = pathpool[i];
+	reserve_stats.paths = nfreepaths;
+}
+
+bool
+reserve_low(void)
+{
+	return reserve_stats.pids < RESERVE_PIDS_LOW;
+}
+
+pid_hash_entry_t *
+reserve_pidentry(void)
+{
+	pid_hash_entry_t *entry = malloc(sizeof *entry);
+
+	if (entry) {
+		/* memory is available again; top up the reserve */
+		if (reserve_stats.pids < RESERVE_PIDS) {
+			pid_hash_entry_t *spare = malloc(sizeof *spare);
+
+			if (spare)
+				pidpool[reserve_stats.pids++] = spare;
+		}
+		return entry;
+	}
+
+	if (reserve_stats.pids == 0)
+		return NULL;
+
+	reserve_stats.pidstaken++;
+	return pidpool[--reserve_stats.pids];
+}
+
+void
+reserve_freepidentry(pid_hash_entry_t *entry)
+{
+	if (reserve_stats.pids < RESERVE_PIDS)
+		pidpool[reserve_stats.pids++] = entry;
+	else
+		free(entry);
+}
+
+/* Write node's path into buf, returning its length even if it didn't fit. */
+static size_t
+pathinto(cg_node_t *node, char *buf, size_t len)
+{
+	size_t off, namelen;
+
+	if (!node->parent)
+		return 0;
+
+	off = pathinto(node->parent, buf, len);
+	namelen = strlen(node->name);
+	if (off + 1 + namelen < len) {
+		buf[off] = '/';
+		memcpy(buf + off + 1, node->name, namelen);
+	}
+
+	return off + 1 + namelen;
+}
+
+char *
+reserve_path(cg_node_t *node)
+{
+	char *path = nodefullpath(node);
+	size_t len;
+
+	if (path || nfreepaths == 0)
+		return path;
+
+	path = freepaths[--nfreepaths];
+	reserve_stats.paths = nfreepaths;
+
+	len = pathinto(node, path, RESERVE_PATHLEN);
+	if (len >= RESERVE_PATHLEN) {
+		freepaths[nfreepaths++] = path;
+		reserve_stats.paths = nfreepaths;
+		return NULL;
+	} else if (len == 0)
+		path[len++] = '/'; /* root node */
+	path[len] = '\0';
+
+	reserve_stats.pathstaken++;
+	return path;
+}
+
+void
+reserve_freepath(char *path)
+{
+	if (path >= pathpool[0] && path < pathpool[RESERVE_PATHS]) {
+		freepaths[nfreepaths++] = path;
+		reserve_stats.paths = nfreepaths;
+	} else
+		free(path);
+}
@@ -0,0 +1,190 @@
+/*
+ * Publication of the PID => CGroup map in shared memory; see cgrpfs_shm.h.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+#include "cgrpfs_shm.h"
+
+/* number of cgroup entries in the table */
+#define SHM_NCGSLOTS 4096
+
+static struct cgrpfs_shm_hdr *shmhdr;
+static uint64_t *shmpids;
+static struct cgrpfs_shm_cg *shmcgs;
+
+/* Get the number of PID slots needed to cover all PIDs. */
+static uint32_t
+getpidmax(void)
+{
+#if defined(__FreeBSD__)
+	int pidmax;
+	size_t len = sizeof pidmax;
+
+	if (sysctlbyname("kern.pid_max", &pidmax, &len, NULL, 0) == 0)
+		return pidmax + 1;
+#elif defined(__linux__)
+	FILE *f = fopen("/proc/sys/kernel/pid_max", "r");
+	unsigned pidmax;
+
+	if (f) {
+		int r = fscanf(f, "%u", &pidmax);
+
+		fclose(f);
+		if (r == 1)
+			return pidmax + 1;
+	}
+#endif
+	/* covers PID_MAX of the other BSDs */
+	return 100000;
+}
+
+void
+shm_init(void)
+{
+	pid_hash_entry_t *entry, *tmp;
+	size_t size;
+	uint32_t pidmax = getpidmax();
+	void *map;
+	int fd;
+
+	size = sizeof *shmhdr + pidmax * sizeof *shmpids +
+		SHM_NCGSLOTS * sizeof *shmcgs;
+
+	/* clients still mapping a previous run's table keep their copy */
+	unlink(CGRPFS_SHM_PATH);
+
+	fd = open(CGRPFS_SHM_PATH, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("Failed to create shared-memory table");
+		return;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		warn("Failed to size shared-memory table");
+		close(fd);
+		unlink(CGRPFS_SHM_PATH);
+		return;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("Failed to map shared-memory table");
+		unlink(CGRPFS_SHM_PATH);
+		return;
+	}
+
+	/* the file is freshly truncated, so the tables are zeroed */
+	shmhdr = map;
+	shmhdr->version = CGRPFS_SHM_VERSION;
+	shmhdr->epoch = cgmgr.epoch;
+	shmhdr->pidmax = pidmax;
+	shmhdr->ncgslots = SHM_NCGSLOTS;
+	shmhdr->pidoff = sizeof *shmhdr;
+	shmhdr->cgoff = shmhdr->pidoff + pidmax * sizeof *shmpids;
+
+	shmpids = (uint64_t *)((char *)map + shmhdr->pidoff);
+	shmcgs = (struct cgrpfs_shm_cg *)((char *)map + shmhdr->cgoff);
+
+	/* anything taken over from a predecessor */
+	shm_setcgtree(cgmgr.rootnode);
+	HASH_ITER (hh, cgmgr.pidcg, entry, tmp)
+		shm_setpid(entry->pid, entry->node);
+
+	/* readers check the magic, so set it last */
+	__atomic_store_n(&shmhdr->magic, CGRPFS_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+bool
+shm_slotfree(uint64_t id)
+{
+	return !shmhdr || shmcgs[id % SHM_NCGSLOTS].cgid == 0;
+}
+
+void
+shm_setpid(pid_t pid, cg_node_t *node)
+{
+	if (!shmhdr || pid <= 0 || pid >= shmhdr->pidmax)
+		return;
+
+	__atomic_store_n(&shmpids[pid], node ? node->id : 0, __ATOMIC_RELEASE);
+}
+
+/* Rewrite a CGroup entry under its seqlock. */
+static void
+writecg(struct cgrpfs_shm_cg *cg, uint64_t id, const char *path)
+{
+	size_t pathlen = path ? strlen(path) : 0;
+
+	__atomic_store_n(&cg->seq, cg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	cg->cgid = id;
+	if (path && pathlen < CGRPFS_SHM_PATHMAX) {
+		cg->pathlen = pathlen;
+		memcpy(cg->path, path, pathlen + 1);
+	} else
+		/* unknown or too long; readers must ask the control socket */
+		cg->pathlen = UINT32_MAX;
+
+	__atomic_store_n(&cg->seq, cg->seq + 1, __ATOMIC_RELEASE);
+}
+
+void
+shm_setcg(cg_node_t *node)
+{
+	struct cgrpfs_shm_cg *cg;
+	char *path;
+
+	if (!shmhdr)
+		return;
+
+	cg = &shmcgs[node->id % SHM_NCGSLOTS];
+	if (cg->cgid != 0 && cg->cgid != node->id)
+		return; /* table full; this one isn't published */
+
+	path = nodefullpath(node);
+	writecg(cg, node->id, path);
+	free(path);
+}
+
+void
+shm_setcgtree(cg_node_t *node)
+{
+	cg_node_t *subnode;
+
+	if (!shmhdr || node->type != CGN_CG_DIR)
+		return;
+
+	shm_setcg(node);
+	LIST_FOREACH (subnode, &node->subnodes, entries)
+		shm_setcgtree(subnode);
+}
+
+void
+shm_delcg(cg_node_t *node)
+{
+	struct cgrpfs_shm_cg *cg;
+
+	if (!shmhdr)
+		return;
+
+	cg = &shmcgs[node->id % SHM_NCGSLOTS];
+	if (cg->cgid == node->id)
+		writecg(cg, 0, NULL);
+}
@@ -0,0 +1,161 @@
+/*
+ * Shared-memory PID => CGroup table published by CGrpFS.
+ *
+ * The daemon maintains, in a file mapped read-only by clients, a table
+ * mapping each PID to the ID of its cgroup, and a table mapping cgroup IDs to
+ * their paths. Once the file is mapped, lookups need neither locks nor system
+ * calls.
+ *
+ * Each PID slot is a single 64-bit word updated atomically, so it is always
+ * read consistently. Cgroup entries are protected by a seqlock: the daemon
+ * makes the sequence count odd while it rewrites an entry and even again once
+ * done, and readers retry if the count was odd or changed while they copied
+ * the entry.
+ *
+ * A PID slot holding 0 means the PID is not tracked; like the rest of
+ * CGrpFS, treat a live untracked process as belonging to the root cgroup
+ * (ID 1). A cgroup whose path is not available here (its path was too long,
+ * or the table was full) can be looked up through the control socket instead.
+ *
+ * If the daemon restarts, or hands over to a successor, it replaces the file.
+ * A long-lived reader should occasionally compare the inode number of
+ * CGRPFS_SHM_PATH with that of its mapping, and remap if it has changed. The
+ * epoch is that of the notify protocol, which a handoff keeps.
+ */
+
+#ifndef CGRPFS_SHM_H_
+#define CGRPFS_SHM_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CGRPFS_SHM_PATH "/var/run/cgrpfs.shm"
+#define CGRPFS_SHM_MAGIC 0x43475348 /* "CGSH" */
+#define CGRPFS_SHM_VERSION 1
+
+/* longest path, including the NUL, that fits in a cgroup entry */
+#define CGRPFS_SHM_PATHMAX 256
+
+struct cgrpfs_shm_hdr {
+	uint32_t magic; /* CGRPFS_SHM_MAGIC */
+	uint32_t version; /* CGRPFS_SHM_VERSION */
+	uint64_t epoch; /* as in the notify protocol's hello */
+	uint32_t pidmax; /* number of PID slots */
+	uint32_t ncgslots; /* number of cgroup entries */
+	uint64_t pidoff; /* offset of PID table (uint64_t[pidmax]) */
+	uint64_t cgoff; /* offset of cgroup table */
+};
+
+/* a cgroup entry; the entry for ID n is at index n % ncgslots */
+struct cgrpfs_shm_cg {
+	uint32_t seq; /* seqlock count; odd while being written */
+	uint32_t pathlen; /* length of path, excluding the NUL */
+	uint64_t cgid; /* 0 if the entry is unused */
+	char path[CGRPFS_SHM_PATHMAX];
+};
+
+/* a client's mapping of the table */
+struct cgrpfs_shm {
+	const struct cgrpfs_shm_hdr *hdr;
+	size_t size;
+};
+
+/* Map the table. Returns 0 on success or -1 with errno set. */
+static inline int
+cgrpfs_shm_open(struct cgrpfs_shm *shm)
+{
+	struct stat sb;
+	void *map;
+	int fd;
+
+	if ((fd = open(CGRPFS_SHM_PATH, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (fstat(fd, &sb) < 0 ||
+		(size_t)sb.st_size < sizeof(struct cgrpfs_shm_hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	shm->hdr = map;
+	shm->size = sb.st_size;
+
+	if (shm->hdr->magic != CGRPFS_SHM_MAGIC ||
+		shm->hdr->version != CGRPFS_SHM_VERSION) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline void
+cgrpfs_shm_close(struct cgrpfs_shm *shm)
+{
+	munmap((void *)shm->hdr, shm->size);
+	shm->hdr = NULL;
+}
+
+/* Get the cgroup ID of a PID, or 0 if it is not tracked. */
+static inline uint64_t
+cgrpfs_shm_pidcg(const struct cgrpfs_shm *shm, pid_t pid)
+{
+	const uint64_t *pids;
+
+	if (pid <= 0 || (uint32_t)pid >= shm->hdr->pidmax)
+		return 0;
+
+	pids = (const uint64_t *)((const char *)shm->hdr + shm->hdr->pidoff);
+	return __atomic_load_n(&pids[pid], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copy the path of a cgroup into buf. Returns the path length, or -1 if the
+ * path isn't available here or doesn't fit in len bytes.
+ */
+static inline ssize_t
+cgrpfs_shm_cgpath(const struct cgrpfs_shm *shm, uint64_t cgid, char *buf,
+	size_t len)
+{
+	const struct cgrpfs_shm_cg *cg;
+	uint32_t seq, pathlen;
+	uint64_t id;
+
+	if (cgid == 0)
+		return -1;
+
+	cg = (const struct cgrpfs_shm_cg *)((const char *)shm->hdr +
+		     shm->hdr->cgoff) +
+		cgid % shm->hdr->ncgslots;
+
+	do {
+		seq = __atomic_load_n(&cg->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		id = cg->cgid;
+		pathlen = cg->pathlen;
+		if (id == cgid && pathlen < CGRPFS_SHM_PATHMAX && pathlen < len)
+			memcpy(buf, cg->path, pathlen + 1);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&cg->seq, __ATOMIC_RELAXED) != seq);
+
+	if (id != cgid || pathlen >= CGRPFS_SHM_PATHMAX || pathlen >= len)
+		return -1;
+
+	return pathlen;
+}
+
+#endif /* CGRPFS_SHM_H_ */
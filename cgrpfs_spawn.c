@@ -0,0 +1,150 @@
+/*
+ * cgrpfs-spawn: run a command with its initial CGroup already set.
+ *
+ * The helper attaches itself to the given CGroup over the control socket and
+ * only then executes the command, so the command is in its CGroup from its
+ * first instruction and any children it forks are tracked there too. This
+ * is the equivalent of Linux's CLONE_INTO_CGROUP: a service manager forks,
+ * and in the child execs cgrpfs-spawn (or performs the same single request
+ * itself) instead of forking, then writing the child's PID to cgroup.procs.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs_proto.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: cgrpfs-spawn [-p] [-m mode] -c cgroup -- command [arg ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Append a batch operation on path to the request buffer. */
+static size_t
+addop(char *buf, size_t off, size_t size, uint16_t type, const char *path)
+{
+	struct cgrpfs_batch_op *op = (struct cgrpfs_batch_op *)(buf + off);
+	size_t len = (sizeof *op + strlen(path) + 1 + 7) & ~(size_t)7;
+
+	if (len > UINT16_MAX || off + len > size)
+		errx(EXIT_FAILURE, "CGroup path too long");
+
+	memset(op, 0, len);
+	op->type = type;
+	op->len = len;
+	op->uid = (uint32_t)-1;
+	op->gid = (uint32_t)-1;
+	strcpy((char *)(op + 1), path);
+
+	return off + len;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char buf[CGRPFS_CTL_MSGMAX];
+	struct sockaddr_un sun = { .sun_family = AF_UNIX,
+		.sun_path = CGRPFS_CONTROL_PATH };
+	struct cgrpfs_ctl_req *req = (struct cgrpfs_ctl_req *)buf;
+	struct cgrpfs_ctl_reply *reply = (struct cgrpfs_ctl_reply *)buf;
+	struct cgrpfs_batch_op *op;
+	const char *cgroup = NULL;
+	bool create = false;
+	mode_t mode = 0755;
+	size_t off = sizeof *req;
+	ssize_t len;
+	int32_t *results;
+	char *end;
+	long val;
+	int fd, ch;
+
+	while ((ch = getopt(argc, argv, "c:m:p")) != -1) {
+		switch (ch) {
+		case 'c':
+			cgroup = optarg;
+			break;
+		case 'm':
+			/* octal permission bits, as for chmod */
+			val = strtol(optarg, &end, 8);
+			if (end == optarg || *end != '\0' || val < 0 ||
+				val > 07777)
+				usage();
+			mode = val;
+			break;
+		case 'p':
+			create = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (!cgroup || argc < 1)
+		usage();
+
+	memset(req, 0, sizeof *req);
+	req->op = CGRPFS_OP_BATCH;
+	req->flags = CGRPFS_BATCH_STOP;
+
+	if (create) {
+		op = (struct cgrpfs_batch_op *)(buf + off);
+		off = addop(buf, off, sizeof buf, CGRPFS_BOP_MKDIR, cgroup);
+		op->mode = mode;
+		req->count++;
+	}
+
+	op = (struct cgrpfs_batch_op *)(buf + off);
+	off = addop(buf, off, sizeof buf, CGRPFS_BOP_ATTACH, cgroup);
+	op->pid = getpid();
+	req->count++;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		err(EXIT_FAILURE, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, SUN_LEN(&sun)) < 0)
+		err(EXIT_FAILURE, "connect %s", sun.sun_path);
+
+	if (send(fd, buf, off, 0) < 0)
+		err(EXIT_FAILURE, "send");
+
+	len = recv(fd, buf, sizeof buf, 0);
+	if (len < 0)
+		err(EXIT_FAILURE, "recv");
+	else if ((size_t)len < sizeof *reply)
+		errx(EXIT_FAILURE, "Short reply from cgrpfs");
+
+	if (reply->error) {
+		errno = reply->error;
+		err(EXIT_FAILURE, "Batch failed");
+	}
+
+	results = (int32_t *)(reply + 1);
+	if ((size_t)len < sizeof *reply + reply->count * sizeof *results)
+		errx(EXIT_FAILURE, "Short reply from cgrpfs");
+	for (uint32_t i = 0; i < reply->count; i++)
+		if (results[i] != 0) {
+			errno = results[i];
+			err(EXIT_FAILURE, "Failed to %s %s",
+				create && i == 0 ? "create" : "attach to", cgroup);
+		}
+
+	close(fd);
+
+	execvp(argv[0], argv);
+	err(EXIT_FAILURE, "exec %s", argv[0]);
+}
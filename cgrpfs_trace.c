@@ -0,0 +1,122 @@
+/*
+ * Recording of traces; see cgrpfs_trace.h.
+ *
+ * Tracing is enabled by naming the trace file in the CGRPFS_TRACE environment
+ * variable. Records are buffered, and the buffer is flushed on exit.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cgrpfs.h"
+#include "cgrpfs_trace.h"
+
+/* most bytes of a write to record */
+#define TRACE_WRITEMAX 1024
+
+static FILE *tracef;
+static struct timespec tracestart;
+
+void
+trace_init(const char *path)
+{
+	struct cgrpfs_trace_hdr hdr = { CGRPFS_TRACE_MAGIC,
+		CGRPFS_TRACE_VERSION, cgmgr.epoch };
+
+	if (!path || *path == '\0')
+		return;
+
+	if ((tracef = fopen(path, "we")) == NULL) {
+		warn("Failed to open trace file %s", path);
+		return;
+	}
+
+	setvbuf(tracef, NULL, _IOFBF, 1024 * 1024);
+	clock_gettime(CLOCK_MONOTONIC, &tracestart);
+
+	if (fwrite(&hdr, sizeof hdr, 1, tracef) != 1) {
+		warn("Failed to write trace file %s", path);
+		fclose(tracef);
+		tracef = NULL;
+		return;
+	}
+
+	cgmgr.tracing = true;
+}
+
+/* Write a record with up to two pieces of data. */
+static void
+writerec(uint16_t type, int32_t pid, int32_t arg, const void *data1,
+	size_t len1, const void *data2, size_t len2)
+{
+	static const char pad[8];
+	struct cgrpfs_trace_rec rec;
+	struct timespec now;
+	size_t len;
+
+	/* the length must fit in 16 bits; paths never get near that */
+	len = sizeof rec + len1 + len2;
+	if (len + 7 > UINT16_MAX)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&rec, 0, sizeof rec);
+	rec.ts = (uint64_t)(now.tv_sec - tracestart.tv_sec) * 1000000000 +
+		now.tv_nsec - tracestart.tv_nsec;
+	rec.type = type;
+	rec.len = (len + 7) & ~(size_t)7;
+	rec.pid = pid;
+	rec.arg = arg;
+
+	if (fwrite(&rec, sizeof rec, 1, tracef) != 1 ||
+		(len1 && fwrite(data1, len1, 1, tracef) != 1) ||
+		(len2 && fwrite(data2, len2, 1, tracef) != 1) ||
+		(rec.len != len && fwrite(pad, rec.len - len, 1, tracef) != 1)) {
+		warn("Failed to write trace; tracing stopped");
+		fclose(tracef);
+		tracef = NULL;
+		cgmgr.tracing = false;
+	}
+}
+
+void
+trace_event(const cg_event_t *ev)
+{
+	switch (ev->kind) {
+	case CGE_FORK:
+		writerec(CGRPFS_TR_FORK, ev->ident, ev->data, NULL, 0, NULL, 0);
+		break;
+	case CGE_EXIT:
+		writerec(CGRPFS_TR_EXIT, ev->ident, ev->data, NULL, 0, NULL, 0);
+		break;
+	case CGE_TIMER:
+		writerec(CGRPFS_TR_TIMER, ev->ident, 0, NULL, 0, NULL, 0);
+		break;
+	case CGE_TRACKERR:
+		writerec(CGRPFS_TR_TRACKERR, 0, 0, NULL, 0, NULL, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+trace_op(enum cgrpfs_trace_type type, const char *path, int32_t arg,
+	const void *data, size_t len)
+{
+	/* only renames and writes have data after the path */
+	if (type == CGRPFS_TR_RENAME)
+		len = strlen(data) + 1;
+	else if (type == CGRPFS_TR_WRITE)
+		arg = len = len > TRACE_WRITEMAX ? TRACE_WRITEMAX : len;
+	else
+		len = 0;
+
+	writerec(type, 0, arg, path, strlen(path) + 1, data, len);
+}
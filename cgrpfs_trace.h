@@ -0,0 +1,68 @@
+/*
+ * Binary trace of the events and filesystem operations processed by CGrpFS.
+ *
+ * A trace is a header followed by records. Each record is a fixed part,
+ * followed by its data and padded to a multiple of 8 bytes. All values are in
+ * host byte order, so a trace is replayed on the kind of machine it was
+ * recorded on.
+ */
+
+#ifndef CGRPFS_TRACE_H_
+#define CGRPFS_TRACE_H_
+
+#include <stdint.h>
+
+#define CGRPFS_TRACE_MAGIC 0x43475452 /* "CGTR" */
+#define CGRPFS_TRACE_VERSION 1
+
+/*
+ * Snapshots and journals of the saved state (see cgrpfs_persist.c) have the
+ * same header and records, with these magic numbers; the epoch in their header
+ * is the generation of the snapshot, which a journal must match to apply.
+ */
+#define CGRPFS_SNAPSHOT_MAGIC 0x4347534e /* "CGSN" */
+#define CGRPFS_JOURNAL_MAGIC 0x43474a4e /* "CGJN" */
+
+struct cgrpfs_trace_hdr {
+	uint32_t magic; /* CGRPFS_TRACE_MAGIC */
+	uint32_t version; /* CGRPFS_TRACE_VERSION */
+	uint64_t epoch; /* of the run which recorded it */
+};
+
+enum cgrpfs_trace_type {
+	/* events; pid is the PID or timer, arg the parent PID or wait status */
+	CGRPFS_TR_FORK = 1,
+	CGRPFS_TR_EXIT,
+	CGRPFS_TR_TIMER,
+	CGRPFS_TR_TRACKERR,
+	/* operations; data is a path, NUL-terminated, and then as noted */
+	CGRPFS_TR_MKDIR, /* arg is the mode */
+	CGRPFS_TR_RMDIR,
+	CGRPFS_TR_RENAME, /* followed by the new path, NUL-terminated */
+	CGRPFS_TR_WRITE, /* followed by the arg bytes written */
+	CGRPFS_TR_READ, /* the file's contents were generated */
+	/* saved state only */
+	CGRPFS_TR_CHMOD, /* arg is the mode */
+	CGRPFS_TR_CHOWN, /* pid is the owner, arg the group */
+	/*
+	 * pid was attached to the CGroup at path; in a snapshot, data is
+	 * empty and arg is the index of the CGroup's MKDIR, or 0 for the root
+	 */
+	CGRPFS_TR_ATTACH,
+	/*
+	 * in a handoff, pid and arg are the high and low halves of the ID of
+	 * the CGroup of the last MKDIR, or of the root CGroup before any
+	 */
+	CGRPFS_TR_CGID,
+};
+
+struct cgrpfs_trace_rec {
+	uint64_t ts; /* nanoseconds since the trace began; 0 in saved state */
+	uint16_t type; /* enum cgrpfs_trace_type */
+	uint16_t len; /* of the record, including data and padding */
+	int32_t pid;
+	int32_t arg;
+	uint32_t reserved;
+};
+
+#endif /* CGRPFS_TRACE_H_ */
@@ -9,6 +9,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void
 setaccessed(cg_node_t *node)
@@ -16,6 +18,26 @@ setaccessed(cg_node_t *node)
 	node->accessed++;
 }
 
+/*
+ * Record an operation on the file name within node (or node itself if name is
+ * NULL) in the trace.
+ */
+static void
+tracenode(enum cgrpfs_trace_type type, cg_node_t *node, const char *name,
+	int32_t arg, const void *data, size_t len)
+{
+	char *path = nodefullpath(node), *full = NULL;
+
+	if (!path)
+		return;
+	if (name)
+		asprintf(&full, "%s/%s", node->parent ? path : "", name);
+
+	trace_op(type, full ? full : path, arg, data, len);
+	free(full);
+	free(path);
+}
+
 static int
 nodevtype(cg_node_t *node)
 {
@@ -24,6 +46,16 @@ nodevtype(cg_node_t *node)
 	case CGN_PROCS: /* cgroup.procs file */
 	case CGN_RELEASE_AGENT: /* release_agent file */
 	case CGN_NOTIFY_ON_RELEASE: /* notify_on_release file */
+	case CGN_KILL: /* cgroup.kill file */
+	case CGN_FREEZE: /* cgroup.freeze file */
+	case CGN_PIDS_CURRENT: /* pids.current file */
+	case CGN_PIDS_MAX: /* pids.max file */
+	case CGN_PIDS_EVENTS: /* pids.events file */
+	case CGN_CPU_STAT: /* cpu.stat file */
+	case CGN_MEMORY_CURRENT: /* memory.current file */
+	case CGN_STAT: /* cgroup.stat file */
+	case CGN_AUTOREMOVE: /* cgroup.autoremove file */
+	case CGN_DAEMON_STATS: /* cgrpfs.stats file */
 	case CGN_PID_CGROUP:
 		return VREG;
 
@@ -41,7 +73,6 @@ int
 cgrpfs_node_lookup(struct puffs_usermount *pu, void *opc,
 	struct puffs_newinfo *pni, const struct puffs_cn *pcn)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)opc, *file;
 
 	if (PCNISDOTDOT(pcn)) {
@@ -84,18 +115,27 @@ cgrpfs_node_mkdir(struct puffs_usermount *pu, void *opc,
 	struct puffs_newinfo *pni, const struct puffs_cn *pcn,
 	const struct vattr *va)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node_parent = (cg_node_t *)opc;
 	cg_node_t *node_new;
 	uid_t uid;
 	gid_t gid;
 
+	if (cgmgr.tracing)
+		tracenode(CGRPFS_TR_MKDIR, node_parent, pcn->pcn_name,
+			va->va_mode & 07777, NULL, 0);
+
 	if (node_parent->type != CGN_CG_DIR)
 		return EOPNOTSUPP;
 
 	if (lookupfile(node_parent, pcn->pcn_name) != NULL)
 		return EEXIST;
 
+	/* keep what memory is left for tracking processes */
+	if (reserve_low()) {
+		reserve_stats.mkdirrefused++;
+		return ENOSPC;
+	}
+
 	assert(puffs_cred_getuid(pcn->pcn_cred, &uid) == 0);
 	assert(puffs_cred_getgid(pcn->pcn_cred, &gid) == 0);
 
@@ -103,6 +143,8 @@ cgrpfs_node_mkdir(struct puffs_usermount *pu, void *opc,
 	// from vattr.
 	node_new = newcgdir(node_parent, pcn->pcn_name, va->va_mode & 07777,
 		uid, gid);
+	if (!node_new)
+		return ENOMEM;
 
 	setaccessed(node_new);
 	puffs_newinfo_setcookie(pni, node_new);
@@ -114,9 +156,11 @@ int
 cgrpfs_node_rmdir(struct puffs_usermount *pu, void *opc, void *targ,
 	const struct puffs_cn *pcn)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)targ;
 
+	if (cgmgr.tracing)
+		tracenode(CGRPFS_TR_RMDIR, node, NULL, 0, NULL, 0);
+
 	if (node->type != CGN_CG_DIR || node == cgmgr.rootnode)
 		return -ENOTSUP;
 
@@ -130,7 +174,6 @@ int
 cgrpfs_node_access(struct puffs_usermount *pu, void *opc, int acc_mode,
 	const struct puffs_cred *pcr)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)opc;
 
 	return puffs_access(nodevtype(node), node->attr.st_mode & 07777,
@@ -141,7 +184,6 @@ int
 cgrpfs_node_getattr(struct puffs_usermount *pu, void *opc, struct vattr *va,
 	const struct puffs_cred *pcred)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)opc;
 
 	puffs_stat2vattr(va, &node->attr);
@@ -153,7 +195,6 @@ int
 cgrpfs_node_setattr(struct puffs_usermount *pu, void *opc,
 	const struct vattr *va, const struct puffs_cred *pcr)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)opc;
 	int rv;
 
@@ -170,6 +211,7 @@ cgrpfs_node_setattr(struct puffs_usermount *pu, void *opc,
 			node->attr.st_uid = va->va_uid;
 		if (va->va_gid != PUFFS_VNOVAL)
 			node->attr.st_gid = va->va_gid;
+		nodeattrchanged(node);
 	}
 
 	if (va->va_mode != PUFFS_VNOVAL) {
@@ -179,6 +221,7 @@ cgrpfs_node_setattr(struct puffs_usermount *pu, void *opc,
 			return rv;
 		node->attr.st_mode &= ~(07777);
 		node->attr.st_mode |= va->va_mode & 07777;
+		nodeattrchanged(node);
 	}
 
 	if ((va->va_atime.tv_sec != PUFFS_VNOVAL &&
@@ -210,7 +253,6 @@ cgrpfs_node_setattr(struct puffs_usermount *pu, void *opc,
 int
 cgrpfs_node_poll(struct puffs_usermount *pu, void *opc, int *revents)
 {
-	CGMGR_LOCKED;
 	*revents &= POLLIN | POLLHUP;
 	return EOPNOTSUPP;
 }
@@ -220,7 +262,6 @@ cgrpfs_node_readdir(struct puffs_usermount *pu, void *opc, struct dirent *dent,
 	off_t *readoff, size_t *reslen, const struct puffs_cred *pcr,
 	int *eofflag, off_t *cookies, size_t *ncookies)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = (cg_node_t *)opc;
 	cg_node_t *subnode; /* iterator */
 	int i = 0;
@@ -276,11 +317,23 @@ cgrpfs_node_rename(struct puffs_usermount *pu, void *opc, void *src,
 	const struct puffs_cn *pcn_src, void *targ_dir, void *targ,
 	const struct puffs_cn *pcn_targ)
 {
-	CGMGR_LOCKED;
 	cg_node_t *cgn_sdir = opc;
 	cg_node_t *cgn_sfile = src;
 	cg_node_t *cgn_tdir = targ_dir;
 	/* Target file doesn't matter. It doesn't exist yet. */
+	char *oldname;
+
+	if (cgmgr.tracing) {
+		char *newpath = nodefullpath(cgn_tdir), *full;
+
+		if (newpath && asprintf(&full, "%s/%s",
+				   cgn_tdir->parent ? newpath : "",
+				   pcn_targ->pcn_name) >= 0) {
+			tracenode(CGRPFS_TR_RENAME, cgn_sfile, NULL, 0, full, 0);
+			free(full);
+		}
+		free(newpath);
+	}
 
 	if (cgn_sdir != cgn_tdir)
 		return EPERM; /* only rename within same dir */
@@ -289,8 +342,12 @@ cgrpfs_node_rename(struct puffs_usermount *pu, void *opc, void *src,
 
 	// TODO: double check source still exists?
 
-	free(cgn_sfile->name);
+	oldname = cgn_sfile->name;
 	cgn_sfile->name = strdup(pcn_targ->pcn_name);
+	shm_setcgtree(cgn_sfile);
+	if (cgmgr.persisting)
+		persist_rename(cgn_sfile, oldname);
+	free(oldname);
 
 	return 0;
 }
@@ -299,25 +356,29 @@ int
 cgrpfs_node_read(struct puffs_usermount *pu, void *opc, uint8_t *buf,
 	off_t offset, size_t *resid, const struct puffs_cred *pcr, int ioflag)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = opc;
 	char *txt;
 	size_t maxlen;
 
+	if (cgmgr.tracing)
+		tracenode(CGRPFS_TR_READ, node, NULL, 0, NULL, 0);
+
 	txt = nodetxt(node);
 
 	if (!txt)
 		return ENOMEM;
 
 	maxlen = strlen(txt);
-	if (offset > maxlen)
+	if (offset > maxlen) {
+		free(txt);
 		return 0;
-	else if (*resid < maxlen - offset)
+	} else if (*resid < maxlen - offset)
 		maxlen = *resid;
 	else
 		maxlen -= offset;
 
 	memcpy(buf, txt + offset, maxlen);
+	free(txt);
 
 	*resid -= maxlen;
 
@@ -328,25 +389,23 @@ int
 cgrpfs_node_write(struct puffs_usermount *pu, void *opc, uint8_t *buf,
 	off_t offset, size_t *resid, const struct puffs_cred *pcr, int ioflag)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = opc;
+	cg_cred_t cred;
+	int r;
 
-	if (node->type == CGN_PROCS) {
-		long pid;
-		int r;
+	if (cgmgr.tracing)
+		tracenode(CGRPFS_TR_WRITE, node, NULL, 0, buf, *resid);
 
-		if (sscanf((const char *)buf, "%ld\n", &pid) < 1)
-			return -EINVAL;
+	assert(puffs_cred_getuid(pcr, &cred.uid) == 0);
+	assert(puffs_cred_getgid(pcr, &cred.gid) == 0);
 
-		r = attachpid(node->parent, pid);
-		if (r < 0)
-			return -r;
+	r = nodewrite(node, (const char *)buf, *resid, &cred);
+	if (r < 0)
+		return -r;
 
-		*resid = 0;
+	*resid = 0;
 
-		return 0;
-	} else
-		return ENODEV;
+	return 0;
 }
 
 int
@@ -359,7 +418,6 @@ cgrpfs_node_inactive(struct puffs_usermount *pu, void *opc)
 int
 cgrpfs_node_reclaim(struct puffs_usermount *pu, void *opc)
 {
-	CGMGR_LOCKED;
 	cg_node_t *node = opc;
 
 	if (node->todel)
@@ -0,0 +1,157 @@
+/*
+ * Check that moving a process within a subtree doesn't make the CGroups it
+ * stays within seem to empty: a kill of the subtree must stay in force, and no
+ * release may be queued for a CGroup still populated.
+ *
+ * The core is driven directly, with the null event backend, as by
+ * cgrpfs-replay; the processes signalled are this test's own children.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+cgmgr_t cgmgr;
+
+static int failures;
+
+/* the test mounts no instances */
+int
+fs_mount(cg_inst_t *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+}
+
+static void
+check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+/* Fork a child which waits to be killed. */
+static pid_t
+spawn(void)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		err(EXIT_FAILURE, "fork");
+	else if (pid == 0)
+		for (;;)
+			pause();
+
+	return pid;
+}
+
+/* Write a string to a pseudo-file as the daemon. */
+static int
+writestr(const char *path, const char *val)
+{
+	cg_node_t *node = lookupnode(path, false);
+
+	if (!node)
+		errx(EXIT_FAILURE, "No %s", path);
+	return nodewrite(node, val, strlen(val), NULL);
+}
+
+/* Write a number to a pseudo-file as the daemon. */
+static int
+writeval(const char *path, long val)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof buf, "%ld", val);
+	return writestr(path, buf);
+}
+
+/*
+ * Was a child killed? It's given a second to die, then reaped in any case, so
+ * that one which escaped a kill fails the test rather than hanging it.
+ */
+static bool
+killed(pid_t pid)
+{
+	int status;
+
+	for (int i = 0; i < 100; i++) {
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			return WIFSIGNALED(status) &&
+			    WTERMSIG(status) == SIGKILL;
+		usleep(10000);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return false;
+}
+
+int
+main(void)
+{
+	cg_node_t *a, *b;
+	pid_t child, late;
+
+	cgmgr_initstate();
+
+	if (mkcgdirs(cgmgr.rootnode, "a/b", 0755, getuid(), getgid(), &b) < 0)
+		errx(EXIT_FAILURE, "Failed to make the subtree");
+	a = b->parent;
+
+	/* a PID moved from a/b to a while a is being killed */
+	child = spawn();
+	if (writeval("/a/b/cgroup.procs", child) < 0 ||
+	    writeval("/a/cgroup.kill", 1) < 0)
+		errx(EXIT_FAILURE, "Failed to kill the subtree");
+	check(a->killing && cgmgr.nkilling == 1, "kill is in progress");
+	/* its exit isn't seen by the null backend, so it's still tracked */
+	check(writeval("/a/cgroup.procs", child) == 0 && a->killing &&
+		cgmgr.nkilling == 1 && a->npids == 1 && b->npids == 0,
+	    "kill stays in force as a PID moves within the subtree");
+	check(killed(child), "moved PID is killed");
+	late = spawn();
+	check(writeval("/a/cgroup.procs", late) == 0 && killed(late),
+	    "newcomer to the subtree is killed");
+	detachpid(child, SIGKILL, false);
+	detachpid(late, SIGKILL, false);
+	check(!a->killing && cgmgr.nkilling == 0,
+	    "kill is complete once the subtree empties");
+
+	/* a PID moved from a/b to a with notify_on_release set on a */
+	if (writestr("/release_agent", "/bin/true") < 0 ||
+	    writeval("/a/notify_on_release", 1) < 0)
+		errx(EXIT_FAILURE, "Failed to set up release notification");
+	child = spawn();
+	if (writeval("/a/b/cgroup.procs", child) < 0)
+		errx(EXIT_FAILURE, "Failed to attach PID %lld",
+		    (long long)child);
+	/*
+	 * The spawner isn't started, so a release queued now would still be
+	 * queued when a empties, and the one queued then would coalesce with
+	 * it.
+	 */
+	check(writeval("/a/cgroup.procs", child) == 0 && a->nsubpids == 1,
+	    "PID moves within the subtree");
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	detachpid(child, SIGKILL, false);
+	check(release_stats.coalesced == 0 && release_stats.dropped == 0,
+	    "no release is queued as a PID moves within the subtree");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
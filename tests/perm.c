@@ -0,0 +1,164 @@
+/*
+ * Check that a delegatee - a user given a CGroup subtree - can neither attach,
+ * kill nor freeze a process it doesn't own.
+ *
+ * The core is driven directly, with the null event backend, as by
+ * cgrpfs-replay; the processes signalled are this test's own children.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgrpfs.h"
+
+cgmgr_t cgmgr;
+
+static int failures;
+
+/* the test mounts no instances */
+int
+fs_mount(cg_inst_t *inst)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+fs_unmount(cg_inst_t *inst)
+{
+}
+
+static void
+check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+/*
+ * Fork a child which waits to be killed, as uid if it isn't -1. Returns once
+ * the child has taken on its UID.
+ */
+static pid_t
+spawn(uid_t uid)
+{
+	int fds[2];
+	char c;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		err(EXIT_FAILURE, "pipe");
+	else if ((pid = fork()) < 0)
+		err(EXIT_FAILURE, "fork");
+	else if (pid == 0) {
+		if (uid != (uid_t)-1 && setuid(uid) < 0)
+			_exit(EXIT_FAILURE);
+		write(fds[1], "", 1);
+		for (;;)
+			pause();
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &c, 1) != 1)
+		errx(EXIT_FAILURE, "Child %lld failed", (long long)pid);
+	close(fds[0]);
+
+	return pid;
+}
+
+/* Write a number to a pseudo-file as a writer. */
+static int
+writeval(const char *path, long val, const cg_cred_t *cred)
+{
+	char buf[32];
+	cg_node_t *node = lookupnode(path, false);
+
+	if (!node)
+		errx(EXIT_FAILURE, "No %s", path);
+	snprintf(buf, sizeof buf, "%ld", val);
+	return nodewrite(node, buf, strlen(buf), cred);
+}
+
+/* Which CGroup is a PID in? */
+static cg_node_t *
+pidnode(pid_t pid)
+{
+	pid_hash_entry_t *entry;
+	uintptr_t pidp = pid;
+
+	HASH_FIND_PTR(cgmgr.pidcg, &pidp, entry);
+	return entry ? entry->node : NULL;
+}
+
+static bool
+alive(pid_t pid)
+{
+	return waitpid(pid, NULL, WNOHANG) == 0;
+}
+
+int
+main(void)
+{
+	cg_cred_t self = { getuid(), getgid() };
+	cg_cred_t deleg = { getuid() + 1, getgid() + 1 };
+	cg_node_t *dir, *sub;
+	pid_t child;
+	int status;
+
+	cgmgr_initstate();
+
+	if (mkcgdirs(cgmgr.rootnode, "deleg", 0755, deleg.uid, deleg.gid,
+		    &dir) < 0 ||
+		mkcgdirs(dir, "sub", 0755, deleg.uid, deleg.gid, &sub) < 0)
+		errx(EXIT_FAILURE, "Failed to make the delegated subtree");
+
+	child = spawn(-1);
+
+	check(writeval("/deleg/cgroup.procs", 1, &deleg) == -EPERM &&
+		pidnode(1) != dir,
+	    "delegatee can't attach PID 1");
+	check(writeval("/deleg/cgroup.procs", child, &deleg) == -EPERM &&
+		pidnode(child) != dir,
+	    "delegatee can't attach another user's process");
+
+	/* as if root had put it there */
+	check(writeval("/deleg/sub/cgroup.procs", child, NULL) == 0 &&
+		pidnode(child) == sub,
+	    "daemon can attach any process");
+	check(writeval("/deleg/cgroup.kill", 1, &deleg) == -EPERM &&
+		alive(child),
+	    "delegatee can't kill another user's process");
+	check(writeval("/deleg/cgroup.freeze", 1, &deleg) == -EPERM &&
+		!sub->frozen && !dir->frozen,
+	    "delegatee can't freeze another user's process");
+
+	if (getuid() == 0) {
+		pid_t own = spawn(deleg.uid);
+
+		check(writeval("/deleg/cgroup.procs", own, NULL) == 0 &&
+			writeval("/deleg/sub/cgroup.procs", own, &deleg) == 0 &&
+			pidnode(own) == sub,
+		    "delegatee can move its own process within its subtree");
+		check(writeval("/cgroup.procs", own, &deleg) == -EACCES &&
+			pidnode(own) == sub,
+		    "delegatee can't move its own process out of its subtree");
+		kill(own, SIGKILL);
+		waitpid(own, NULL, 0);
+	}
+
+	check(writeval("/deleg/cgroup.kill", 1, &self) == 0 &&
+		waitpid(child, &status, 0) == child && WIFSIGNALED(status) &&
+		WTERMSIG(status) == SIGKILL,
+	    "owner can kill its own process");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}